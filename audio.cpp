@@ -2,17 +2,69 @@
 
 #include <stdint.h>
 #include <stdio.h>
-#include <math.h>
 #include <AL/al.h>
 #include <AL/alc.h>
+#ifndef __EMSCRIPTEN__
+#include <algorithm>
+#include <chrono>
+#endif
 
-Audio::Audio()
+DeviceAudio::DeviceAudio()
+{
+#ifndef __EMSCRIPTEN__
+  streamer = std::thread([this]
+  {
+    while (!closing && !failed)
+    {
+      pump();
+      std::this_thread::sleep_for(next_wake());
+    }
+  });
+#endif
+}
+
+DeviceAudio::~DeviceAudio()
+{
+#ifndef __EMSCRIPTEN__
+  closing = true;
+  if (streamer.joinable())
+    streamer.join();
+#endif
+  if (ok)
+  {
+    alSourceStop(source);
+    alSourcei(source, AL_BUFFER, 0);
+    alDeleteSources(1, &source);
+    alDeleteBuffers(buffer_count, buffers);
+  }
+  alcMakeContextCurrent(NULL);
+  if (ctx)
+    alcDestroyContext(ctx);
+  if (dev)
+    alcCloseDevice(dev);
+}
+
+void DeviceAudio::tick(bool on)
+{
+  if (failed.load(std::memory_order_relaxed))
+    return;
+  // If the streamer is a whole ring behind, the tick is dropped
+  ticks.push(on);
+#ifdef __EMSCRIPTEN__
+  pump();
+#endif
+}
+
+// Called by the streaming side on the first rising edge, so a run that
+// never beeps never opens the device. Returns false, after printing why,
+// if there's nothing to play on.
+bool DeviceAudio::open()
 {
   dev = alcOpenDevice(NULL);
   if (!dev)
   {
     fprintf(stderr, "no device\n");
-    return;
+    return false;
   }
 
   ctx = alcCreateContext(dev, NULL);
@@ -20,45 +72,103 @@ Audio::Audio()
   if (!ctx)
   {
     fprintf(stderr, "no context\n");
-    return;
+    return false;
   }
 
-  int16_t buf[bufferSize];
-
-  for (int i=0; i<bufferSize; i++)
-  {
-    buf[i] = 0x7fff*sin(2*M_PI*((double)i/(double)bufferSize));
-  }
-
-  alGenBuffers(1, &buffer);
+  alGenBuffers(buffer_count, buffers);
   alGenSources(1, &source);
   if (alGetError() != AL_NO_ERROR)
   {
     fprintf(stderr, "error generating buffers\n");
-    return;
+    return false;
   }
-
-  alBufferData(buffer, AL_FORMAT_MONO16, buf, bufferSize, 44100);
-
-  alSourcei(source, AL_BUFFER, buffer);
-  alSourcei(source, AL_LOOPING, AL_TRUE);
+  for (unsigned int i=0; i<buffer_count; i++)
+    free_buffers[i] = buffers[i];
+  free_count = buffer_count;
+  ok = true;
+  return true;
 }
 
-Audio::~Audio()
+// Queue the ticks waiting in the ring, as far as there are buffers free
+void DeviceAudio::pump()
 {
-  alDeleteSources(1, &source);
-  alDeleteBuffers(1, &buffer);
-  alcMakeContextCurrent(NULL);
-  alcDestroyContext(ctx);
-  alcCloseDevice(dev);
+  if (streaming)
+  {
+    ALint processed = 0;
+    alGetSourcei(source, AL_BUFFERS_PROCESSED, &processed);
+    for (; processed > 0; processed--)
+      alSourceUnqueueBuffers(source, 1, &free_buffers[free_count++]);
+  }
+
+  uint8_t on;
+  while ((!streaming || free_count > 0) && ticks.pop(on))
+  {
+    if (!on && !last_on)
+      continue; // Still silent; the source runs dry by itself
+    if (!streaming)
+    {
+      if (!ok && !open())
+      {
+        // Carry on silently; tick() drops everything from now on
+        failed = true;
+        return;
+      }
+      // Rising edge. A tick of silence goes first, so the source has
+      // something to play while the next tick is on its way.
+      streaming = true;
+      queue(false);
+    }
+    queue(on);
+    last_on = on;
+  }
+
+  if (streaming)
+  {
+    ALint state;
+    alGetSourcei(source, AL_SOURCE_STATE, &state);
+    if (state == AL_PLAYING)
+      return;
+    if (free_count == buffer_count)
+    {
+      // Everything queued has played: the tone was stopped, or the
+      // emulator stalled and it starts again from its next rising edge
+      streaming = false;
+      last_on = false;
+    }
+    else
+    {
+      alSourcePlay(source);
+    }
+  }
 }
 
-void Audio::play()
+// Render a tick of the tone and queue it
+void DeviceAudio::queue(bool on)
 {
-  alSourcePlay(source);
+  tone.render(samples, on);
+  ALuint buffer = free_buffers[--free_count];
+  alBufferData(buffer, AL_FORMAT_MONO16, samples, sizeof(samples), Tone::sample_rate);
+  alSourceQueueBuffers(source, 1, &buffer);
 }
 
-void Audio::stop()
+#ifndef __EMSCRIPTEN__
+// OpenAL has no way to wait for a buffer to finish, so the streamer
+// sleeps until the one playing is due to. While streaming, the emulator
+// stays about a tick ahead of the device (see the lead-in in pump()), so
+// the next tick is already waiting then; the wait is capped at half a tick
+// in case it was late. While silent it only has the ring to watch, and
+// checks it every idle_poll, which bounds how late a beep can start:
+// idle_poll plus the lead-in tick, under 19ms.
+std::chrono::microseconds DeviceAudio::next_wake() const
 {
-  alSourcePause(source);
+  const std::chrono::microseconds idle_poll(2000);
+  const std::chrono::microseconds half_tick(1000000/60/2);
+  if (!streaming)
+    return idle_poll;
+  ALint offset = 0;
+  alGetSourcei(source, AL_SAMPLE_OFFSET, &offset);
+  long left = (long)Tone::tick_samples - offset;
+  std::chrono::microseconds until_done(std::max(left, 1L)*1000000/Tone::sample_rate);
+  return std::min(until_done, half_tick);
 }
+#endif
@@ -1,22 +1,118 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
-#include <AL/al.h>
-#include <AL/alc.h>
+#include <stdint.h>
+#include <math.h>
 
+// Where the sound timer's tone goes. tick() is called once per timer tick
+// with whether the tone is on for it.
 class Audio
 {
-  static const int bufferSize = 200;
+public:
+  virtual ~Audio() {}
+  virtual void tick(bool on) = 0;
+};
 
-  ALCdevice *dev;
-  ALCcontext *ctx;
-  ALuint source, buffer;
+// Discards the tone, e.g. to keep a windowed run off the sound device
+class NullAudio : public Audio
+{
+public:
+  void tick(bool on) override {}
+};
 
+// The tone itself, a 441Hz sine rendered a tick at a time. Each beep
+// starts at the start of a cycle and carries on smoothly across ticks.
+class Tone
+{
 public:
-  Audio();
-  ~Audio();
-  void play();
-  void stop();
+  static const unsigned int sample_rate = 44100;
+  static const unsigned int tick_samples = sample_rate/60;
+
+  Tone()
+  {
+    for (unsigned int i=0; i<period; i++)
+      cycle[i] = 0x7fff*sin(2*M_PI*((double)i/(double)period));
+  }
+
+  void render(int16_t *out, bool on)
+  {
+    for (unsigned int i=0; i<tick_samples; i++)
+    {
+      out[i] = on ? cycle[phase] : 0;
+      phase = on ? (phase + 1) % period : 0;
+    }
+  }
+
+private:
+  static const unsigned int period = 100; // Samples
+  int16_t cycle[period];
+  unsigned int phase = 0;
 };
 
+#ifndef CHIP8_HEADLESS
+
+#include <AL/al.h>
+#include <AL/alc.h>
+#include <atomic>
+#ifndef __EMSCRIPTEN__
+#include <chrono>
+#include <thread>
+#endif
+#include "handoff.h"
+
+// Plays the tone on the sound device, through OpenAL. Headless builds
+// don't link against it.
+//
+// tick() only queues the tone's state in a lock-free ring. A thread of its
+// own opens the device on the first rising edge, then turns each tick into
+// 1/60 sec of samples and streams them to OpenAL, so the emulator never
+// calls into the driver and the tone starts and stops on the exact sample
+// of a tick boundary. While the tone is off nothing is streamed, so
+// OpenAL is only called from a rising edge until the tick after the
+// falling one has played. Under Emscripten, which has no threads here,
+// tick() does the streaming itself.
+class DeviceAudio : public Audio
+{
+public:
+  DeviceAudio();
+  ~DeviceAudio();
+  DeviceAudio(const DeviceAudio &) = delete;
+  DeviceAudio &operator=(const DeviceAudio &) = delete;
+
+  void tick(bool on) override;
+
+private:
+  static const unsigned int buffer_count = 4; // A tick each
+
+  ALCdevice *dev = nullptr;
+  ALCcontext *ctx = nullptr;
+  ALuint source = 0;
+  ALuint buffers[buffer_count];
+  bool ok = false;                  // The device is open
+  std::atomic<bool> failed{false};  // It couldn't be, so ticks are dropped
+
+  SpscQueue<uint8_t, 64> ticks; // Tone on or off, a tick each
+
+  // Only touched by the streaming side
+  ALuint free_buffers[buffer_count];
+  unsigned int free_count = 0;
+  bool streaming = false;
+  bool last_on = false;
+  Tone tone;
+  int16_t samples[Tone::tick_samples];
+
+  bool open();
+  void pump();
+  void queue(bool on);
+
+#ifndef __EMSCRIPTEN__
+  std::atomic<bool> closing{false};
+  std::thread streamer;
+
+  std::chrono::microseconds next_wake() const;
+#endif
+};
+
+#endif
+
 #endif
@@ -0,0 +1,178 @@
+#include "batch.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+Batch::Batch(unsigned int instances, const Chip8 &settings, unsigned int threads)
+{
+  if (threads == 0)
+    threads = std::thread::hardware_concurrency();
+  if (threads == 0)
+    threads = 1;
+  if (threads > instances)
+    threads = instances;
+  this->threads = threads;
+
+  for (unsigned int i=0; i<instances; i++)
+  {
+    Chip8 *c = new Chip8();
+    c->dispatch = settings.dispatch;
+    c->quirks = settings.quirks;
+    c->fusion = settings.fusion;
+    c->idle_skip = settings.idle_skip;
+    c->instructions_per_step = settings.instructions_per_step;
+    c->muted = true;
+    cores.emplace_back(c);
+  }
+  for (unsigned int t=0; t<threads; t++)
+    queues.emplace_back(new Queue());
+}
+
+void Batch::loadProgram(char *rom)
+{
+  // The file is read once, and shared
+  cores[0]->loadProgram(rom);
+  for (unsigned int i=1; i<cores.size(); i++)
+    cores[i]->loadProgram(*cores[0]);
+}
+
+void Batch::loadProgram(const PackedRom &rom)
+{
+  for (auto &c : cores)
+    c->loadProgram(rom.data, rom.size, rom.name);
+}
+
+void Batch::loadProgram(const RomPack &pack)
+{
+  for (unsigned int i=0; i<cores.size(); i++)
+  {
+    const PackedRom &rom = pack[i % pack.size()];
+    cores[i]->loadProgram(rom.data, rom.size, rom.name);
+  }
+}
+
+bool Batch::next(unsigned int thread, unsigned int &instance, bool &stolen)
+{
+  // Take from the front of our own queue, or failing that steal from the
+  // back of another thread's
+  for (unsigned int i=0; i<threads; i++)
+  {
+    Queue &q = *queues[(thread + i) % threads];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.instances.empty())
+      continue;
+    if (i == 0)
+    {
+      instance = q.instances.front();
+      q.instances.pop_front();
+    }
+    else
+    {
+      instance = q.instances.back();
+      q.instances.pop_back();
+    }
+    stolen = i != 0;
+    return true;
+  }
+  return false;
+}
+
+void Batch::worker(unsigned int thread, uint64_t frames, uint64_t &stolen)
+{
+  // Counts are kept locally and written back once, as the threads'
+  // counters and neighbouring instances' ran share cache lines
+  uint64_t steals = 0;
+  unsigned int instance;
+  bool was_stolen;
+  while (next(thread, instance, was_stolen))
+  {
+    // An instance which halts or faults is retired, having run the frames
+    // up to and including the one it stopped in
+    Chip8 &c = *cores[instance];
+    uint64_t f = ran[instance];
+    uint64_t end = std::min(frames, f + chunk_frames);
+    bool running = true;
+    while (running && f < end)
+    {
+      f++;
+      running = c.step() == Chip8::Status::Running;
+    }
+    ran[instance] = f;
+    if (was_stolen)
+      steals++;
+    if (running && f < frames)
+    {
+      // Back on the front of our queue, to carry on with it while it's in
+      // the cache, but where an idle thread can steal the rest of it
+      Queue &q = *queues[thread];
+      std::lock_guard<std::mutex> guard(q.lock);
+      q.instances.push_front(instance);
+    }
+  }
+  stolen = steals;
+}
+
+void Batch::run(uint64_t frames)
+{
+  // Deal the instances out round-robin; stealing evens out the rest
+  ran.assign(cores.size(), 0);
+  uint64_t executed_before = 0;
+  for (auto &c : cores)
+    executed_before += c->instructions_run - c->idle_instructions;
+  for (unsigned int i=0; i<cores.size(); i++)
+    queues[i % threads]->instances.push_back(i);
+
+  std::vector<uint64_t> stolen(threads, 0);
+  std::vector<std::thread> pool;
+
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned int t=0; t<threads; t++)
+  {
+    pool.emplace_back(&Batch::worker, this, t, frames, std::ref(stolen[t]));
+#ifdef __linux__
+    // Pin each thread to its own core so instances stay cache-warm
+    unsigned int cpus = std::thread::hardware_concurrency();
+    if (cpus)
+    {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(t % cpus, &set);
+      pthread_setaffinity_np(pool.back().native_handle(), sizeof(set), &set);
+    }
+#endif
+  }
+  for (auto &t : pool)
+    t.join();
+  auto end = std::chrono::steady_clock::now();
+
+  // Not counting instructions fast-forwarded over in idle loops
+  uint64_t instructions = 0, frames_run = 0;
+  unsigned int stopped = 0;
+  for (unsigned int i=0; i<cores.size(); i++)
+  {
+    instructions += cores[i]->instructions_run - cores[i]->idle_instructions;
+    frames_run += ran[i];
+    if (cores[i]->status != Chip8::Status::Running)
+      stopped++;
+  }
+  instructions -= executed_before;
+  uint64_t steals = 0;
+  for (uint64_t s : stolen)
+    steals += s;
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  printf("Executed %llu instructions in %llu frames on %u instances (%u threads, %llu stolen)\n",
+         (unsigned long long)instructions, (unsigned long long)frames,
+         size(), threads, (unsigned long long)steals);
+  printf("Elapsed time: %.3f s (%.0f instructions/sec, %.0f frames/sec)\n",
+         seconds, instructions/seconds, frames_run/seconds);
+  if (stopped)
+    printf("%u instances halted or faulted before the end\n", stopped);
+}
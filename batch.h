@@ -0,0 +1,56 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "chip8.h"
+#include "rompack.h"
+
+// Runs many independent Chip8 instances at once, spread across all hardware
+// threads. Each thread has its own queue of instances to run and steals from
+// the back of the others' queues once its own is empty, so the load stays
+// balanced when some ROMs are more expensive than others. Instances run
+// chunk_frames frames at a time, so a thread left with one long instance
+// can have the rest of it stolen too.
+class Batch
+{
+public:
+  // Instances take their settings (dispatch, quirks...) from settings.
+  // threads = 0 uses one per hardware thread.
+  Batch(unsigned int instances, const Chip8 &settings, unsigned int threads = 0);
+
+  void loadProgram(char *rom);
+  void loadProgram(const PackedRom &rom);
+  // Deal out every ROM in pack to the instances in turn
+  void loadProgram(const RomPack &pack);
+
+  // Run every instance for frames frames, or until it halts or faults,
+  // and report the aggregate instructions/sec
+  void run(uint64_t frames);
+
+  Chip8 &instance(unsigned int i) { return *cores[i]; }
+  unsigned int size() const { return cores.size(); }
+
+private:
+  struct Queue
+  {
+    std::mutex lock;
+    std::deque<unsigned int> instances;
+  };
+
+  static const uint64_t chunk_frames = 64; // Frames run between steals
+
+  std::vector<std::unique_ptr<Chip8>> cores;
+  std::vector<uint64_t> ran; // Frames each instance ran in the last run()
+  std::vector<std::unique_ptr<Queue>> queues; // One per thread
+  unsigned int threads;
+
+  bool next(unsigned int thread, unsigned int &instance, bool &stolen);
+  void worker(unsigned int thread, uint64_t frames, uint64_t &stolen);
+};
+
+#endif
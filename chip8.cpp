@@ -1,5 +1,7 @@
 #include "chip8.h"
 #include "font_loader.h"
+#include "movie.h"
+#include "rewind.h"
 
 #include <istream>
 #include <fstream>
@@ -7,632 +9,1615 @@
 #include <vector>
 #include <string.h>
 
-#define GLEW_STATIC
-#include <GL/glew.h>
-#include <GLFW/glfw3.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#ifdef __EMSCRIPTEN__
-#include <emscripten.h>
-#endif
+void Chip8::loadProgram(char *rom)
+{
+  std::ifstream program(rom, std::ios::binary);
+  if (!program.is_open())
+  {
+    fprintf(stderr, "Couldn't load ROM from '%s'\n", rom);
+    abort();
+  }
+  std::vector<uint8_t> *file = new std::vector<uint8_t>(0x1000-0x200);
+  program.read(reinterpret_cast<char *>(file->data()), file->size());
+  file->resize(program.gcount());
+  rom_file.reset(file);
+  rom_name = rom;
+  this->rom = file->data();
+  rom_size = file->size();
+  load_rom();
+}
+
+void Chip8::loadProgram(const uint8_t *data, size_t size, const char *name)
+{
+  rom_file.reset();
+  rom_name = name;
+  rom = data;
+  rom_size = size;
+  load_rom();
+}
+
+void Chip8::loadProgram(const Chip8 &other)
+{
+  rom_file = other.rom_file;
+  rom_name = other.rom_name;
+  rom = other.rom;
+  rom_size = other.rom_size;
+  load_rom();
+}
+
+void Chip8::load_rom()
+{
+  // Anything past 0xFFF doesn't fit, and the rest of memory is cleared
+  size_t size = rom_size < 0x1000-0x200 ? rom_size : 0x1000-0x200;
+  static const uint8_t zeros[0x1000-0x200] = {};
+  memory.load(0x200, size, rom);
+  memory.load(0x200 + size, 0x1000-0x200 - size, zeros);
+
+  // 5-bit (4x5 pixel) font
+  uint8_t font[] = {0xf0, 0x90, 0x90, 0x90, 0xf0, // 0
+                    0x20, 0x60, 0x20, 0x20, 0x70, // 1
+                    0xf0, 0x10, 0xf0, 0x80, 0xf0, // 2
+                    0xf0, 0x10, 0xf0, 0x10, 0xf0, // 3
+                    0x90, 0x90, 0xf0, 0x10, 0x10, // 4
+                    0xf0, 0x80, 0xf0, 0x10, 0xf0, // 5
+                    0xf0, 0x80, 0xf0, 0x90, 0xf0, // 6
+                    0xf0, 0x10, 0x20, 0x40, 0x40, // 7
+                    0xf0, 0x90, 0xf0, 0x90, 0xf0, // 8
+                    0xf0, 0x90, 0xf0, 0x10, 0xf0, // 9
+                    0xf0, 0x90, 0xf0, 0x90, 0x90, // A
+                    0xe0, 0x90, 0xe0, 0x90, 0xe0, // B
+                    0xf0, 0x80, 0x80, 0x80, 0xf0, // C
+                    0xe0, 0x90, 0x90, 0x90, 0xe0, // D
+                    0xf0, 0x80, 0xf0, 0x80, 0xf0, // E
+                    0xf0, 0x80, 0xf0, 0x80, 0x80};// F
+  memory.load(0x100, 16*5, font);
+
+  // 10-bit (8*10) font, built once
+  static const std::vector<uint8_t> font10 = load_font();
+  memory.load(0x150, 10*10, font10.data());
+
+  invalidate_decode_cache();
+  if (jit)
+    jit->flush();
+  status = Status::Running;
+}
+
+void Chip8::reset()
+{
+  reg.PC = 0x200;
+  reg.SP = 0;
+  memset(display, 0, sizeof(display));
+  mark_display();
+  load_rom();
+}
+
+bool Chip8::begin_frame()
+{
+  Input in;
+  while (input.pop(in))
+  {
+    switch (in.type)
+    {
+      case Input::Key:    keys[in.key] = in.pressed; break;
+      case Input::Reset:  reset_requested = true; break;
+      case Input::Rewind: rewinding = in.pressed; break;
+    }
+  }
+
+  // Movies can't be rewound, since the recorded inputs would no longer
+  // line up
+  if (rewinder && rewinding && !recorder && !player)
+  {
+    bool pressed[16];
+    memcpy(pressed, keys, sizeof(keys));
+    rewinder->rewind(*this, 1);
+    memcpy(keys, pressed, sizeof(keys));
+    return false;
+  }
+  if (player)
+    player->frame(*this);
+  if (recorder)
+    recorder->frame(*this, reset_requested);
+  if (reset_requested)
+  {
+    reset();
+    reset_requested = false;
+  }
+  if (rewinder)
+    rewinder->push(*this);
+  return true;
+}
+
+//
+// Save states. The layout is fixed, little-endian and versioned:
+//
+//   0     "C8ST" version:u16 header_size:u16
+//   8     flags:u8 (bit 0: extendedMode) SP:u8 timerD:u8 timerS:u8
+//   12    PC:u16 I:u16 V:u8[16] hp_48_flags:u8[8] rng:u32 keys:u16
+//   64    memory, 4KB
+//   4160  display, 128x64 at 1 bit per pixel, 16 bytes per row, MSB leftmost
+//
+// Later versions may grow the header; header_size says where memory
+// starts. Memory is copied straight out of the buffer, so a state can be
+// loaded from a mapped file with no parsing.
+//
+// Version 1 states, from before the two displays became one framebuffer,
+// can still be loaded. They hold a 64x32 display at 4160 and a 128x64 one
+// at 4416, and the one for the saved mode is used.
+//
+static const uint16_t state_version = 2;
+static const size_t state_header_size = 64;
+static const size_t state_display_size = 64*128/8;
+static const size_t state_size = state_header_size + 0x1000 + state_display_size;
+static const size_t state_v1_size = state_header_size + 0x1000 + 32*64/8 + 64*128/8;
+
+static void put16(uint8_t *p, uint16_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+// Each of the 32 pixels in bits twice over, for drawing at double size
+static inline uint64_t double_pixels(uint32_t bits)
+{
+  uint64_t x = bits;
+  x = (x | (x << 16)) & 0x0000ffff0000ffff;
+  x = (x | (x << 8)) & 0x00ff00ff00ff00ff;
+  x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0f;
+  x = (x | (x << 2)) & 0x3333333333333333;
+  x = (x | (x << 1)) & 0x5555555555555555;
+  return x | (x << 1);
+}
+
+// Rows of display words to and from bytes, leftmost pixels first
+static void put_rows(uint8_t *out, const uint64_t *rows, size_t n)
+{
+  for (size_t i=0; i<n; i++)
+  {
+    for (unsigned int b=0; b<8; b++)
+      *out++ = rows[i] >> (56 - b*8);
+  }
+}
+
+static void get_rows(uint64_t *rows, const uint8_t *in, size_t n)
+{
+  for (size_t i=0; i<n; i++)
+  {
+    uint64_t row = 0;
+    for (unsigned int b=0; b<8; b++)
+      row = (row << 8) | *in++;
+    rows[i] = row;
+  }
+}
+
+void Chip8::save_state(std::vector<uint8_t> &out) const
+{
+  out.assign(state_size, 0);
+  uint8_t *p = out.data();
+  memcpy(p, "C8ST", 4);
+  put16(p + 4, state_version);
+  put16(p + 6, state_header_size);
+  p[8] = extendedMode;
+  p[9] = reg.SP;
+  p[10] = reg.timerD;
+  p[11] = reg.timerS;
+  put16(p + 12, reg.PC);
+  put16(p + 14, reg.I);
+  memcpy(p + 16, reg.V, 16);
+  memcpy(p + 32, reg.hp_48_flags, 8);
+  put16(p + 40, rng.state & 0xffff);
+  put16(p + 42, rng.state >> 16);
+  uint16_t pressed = 0;
+  for (unsigned int k=0; k<16; k++)
+    pressed |= keys[k] << k;
+  put16(p + 44, pressed);
+
+  p += state_header_size;
+  memcpy(p, memory.data(), 0x1000);
+  p += 0x1000;
+  put_rows(p, &display[0][0], extHeight*extWidth/64);
+}
+
+bool Chip8::load_state(const uint8_t *data, size_t size)
+{
+  if (size < 8 || memcmp(data, "C8ST", 4) != 0)
+    return false;
+  uint16_t version = get16(data + 4);
+  size_t header_size = get16(data + 6);
+  size_t body_size;
+  if (version == state_version)
+    body_size = state_size - state_header_size;
+  else if (version == 1)
+    body_size = state_v1_size - state_header_size;
+  else
+    return false;
+  if (header_size < state_header_size || size != header_size + body_size)
+    return false;
+  uint32_t rng_state = get16(data + 40) | ((uint32_t)get16(data + 42) << 16);
+  if (rng_state == 0)
+    return false; // Rng never gets here, and would stay 0 forever
+
+  const uint8_t *p = data;
+  extendedMode = p[8] & 1;
+  reg.SP = p[9];
+  reg.timerD = p[10];
+  reg.timerS = p[11];
+  reg.PC = get16(p + 12);
+  reg.I = get16(p + 14);
+  memcpy(reg.V, p + 16, 16);
+  memcpy(reg.hp_48_flags, p + 32, 8);
+  rng.state = rng_state;
+  uint16_t pressed = get16(p + 44);
+  for (unsigned int k=0; k<16; k++)
+    keys[k] = (pressed >> k) & 1;
+
+  p += header_size;
+  memory.load(0, 0x1000, p);
+  p += 0x1000;
+  if (version == 1 && !extendedMode)
+  {
+    uint64_t rows[height];
+    get_rows(rows, p, height);
+    for (unsigned int y=0; y<height; y++)
+    {
+      display[y*2][0] = double_pixels(rows[y] >> 32);
+      display[y*2][1] = double_pixels(rows[y] & 0xffffffff);
+      memcpy(display[y*2 + 1], display[y*2], sizeof(display[0]));
+    }
+  }
+  else
+  {
+    if (version == 1)
+      p += 32*64/8;
+    get_rows(&display[0][0], p, extHeight*extWidth/64);
+  }
+  mark_display();
+
+  invalidate_decode_cache();
+  if (jit)
+    jit->flush();
+  status = Status::Running;
+  return true;
+}
+
+bool Chip8::save_state(const char *path) const
+{
+  std::vector<uint8_t> state;
+  save_state(state);
+  FILE *f = fopen(path, "wb");
+  if (!f)
+  {
+    fprintf(stderr, "Couldn't write state to '%s'\n", path);
+    return false;
+  }
+  bool ok = fwrite(state.data(), 1, state.size(), f) == state.size();
+  ok &= fclose(f) == 0;
+  if (!ok)
+    fprintf(stderr, "Couldn't write state to '%s'\n", path);
+  return ok;
+}
+
+bool Chip8::load_state(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    fprintf(stderr, "Couldn't load state from '%s'\n", path);
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  void *m = st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  bool ok = m != MAP_FAILED && load_state(static_cast<const uint8_t *>(m), st.st_size);
+  if (m != MAP_FAILED)
+    munmap(m, st.st_size);
+  if (!ok)
+    fprintf(stderr, "'%s' is not a valid save state\n", path);
+  return ok;
+}
+
+//
+// Checkpoints
+//
+static_assert(Chip8Memory::lines == 64, "memory lines must fit in a uint64_t mask");
+
+void Chip8::set_base()
+{
+  Image *image = new Image;
+  memcpy(image->memory, memory.data(), sizeof(image->memory));
+  memcpy(image->display, display, sizeof(display));
+  base.reset(image);
+  memory.clean();
+  display_dirty = 0;
+}
+
+void Chip8::checkpoint(Checkpoint &out) const
+{
+  if (!base)
+  {
+    fprintf(stderr, "checkpoint() needs a base image from set_base()\n");
+    abort();
+  }
+  out.reg = reg;
+  out.extendedMode = extendedMode;
+  out.rng = rng.state;
+  memcpy(out.keys, keys, sizeof(keys));
+  out.base = base;
+
+  const unsigned int line_size = Chip8Memory::line_size;
+  out.memory_lines = 0;
+  out.data.clear();
+  for (unsigned int l=0; l<Chip8Memory::lines; l++)
+  {
+    if (!memory.dirty(l))
+      continue;
+    out.memory_lines |= (uint64_t)1 << l;
+    const uint8_t *line = memory.data() + l*line_size;
+    out.data.insert(out.data.end(), line, line + line_size);
+  }
+  out.rows.clear();
+  out.display_rows = display_dirty;
+  for (unsigned int y=0; y<extHeight; y++)
+  {
+    if ((display_dirty >> y) & 1)
+      out.rows.insert(out.rows.end(), display[y], display[y] + extWidth/64);
+  }
+}
+
+bool Chip8::restore(const Checkpoint &cp)
+{
+  if (!cp.base)
+  {
+    fprintf(stderr, "restore() needs a checkpoint with a base image\n");
+    abort();
+  }
+  if (cp.rng == 0)
+    return false;
+  reg = cp.reg;
+  extendedMode = cp.extendedMode;
+  rng.state = cp.rng;
+  memcpy(keys, cp.keys, sizeof(keys));
+  restore_from(cp.base, cp.memory_lines, cp.display_rows, cp.data.data(),
+               cp.rows.data(), nullptr);
+  return true;
+}
+
+void Chip8::fork(const Chip8 &from)
+{
+  reg = from.reg;
+  extendedMode = from.extendedMode;
+  rng = from.rng;
+  memcpy(keys, from.keys, sizeof(keys));
+  rom_name = from.rom_name;
+  rom = from.rom;
+  rom_size = from.rom_size;
+  rom_file = from.rom_file;
+  if (!from.base)
+  {
+    // Nothing to share, so copy everything
+    base.reset();
+    memory.load(0, 0x1000, from.memory.data());
+    memcpy(display, from.display, sizeof(display));
+    mark_display();
+    invalidate_decode_cache();
+    if (jit)
+      jit->flush();
+    return;
+  }
+  uint64_t memory_lines = 0;
+  for (unsigned int l=0; l<Chip8Memory::lines; l++)
+    memory_lines |= (uint64_t)from.memory.dirty(l) << l;
+  restore_from(from.base, memory_lines, from.display_dirty, nullptr, nullptr,
+               &from);
+}
+
+void Chip8::restore_from(const std::shared_ptr<const Image> &from_base,
+                         uint64_t memory_lines, uint64_t display_rows,
+                         const uint8_t *data, const uint64_t *rows,
+                         const Chip8 *from)
+{
+  // Lines and rows are copied from data and rows in order, or straight
+  // from another Chip8.
+  // Lines dirty here but not there go back to the base.
+  status = Status::Running;
+  if (base != from_base)
+  {
+    base = from_base;
+    memory.load(0, 0x1000, base->memory);
+    memcpy(display, base->display, sizeof(display));
+    memory.clean();
+    display_dirty = 0;
+    invalidate_decode_cache();
+    if (jit)
+      jit->flush();
+  }
+
+  const unsigned int line_size = Chip8Memory::line_size;
+  for (unsigned int l=0; l<Chip8Memory::lines; l++)
+  {
+    const uint8_t *src;
+    if ((memory_lines >> l) & 1)
+    {
+      src = from ? from->memory.data() + l*line_size : data;
+      if (!from)
+        data += line_size;
+    }
+    else if (memory.dirty(l))
+    {
+      src = base->memory + l*line_size;
+    }
+    else
+    {
+      continue;
+    }
+    unsigned int address = l*line_size;
+    if (memcmp(memory.data() + address, src, line_size) == 0)
+      continue;
+    memory.load(address, line_size, src);
+    for (unsigned int slot=address/2; slot<(address+line_size)/2; slot++)
+      invalidate_slot(slot);
+    if (jit)
+    {
+      for (unsigned int a=address; a<address+line_size; a++)
+        jit->invalidate(a);
+    }
+  }
+  memory.clean();
+  for (unsigned int l=0; l<Chip8Memory::lines; l++)
+  {
+    if ((memory_lines >> l) & 1)
+      memory.mark_range(l*line_size, line_size);
+  }
+
+  for (unsigned int y=0; y<extHeight; y++)
+  {
+    const uint64_t *src;
+    if ((display_rows >> y) & 1)
+    {
+      src = from ? from->display[y] : rows;
+      if (!from)
+        rows += extWidth/64;
+    }
+    else if ((display_dirty >> y) & 1)
+    {
+      src = base->display[y];
+    }
+    else
+    {
+      continue;
+    }
+    memcpy(display[y], src, sizeof(display[y]));
+  }
+  display_dirty = display_rows;
+  changed_rows = ~(uint64_t)0;
+}
+
+template <class Q>
+inline unsigned int Chip8::execute_cached(unsigned int budget)
+{
+  // Execute the next instruction, or a superinstruction if one starts here
+  // and fits in budget. Returns the number of instructions executed.
+  uint16_t pc = reg.PC;
+  if (pc & 0xf001)
+  {
+    // Odd or out of range PC - decode without caching
+    MicroOp op = decode_op<Q>(memory.get16(pc));
+    reg.PC += 2;
+    op.handler(*this, op);
+    return 1;
+  }
+  MicroOp *op = &decode_cache[pc >> 1];
+  if (!op->handler)
+    decode_slot<Q>(pc >> 1);
+  if (op->fused && fusions[op->fused].length <= budget)
+  {
+    unsigned int n = fusions[op->fused].run(*this, op, budget);
+    fused_instructions[op->fused] += n;
+    return n;
+  }
+  reg.PC += 2;
+  op->handler(*this, *op);
+  return 1;
+}
+
+template <class Q>
+void Chip8::step(unsigned int budget)
+{
+  update_timers();
+  // Halting or faulting ends the frame early
+  unsigned int i = 0; // Instructions run this frame
+  switch (dispatch)
+  {
+    case Dispatch::Switch:
+      for (; i<budget && status == Status::Running; i++)
+      {
+        //printf("fetch: 0x%08X\n", reg.PC);
+        uint16_t instruction = memory.get16(reg.PC);
+        reg.PC += 2;
+        //printf("execute: %04X\n", instruction);
+        execute<Q>(instruction);
+        //print_registers();
+        //print_screen();
+        //getchar();
+      }
+      break;
+    case Dispatch::Table:
+      {
+        const Handler *table = handler_table<Q>();
+        for (; i<budget && status == Status::Running; i++)
+        {
+          uint16_t instruction = memory.get16(reg.PC);
+          reg.PC += 2;
+          MicroOp op = operands(instruction);
+          table[instruction](*this, op);
+        }
+        break;
+      }
+    case Dispatch::Cached:
+      for (; i<budget && status == Status::Running; )
+        i += execute_cached<Q>(budget - i);
+      break;
+    case Dispatch::Jit:
+      {
+        if (!jit)
+          jit.reset(new Jit());
+        // Blocks are sized for the setting, not this frame's budget, so
+        // a varying budget doesn't retranslate them every frame
+        jit->set_max_instructions(instructions_per_step);
+        jit->set_quirks(quirk_flags<Q>());
+        while (i < budget && status == Status::Running)
+        {
+          // Run whole translated blocks while they fit in this frame, and
+          // interpret anything the JIT can't translate
+          const Jit::Block *block = jit->block(reg.PC, memory);
+          if (block && block->instructions <= budget - i)
+          {
+            block->code(&reg);
+            i += block->instructions;
+          }
+          else
+          {
+            i += execute_cached<Q>(budget - i);
+          }
+        }
+        break;
+      }
+  }
+  instructions_run += i;
+}
+
+//
+// Instruction handlers, shared by every dispatch method
+//
+struct Ops
+{
+  typedef Chip8::MicroOp MicroOp;
+
+  static void unknown(Chip8 &c, const MicroOp &op)
+  {
+    c.status = Chip8::Status::Faulted;
+    c.reg.PC -= 2;
+  }
+
+  static void scd(Chip8 &c, const MicroOp &op)
+  {
+    // SUPER-CHIP
+    // 00CN - SCD nibble
+    // Scroll display N lines down
+    // In the normal mode, N of its lines (two rows each)
+    unsigned int n = c.extendedMode ? op.n : op.n*2;
+    memmove(c.display[n], c.display[0], sizeof(c.display[0])*(Chip8::extHeight - n));
+    memset(c.display, 0, sizeof(c.display[0])*n);
+    c.mark_display();
+  }
+
+  static void cls(Chip8 &c, const MicroOp &op)
+  {
+    // 00E0 - CLS
+    // Clear the display
+    memset(c.display, 0, sizeof(c.display));
+    c.mark_display();
+  }
+
+  static void ret(Chip8 &c, const MicroOp &op)
+  {
+    // 00EE - RET
+    // Return from a subroutine
+    c.reg.PC = c.memory.get16(c.reg.SP);
+    c.reg.SP -= 2;
+  }
+
+  static void scr(Chip8 &c, const MicroOp &op)
+  {
+    // SUPER-CHIP
+    // 00FB - SCR
+    // Scroll display 4 pixels right
+    unsigned int n = c.extendedMode ? 4 : 8;
+    for (auto &row : c.display)
+    {
+      row[1] = (row[1] >> n) | (row[0] << (64 - n));
+      row[0] >>= n;
+    }
+    c.mark_display();
+  }
+
+  static void scl(Chip8 &c, const MicroOp &op)
+  {
+    // SUPER-CHIP
+    // 00FC - SCL
+    // Scroll display 4 pixels left
+    unsigned int n = c.extendedMode ? 4 : 8;
+    for (auto &row : c.display)
+    {
+      row[0] = (row[0] << n) | (row[1] >> (64 - n));
+      row[1] <<= n;
+    }
+    c.mark_display();
+  }
+
+  static void exit(Chip8 &c, const MicroOp &op)
+  {
+    // SUPER-CHIP
+    // 00FD - EXIT
+    // Exit interpreter
+    c.status = Chip8::Status::Halted;
+    c.reg.PC -= 2;
+  }
+
+  static void low(Chip8 &c, const MicroOp &op)
+  {
+    // SUPER-CHIP
+    // 00FE - LOW
+    // Disable extended screen mode
+    c.extendedMode = false;
+  }
+
+  static void high(Chip8 &c, const MicroOp &op)
+  {
+    // SUPER-CHIP
+    // 00FF - HIGH
+    // Enable extended screen mode for full-screen graphics
+    c.extendedMode = true;
+  }
+
+  static void jp(Chip8 &c, const MicroOp &op)
+  {
+    // 1nnn - JP addr
+    // Jump to location nnn
+    c.reg.PC = op.nnn;
+  }
+
+  static void call(Chip8 &c, const MicroOp &op)
+  {
+    // 2nnn - CALL addr
+    // Call subroutine at nnn
+    c.reg.SP += 2;
+    c.write16(c.reg.SP, c.reg.PC);
+    c.reg.PC = op.nnn;
+  }
+
+  static void se_vx_byte(Chip8 &c, const MicroOp &op)
+  {
+    // 3xkk - SE Vx, byte
+    // Skip next instruction if Vx = kk
+    unsigned int x = op.x;
+    unsigned int kk = op.kk;
+    if (c.reg.V[x] == kk)
+      c.reg.PC += 2;
+  }
+
+  static void sne_vx_byte(Chip8 &c, const MicroOp &op)
+  {
+    // 4xkk - SNE Vx, byte
+    // Skip next instruction if Vx != kk
+    unsigned int x = op.x;
+    unsigned int kk = op.kk;
+    if (c.reg.V[x] != kk)
+      c.reg.PC += 2;
+  }
+
+  static void se_vx_vy(Chip8 &c, const MicroOp &op)
+  {
+    // 5xy0 - SE Vx, Vy
+    // Skip next instruction if Vx = Vy
+    unsigned int x = op.x;
+    unsigned int y = op.y;
+    if (c.reg.V[x] == c.reg.V[y])
+      c.reg.PC += 2;
+  }
+
+  static void ld_vx_byte(Chip8 &c, const MicroOp &op)
+  {
+    // 6xkk - LD Vx, byte
+    // Set Vx = kk
+    unsigned int x = op.x;
+    unsigned int kk = op.kk;
+    c.reg.V[x] = kk;
+  }
+
+  static void add_vx_byte(Chip8 &c, const MicroOp &op)
+  {
+    // 7xkk - ADD Vx, byte
+    // Set Vx = Vx + kk
+    unsigned int x = op.x;
+    unsigned int kk = op.kk;
+    c.reg.V[x] += kk;
+  }
+
+  // 8xyo - (o) Vx, Vy
+  // Set Vx = Vx (o) Vy
+
+  static void ld_vx_vy(Chip8 &c, const MicroOp &op)
+  {
+    // 8xy0 - LD Vx, Vy
+    unsigned int x = op.x;
+    unsigned int y = op.y;
+    c.reg.V[x] = c.reg.V[y];
+  }
+
+  static void or_vx_vy(Chip8 &c, const MicroOp &op)
+  {
+    // 8xy1 - OR Vx, Vy
+    unsigned int x = op.x;
+    unsigned int y = op.y;
+    c.reg.V[x] |= c.reg.V[y];
+  }
+
+  static void and_vx_vy(Chip8 &c, const MicroOp &op)
+  {
+    // 8xy2 - AND Vx, Vy
+    unsigned int x = op.x;
+    unsigned int y = op.y;
+    c.reg.V[x] &= c.reg.V[y];
+  }
+
+  static void xor_vx_vy(Chip8 &c, const MicroOp &op)
+  {
+    // 8xy3 - XOR Vx, Vy
+    unsigned int x = op.x;
+    unsigned int y = op.y;
+    c.reg.V[x] ^= c.reg.V[y];
+  }
+
+  static void add_vx_vy(Chip8 &c, const MicroOp &op)
+  {
+    // 8xy4 - ADD Vx, Vy
+    unsigned int x = op.x;
+    unsigned int y = op.y;
+    if (c.reg.V[x] > 0xff - c.reg.V[y])
+      c.reg.V[0xf] = 1;
+    else
+      c.reg.V[0xf] = 0;
+    c.reg.V[x] += c.reg.V[y];
+  }
+
+  static void sub_vx_vy(Chip8 &c, const MicroOp &op)
+  {
+    // 8xy5 - SUB Vx, Vy
+    unsigned int x = op.x;
+    unsigned int y = op.y;
+    if (c.reg.V[x] < c.reg.V[y])
+      c.reg.V[0xf] = 0;
+    else
+      c.reg.V[0xf] = 1;
+    c.reg.V[x] -= c.reg.V[y];
+  }
+
+  template <class Q>
+  static void shr_vx(Chip8 &c, const MicroOp &op)
+  {
+    // 8xy6 - SHR Vx {, Vy}
+    unsigned int x = op.x;
+    unsigned int from = Q::shift_vy ? op.y : op.x;
+    c.reg.V[0xf] = c.reg.V[from] & 0x01;
+    c.reg.V[x] = c.reg.V[from] >> 1;
+  }
+
+  static void subn_vx_vy(Chip8 &c, const MicroOp &op)
+  {
+    // 8xy7 - SUBN Vx, Vy
+    unsigned int x = op.x;
+    unsigned int y = op.y;
+    if (c.reg.V[y] < c.reg.V[x])
+      c.reg.V[0xf] = 0;
+    else
+      c.reg.V[0xf] = 1;
+    c.reg.V[x] = c.reg.V[y] - c.reg.V[x];
+  }
+
+  template <class Q>
+  static void shl_vx(Chip8 &c, const MicroOp &op)
+  {
+    // 8xyE - SHL Vx {, Vy}
+    unsigned int x = op.x;
+    unsigned int from = Q::shift_vy ? op.y : op.x;
+    c.reg.V[0xf] = Q::original_vf ? 0 : c.reg.V[from] >> 7;
+    c.reg.V[x] = c.reg.V[from] << 1;
+  }
+
+  static void sne_vx_vy(Chip8 &c, const MicroOp &op)
+  {
+    // 9xy0 - SNE Vx, Vy
+    // Skip next instruction if Vx != Vy
+    unsigned int x = op.x;
+    unsigned int y = op.y;
+    if (c.reg.V[x] != c.reg.V[y])
+      c.reg.PC += 2;
+  }
+
+  static void ld_i_addr(Chip8 &c, const MicroOp &op)
+  {
+    // Annn - LD I, addr
+    // Set I = nnn
+    c.reg.I = op.nnn;
+  }
+
+  template <class Q>
+  static void jp_v0_addr(Chip8 &c, const MicroOp &op)
+  {
+    // Bnnn - JP V0, addr
+    // Jump to location nnn + V0 (SUPER-CHIP: Bxnn jumps to xnn + Vx)
+    c.reg.PC = c.reg.V[Q::jump_vx ? op.x : 0] + op.nnn;
+  }
+
+  static void rnd_vx_byte(Chip8 &c, const MicroOp &op)
+  {
+    // Cxkk - RND Vx, byte
+    // Set Vx = random byte AND kk
+    unsigned int x = op.x;
+    unsigned int kk = op.kk;
+    unsigned int r = c.rng.byte();
+    c.reg.V[x] = r & kk;
+  }
+
+  // Screen position of the sprite pixel offset pixels from v, on an axis
+  // size pixels long. Returns false if the pixel is clipped.
+  template <class Q>
+  static bool sprite_position(unsigned int v, unsigned int offset, unsigned int size, unsigned int &pos)
+  {
+    if (Q::clip_sprites)
+    {
+      pos = v%size + offset;
+      return pos < size;
+    }
+    pos = (v + offset)%size;
+    return true;
+  }
+
+  // XOR one row of a sprite into a display row Words words wide, at x.
+  // bits holds the sprite row left-aligned: bit 63 is its leftmost pixel.
+  // Returns true if it turned off a pixel.
+  template <class Q, unsigned int Words>
+  static bool draw_row(uint64_t *row, uint64_t bits, unsigned int x)
+  {
+    unsigned int w = x / 64;
+    unsigned int shift = x % 64;
+    uint64_t left = bits >> shift;
+    uint64_t right = shift ? bits << (64 - shift) : 0; // Spills into the next word
+    bool collision = (row[w] & left) != 0;
+    row[w] ^= left;
+    if (w + 1 < Words || !Q::clip_sprites)
+    {
+      // Without clipping, spilling off the right edge wraps to the left
+      uint64_t &next = row[(w + 1) % Words];
+      collision |= (next & right) != 0;
+      next ^= right;
+    }
+    return collision;
+  }
+
+  // Dxyn the original way (see QuirkFlags::original_vf), for when VF is x
+  // or y: a pixel at a time, each placed from the registers as they are
+  // when it's drawn. Sprites always wrap.
+  static void drw_original(Chip8 &c, const MicroOp &op)
+  {
+    auto &reg = c.reg;
+    reg.V[0xf] = 0;
+    bool big = c.extendedMode && op.n == 0;
+    unsigned int rows = big ? 16 : op.n;
+    unsigned int cols = big ? 16 : 8;
+    unsigned int w = c.extendedMode ? Chip8::extWidth : Chip8::width;
+    unsigned int h = c.extendedMode ? Chip8::extHeight : Chip8::height;
+    unsigned int scale = c.extendedMode ? 1 : 2; // Display pixels per pixel
+    for (unsigned int row=0; row<rows; row++)
+    {
+      uint16_t bits = big ? c.memory.get16(reg.I + row*2) : c.memory.get8(reg.I + row) << 8;
+      for (unsigned int col=0; col<cols; col++)
+      {
+        if (!(bits & (0x8000 >> col)))
+          continue;
+        unsigned int px = (reg.V[op.x] + col)%w * scale;
+        unsigned int py = (reg.V[op.y] + row)%h * scale;
+        uint64_t mask = (uint64_t)1 << (63 - px%64);
+        if (c.display[py][px/64] & mask)
+          reg.V[0xf] = 1;
+        for (unsigned int i=0; i<scale; i++)
+        {
+          for (unsigned int j=0; j<scale; j++)
+            c.display[py + i][(px + j)/64] ^= mask >> j;
+          c.display_dirty |= (uint64_t)1 << (py + i);
+          c.changed_rows |= (uint64_t)1 << (py + i);
+        }
+      }
+    }
+  }
+
+  template <class Q>
+  static void drw(Chip8 &c, const MicroOp &op)
+  {
+    // Dxyn - DRW Vx, Vy, nibble
+    // Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision
+    // SUPER-CHIP If N=0 and extended mode, show 16x16 sprite.
+    if (Q::original_vf && (op.x == 0xf || op.y == 0xf))
+    {
+      drw_original(c, op);
+      return;
+    }
+    auto &reg = c.reg;
+    unsigned int vx = reg.V[op.x];
+    unsigned int vy = reg.V[op.y];
+    unsigned int n = op.n;
+    bool collision = false;
+    uint64_t touched = 0; // Rows drawn on
+    if (c.extendedMode)
+    {
+      // A 16x16 sprite if n is 0, otherwise n rows of 8
+      unsigned int rows = n ? n : 16;
+      for (unsigned int row=0; row<rows; row++)
+      {
+        uint64_t bits;
+        if (n == 0)
+          bits = (uint64_t)c.memory.get16(reg.I + row*2) << 48;
+        else
+          bits = (uint64_t)c.memory.get8(reg.I + row) << 56;
+        unsigned int py;
+        if (!bits || !sprite_position<Q>(vy, row, Chip8::extHeight, py))
+          continue;
+        collision |= draw_row<Q, 2>(c.display[py], bits, vx % Chip8::extWidth);
+        touched |= (uint64_t)1 << py;
+      }
+    }
+    else
+    {
+      // Each pixel is a 2x2 block: the row doubled horizontally, drawn twice
+      unsigned int x = (vx % Chip8::width)*2;
+      for (unsigned int row=0; row<n; row++)
+      {
+        uint64_t bits = (uint64_t)double_pixels(c.memory.get8(reg.I + row)) << 48;
+        unsigned int py;
+        if (!bits || !sprite_position<Q>(vy, row, Chip8::height, py))
+          continue;
+        collision |= draw_row<Q, 2>(c.display[py*2], bits, x);
+        collision |= draw_row<Q, 2>(c.display[py*2 + 1], bits, x);
+        touched |= (uint64_t)3 << py*2;
+      }
+    }
+    c.display_dirty |= touched;
+    c.changed_rows |= touched;
+    reg.V[0xf] = collision;
+  }
+
+  static void skp_vx(Chip8 &c, const MicroOp &op)
+  {
+    // Ex9E - SKP Vx
+    // Skip next instruction if key with the value of Vx is pressed
+    unsigned int x = op.x;
+    if (c.keys[c.reg.V[x]])
+      c.reg.PC += 2;
+  }
+
+  static void sknp_vx(Chip8 &c, const MicroOp &op)
+  {
+    // ExA1 - SKNP Vx
+    // Skip next instruction if key with the value of Vx is not pressed
+    unsigned int x = op.x;
+    if (!c.keys[c.reg.V[x]])
+      c.reg.PC += 2;
+  }
+
+  static void ld_vx_dt(Chip8 &c, const MicroOp &op)
+  {
+    // Fx07 - LD Vx, DT
+    // Set Vx = delay timer value
+    unsigned int x = op.x;
+    c.reg.V[x] = c.reg.timerD;
+  }
+
+  static void ld_vx_k(Chip8 &c, const MicroOp &op)
+  {
+    // Fx0A - LD Vx, K
+    // Wait for a key press, store the value of the key in Vx
+    unsigned int x = op.x;
+    bool key_pressed = false;
+    for (unsigned int i=0; i<16; i++)
+    {
+      if (c.keys[i])
+      {
+        c.reg.V[x] = i;
+        key_pressed = true;
+        break;
+      }
+    }
+    if (!key_pressed)
+      c.reg.PC -= 2; // stay on this instruction
+  }
+
+  static void ld_dt_vx(Chip8 &c, const MicroOp &op)
+  {
+    // Fx15 - LD DT, Vx
+    // Set delay timer = Vx
+    unsigned int x = op.x;
+    c.reg.timerD = c.reg.V[x];
+  }
+
+  static void ld_st_vx(Chip8 &c, const MicroOp &op)
+  {
+    // Fx18 - LD ST, Vx
+    // Set sound timer = Vx
+    unsigned int x = op.x;
+    c.reg.timerS = c.reg.V[x];
+  }
+
+  template <class Q>
+  static void add_i_vx(Chip8 &c, const MicroOp &op)
+  {
+    // Fx1E - ADD I, Vx
+    // Set I = I + Vx
+    unsigned int x = op.x;
+    if (Q::add_i_vf)
+    {
+      if (c.reg.I + c.reg.V[x] > 0xfff)
+        c.reg.V[0xf] = 1;
+      else
+        c.reg.V[0xf] = 0;
+    }
+    c.reg.I += c.reg.V[x];
+  }
 
-std::uniform_int_distribution<std::mt19937::result_type> rand_byte(0, 0xff);
-GLFWwindow *window;
-GLuint shader_program;
+  static void ld_f_vx(Chip8 &c, const MicroOp &op)
+  {
+    // Fx29 - LD F, Vx
+    // Point I to 5-byte font sprite for hex character VX
+    unsigned int x = op.x;
+    c.reg.I = 0x100 + c.reg.V[x]*5; // 0x100 is address of '0' digit
+  }
 
-void key_callback(GLFWwindow *window, int key, int scancode, int action, int mode);
+  static void ld_hf_vx(Chip8 &c, const MicroOp &op)
+  {
+    // SUPER-CHIP
+    // Fx30 - LD HF, Vx
+    // Point I to 10-byte font sprite for digit VX (0..9)
+    unsigned int x = op.x;
+    c.reg.I = 0x150 + c.reg.V[x]*10; // 0x150 is address of '0' digit
+  }
 
-void Chip8::loadProgram(char *rom)
+  static void ld_b_vx(Chip8 &c, const MicroOp &op)
+  {
+    // Fx33 - LD B, Vx
+    // Store BCD representation of Vx in memory locations I, I+1, and I+2
+    unsigned int x = op.x;
+    c.write8(c.reg.I,    c.reg.V[x]/100);
+    c.write8(c.reg.I+1, (c.reg.V[x]%100)/10);
+    c.write8(c.reg.I+2,  c.reg.V[x]%10);
+  }
+
+  template <class Q>
+  static void ld_i_vx(Chip8 &c, const MicroOp &op)
+  {
+    // Fx55 - LD [I], Vx
+    // Store registers V0 through Vx in memory starting at location I
+    unsigned int x = op.x;
+    uint16_t I = c.reg.I;
+    for (unsigned int j=0; j<=x; j++)
+    {
+      c.write8(I, c.reg.V[j]);
+      I += 1;
+    }
+    if (Q::load_store_i)
+      c.reg.I = I;
+  }
+
+  template <class Q>
+  static void ld_vx_i(Chip8 &c, const MicroOp &op)
+  {
+    // Fx65 - LD Vx, [I]
+    // Read registers V0 through Vx from memory starting at location I
+    unsigned int x = op.x;
+    uint16_t I = c.reg.I;
+    for (unsigned int j=0; j<=x; j++)
+    {
+      c.reg.V[j] = c.memory.get8(I);
+      I += 1;
+    }
+    if (Q::load_store_i)
+      c.reg.I = I;
+  }
+
+  static void ld_r_vx(Chip8 &c, const MicroOp &op)
+  {
+    // SUPER-CHIP
+    // Fx75 - LD R, Vx
+    // Store V0..VX in RPL user flags (X <= 7)
+    unsigned int x = op.x & 7;
+    for (unsigned int i=0; i<x; i++)
+    {
+      c.reg.hp_48_flags[i] = c.reg.V[i];
+    }
+  }
+
+  static void ld_vx_r(Chip8 &c, const MicroOp &op)
+  {
+    // SUPER-CHIP
+    // Fx85 - LD Vx, R
+    // Read V0..VX from RPL user flags (X <= 7)
+    unsigned int x = op.x & 7;
+    for (unsigned int i=0; i<x; i++)
+    {
+      c.reg.V[i] = c.reg.hp_48_flags[i];
+    }
+  }
+};
+
+//
+// Superinstructions. Each starts with PC at the first instruction of the
+// sequence; op[0], op[1]... are its decoded instructions, which are always
+// adjacent in decode_cache. budget is the number of instructions left in
+// the frame. The result must be exactly the same as executing the
+// instructions one by one.
+//
+struct Fused
 {
-  rom_file_name = rom;
-  std::ifstream program(rom);
-  if (!program.is_open())
+  typedef Chip8::MicroOp MicroOp;
+
+  // A loop back to start, with nothing changing in between, repeats
+  // identically for the rest of the frame: the timers and keys only change
+  // between frames. Fast-forward over its whole iterations.
+  static unsigned int idle(Chip8 &c, uint16_t start, unsigned int period, unsigned int budget)
   {
-    fprintf(stderr, "Couldn't load ROM from '%s'\n", rom);
-    abort();
+    if (c.reg.PC != start || !c.idle_skip)
+      return period;
+    unsigned int skipped = (budget - period) / period * period;
+    c.idle_instructions += skipped;
+    return period + skipped;
   }
 
-  memory.load(0x200, 0x1000-0x200, program);
+  template <bool skip_if_equal>
+  static unsigned int skip_jump(Chip8 &c, const MicroOp *op)
+  {
+    if ((c.reg.V[op[0].x] == op[0].kk) == skip_if_equal)
+    {
+      c.reg.PC += 4; // The jump is skipped, not executed
+      return 1;
+    }
+    c.reg.PC = op[1].nnn;
+    return 2;
+  }
 
-  // 5-bit (4x5 pixel) font
-  uint8_t font[] = {0xf0, 0x90, 0x90, 0x90, 0xf0, // 0
-                    0x20, 0x60, 0x20, 0x20, 0x70, // 1
-                    0xf0, 0x10, 0xf0, 0x80, 0xf0, // 2
-                    0xf0, 0x10, 0xf0, 0x10, 0xf0, // 3
-                    0x90, 0x90, 0xf0, 0x10, 0x10, // 4
-                    0xf0, 0x80, 0xf0, 0x10, 0xf0, // 5
-                    0xf0, 0x80, 0xf0, 0x90, 0xf0, // 6
-                    0xf0, 0x10, 0x20, 0x40, 0x40, // 7
-                    0xf0, 0x90, 0xf0, 0x90, 0xf0, // 8
-                    0xf0, 0x90, 0xf0, 0x10, 0xf0, // 9
-                    0xf0, 0x90, 0xf0, 0x90, 0x90, // A
-                    0xe0, 0x90, 0xe0, 0x90, 0xe0, // B
-                    0xf0, 0x80, 0x80, 0x80, 0xf0, // C
-                    0xe0, 0x90, 0x90, 0x90, 0xe0, // D
-                    0xf0, 0x80, 0xf0, 0x80, 0xf0, // E
-                    0xf0, 0x80, 0xf0, 0x80, 0x80};// F
-  memory.load(0x100, 16*5, font);
+  template <bool skip_if_equal>
+  static unsigned int cond_jump(Chip8 &c, const MicroOp *op, unsigned int budget)
+  {
+    // 3xkk/4xkk + 1nnn - conditional jump
+    uint16_t start = c.reg.PC;
+    unsigned int n = skip_jump<skip_if_equal>(c, op);
+    return n == 2 ? idle(c, start, 2, budget) : n;
+  }
 
-  // 10-bit (8*10) font
-  std::vector<uint8_t> font10 = load_font();
-  memory.load(0x150, 10*10, font10.data());
+  template <bool skip_if_equal>
+  static unsigned int add_skip_jump(Chip8 &c, const MicroOp *op, unsigned int budget)
+  {
+    // 7xkk + 3xkk/4xkk + 1nnn - counting loop
+    c.reg.V[op[0].x] += op[0].kk;
+    c.reg.PC += 2;
+    return 1 + skip_jump<skip_if_equal>(c, op+1);
+  }
+
+  template <bool skip_if_equal>
+  static unsigned int delay_skip_jump(Chip8 &c, const MicroOp *op, unsigned int budget)
+  {
+    // Fx07 + 3xkk/4xkk + 1nnn - delay timer polling
+    uint16_t start = c.reg.PC;
+    c.reg.V[op[0].x] = c.reg.timerD;
+    c.reg.PC += 2;
+    unsigned int n = 1 + skip_jump<skip_if_equal>(c, op+1);
+    return n == 3 ? idle(c, start, 3, budget) : n;
+  }
+
+  template <unsigned int n>
+  static unsigned int loads(Chip8 &c, const MicroOp *op, unsigned int budget)
+  {
+    // n * 6xkk
+    for (unsigned int i=0; i<n; i++)
+      c.reg.V[op[i].x] = op[i].kk;
+    c.reg.PC += 2*n;
+    return n;
+  }
+
+  static unsigned int jump_self(Chip8 &c, const MicroOp *op, unsigned int budget)
+  {
+    // 1nnn jumping to itself
+    return idle(c, c.reg.PC, 1, budget);
+  }
+
+  static unsigned int key_wait(Chip8 &c, const MicroOp *op, unsigned int budget)
+  {
+    // Fx0A - stays on this instruction until a key is pressed
+    uint16_t start = c.reg.PC;
+    c.reg.PC += 2;
+    Ops::ld_vx_k(c, op[0]);
+    return idle(c, start, 1, budget);
+  }
+};
+
+enum
+{
+  NotFused,
+  FusedSkipEqJump,
+  FusedSkipNeJump,
+  FusedAddSkipEqJump,
+  FusedAddSkipNeJump,
+  FusedDelaySkipEqJump,
+  FusedDelaySkipNeJump,
+  FusedLoads2,
+  FusedLoads3,
+  FusedLoads4,
+  FusedJumpSelf,
+  FusedKeyWait
+};
+
+const Chip8::Fusion Chip8::fusions[] = {
+  {nullptr,                         1, ""},
+  {Fused::cond_jump<true>,          2, "3xkk 1nnn"},
+  {Fused::cond_jump<false>,         2, "4xkk 1nnn"},
+  {Fused::add_skip_jump<true>,      3, "7xkk 3xkk 1nnn"},
+  {Fused::add_skip_jump<false>,     3, "7xkk 4xkk 1nnn"},
+  {Fused::delay_skip_jump<true>,    3, "Fx07 3xkk 1nnn"},
+  {Fused::delay_skip_jump<false>,   3, "Fx07 4xkk 1nnn"},
+  {Fused::loads<2>,                 2, "6xkk x2"},
+  {Fused::loads<3>,                 3, "6xkk x3"},
+  {Fused::loads<4>,                 4, "6xkk x4"},
+  {Fused::jump_self,                1, "1nnn to self"},
+  {Fused::key_wait,                 1, "Fx0A"},
+};
+
+uint8_t Chip8::find_fusion(unsigned int slot)
+{
+  uint16_t ins[max_fusion];
+  unsigned int n = 0;
+  for (; n<max_fusion && slot+n < 0x800; n++)
+    ins[n] = memory.get16((slot+n)*2);
+  auto op = [&](unsigned int i, uint16_t mask, uint16_t value) {
+    return i < n && (ins[i] & mask) == value;
+  };
+
+  if (idle_skip && op(0, 0xffff, 0x1000 | (slot*2)))
+    return FusedJumpSelf;
+  if (idle_skip && op(0, 0xf0ff, 0xf00a))
+    return FusedKeyWait;
+  if (op(0, 0xf000, 0x3000) && op(1, 0xf000, 0x1000))
+    return FusedSkipEqJump;
+  if (op(0, 0xf000, 0x4000) && op(1, 0xf000, 0x1000))
+    return FusedSkipNeJump;
+  if (op(0, 0xf000, 0x7000) && op(1, 0xf000, 0x3000) && op(2, 0xf000, 0x1000))
+    return FusedAddSkipEqJump;
+  if (op(0, 0xf000, 0x7000) && op(1, 0xf000, 0x4000) && op(2, 0xf000, 0x1000))
+    return FusedAddSkipNeJump;
+  if (op(0, 0xf0ff, 0xf007) && op(1, 0xf000, 0x3000) && op(2, 0xf000, 0x1000))
+    return FusedDelaySkipEqJump;
+  if (op(0, 0xf0ff, 0xf007) && op(1, 0xf000, 0x4000) && op(2, 0xf000, 0x1000))
+    return FusedDelaySkipNeJump;
+  if (op(0, 0xf000, 0x6000) && op(1, 0xf000, 0x6000))
+  {
+    if (!op(2, 0xf000, 0x6000))
+      return FusedLoads2;
+    if (!op(3, 0xf000, 0x6000))
+      return FusedLoads3;
+    return FusedLoads4;
+  }
+  return NotFused;
 }
 
-void Chip8::reset()
+template <class Q>
+void Chip8::decode_slot(unsigned int slot)
 {
-  reg.PC = 0x200;
-  reg.SP = 0;
-  memset(display, 0, width*height);
-  memset(extDisplay, 0, extWidth*extHeight);
-  loadProgram(rom_file_name);
+  MicroOp &op = decode_cache[slot];
+  op = decode_op<Q>(memory.get16(slot*2));
+  if (!fusion)
+    return;
+
+  // The rest of a superinstruction's sequence must be decoded too
+  op.fused = find_fusion(slot);
+  for (unsigned int i=1; i<fusions[op.fused].length; i++)
+  {
+    if (!decode_cache[slot+i].handler)
+      decode_cache[slot+i] = decode_op<Q>(memory.get16((slot+i)*2));
+  }
 }
 
-void Chip8::step()
+void Chip8::print_stats(uint64_t instructions)
 {
-  update_timers();
-  for (unsigned int i=0; i<instructions_per_step; i++)
+  uint64_t total = 0;
+  for (unsigned int i=1; i<sizeof(fusions)/sizeof(fusions[0]); i++)
+    total += fused_instructions[i];
+  if (total == 0)
+    return;
+
+  printf("Fused instructions in %s: %llu of %llu (%.1f%%)\n", rom_name,
+         (unsigned long long)total, (unsigned long long)instructions,
+         100.0*total/instructions);
+  if (idle_instructions)
   {
-    //printf("fetch: 0x%08X\n", reg.PC);
-    uint16_t instruction = memory.get16(reg.PC);
-    reg.PC += 2;
-    //printf("execute: %04X\n", instruction);
-    execute(instruction);
-    //print_registers();
-    //print_screen();
-    //getchar();
+    printf("  of which fast-forwarded in idle loops: %llu\n",
+           (unsigned long long)idle_instructions);
+  }
+  for (unsigned int i=1; i<sizeof(fusions)/sizeof(fusions[0]); i++)
+  {
+    if (fused_instructions[i])
+    {
+      printf("  %-16s %llu\n", fusions[i].name,
+             (unsigned long long)fused_instructions[i]);
+    }
   }
 }
 
+template <class Q>
 void Chip8::execute(uint16_t instruction)
 {
-  // Not the most efficient implementation - switch statements aren't
-  // converted to jump tables... but it's easily fast enough for
-  // Chip-8
-  uint16_t bit1 = instruction & 0xf000;
-  switch (bit1)
+  MicroOp op = operands(instruction);
+
+  // Decode with a nested switch. The compiler turns the outer switch into a
+  // jump table but the 0x0, 0x8, 0xE and 0xF groups need a second branch -
+  // see handler_table() for the single-lookup version.
+  switch (instruction & 0xf000)
   {
     case 0x0000:
       {
         if ((instruction & 0x00f0) == 0x00c0)
         {
-          // SUPER-CHIP
-          // 00CN - SCD nibble
-          // Scroll display N lines down
-          unsigned int n = (instruction & 0x000f);
-          unsigned int nr, w, h;
-          uint8_t *disp;
-          if (extendedMode)
-          {
-            w = extWidth;
-            h = extHeight;
-            disp = &extDisplay[0][0];
-          }
-          else
-          {
-            w = width;
-            h = height;
-            disp = &display[0][0];
-          }
-          nr = n*w;
-          memmove(disp + nr, disp, w*h - nr);
-          memset(disp, 0, nr);
+          Ops::scd(*this, op);
+          break;
         }
-        else
+        switch (instruction & 0x00ff)
         {
-          switch (instruction & 0x00ff)
-          {
-            case 0x00e0:
-              {
-                // 00E0 - CLS
-                // Clear the display
-                if (extendedMode)
-                {
-                  memset(extDisplay, 0, sizeof(extDisplay));
-                }
-                else
-                {
-                  memset(display, 0, sizeof(display));
-                }
-                break;
-              }
-            case 0x00ee:
-              {
-                // 00EE - RET
-                // Return from a subroutine
-                reg.PC = memory.get16(reg.SP);
-                reg.SP -= 2;
-                break;
-              }
-            case 0x00fb:
-              {
-                // SUPER-CHIP
-                // 00FB - SCR
-                // Scroll display 4 pixels right
-                unsigned int w, h;
-                uint8_t *disp;
-                if (extendedMode)
-                {
-                  w = extWidth;
-                  h = extHeight;
-                  disp = &extDisplay[0][0];
-                }
-                else
-                {
-                  w = width;
-                  h = height;
-                  disp = &display[0][0];
-                }
-                for (unsigned int i=0; i<h; i++)
-                {
-                  memmove(disp+4, disp, w-4);
-                  memset(disp, 0, 4);
-                  disp += w; // Next row
-                }
-                break;
-              }
-            case 0x00fc:
-              {
-                // SUPER-CHIP
-                // 00FC - SCL
-                // Scroll display 4 pixels left
-                unsigned int w, h;
-                uint8_t *disp;
-                if (extendedMode)
-                {
-                  w = extWidth;
-                  h = extHeight;
-                  disp = &extDisplay[0][0];
-                }
-                else
-                {
-                  w = width;
-                  h = height;
-                  disp = &display[0][0];
-                }
-                for (unsigned int i=0; i<h; i++)
-                {
-                  memmove(disp, disp+4, w-4);
-                  memset(disp+w-4, 0, 4);
-                  disp += w; // Next row
-                }
-                break;
-              }
-            case 0x00fd:
-              {
-                // SUPER-CHIP
-                // 00FE - EXIT
-                // Exit interpreter
-                printf("Exiting...\n");
-                abort(); // TODO nicer exit
-                break;
-              }
-            case 0x00fe:
-              {
-                // SUPER-CHIP
-                // 00FE - LOW
-                // Disable extended screen mode
-                extendedMode = false;
-                break;
-              }
-            case 0x00ff:
-              {
-                // SUPER-CHIP
-                // 00FF - HIGH
-                // Enable extended screen mode for full-screen graphics
-                extendedMode = true;
-                break;
-              }
-            default:
-              printf("Unknown instruction: %04X\n", instruction);
-              abort();
-          }
+          case 0x00e0: Ops::cls(*this, op); break;
+          case 0x00ee: Ops::ret(*this, op); break;
+          case 0x00fb: Ops::scr(*this, op); break;
+          case 0x00fc: Ops::scl(*this, op); break;
+          case 0x00fd: Ops::exit(*this, op); break;
+          case 0x00fe: Ops::low(*this, op); break;
+          case 0x00ff: Ops::high(*this, op); break;
+          default:     Ops::unknown(*this, op);
         }
         break;
       }
-    case 0x1000:
-      {
-        // 1nnn - JP addr
-        // Jump to location nnn
-        reg.PC = instruction & 0x0fff;
-        break;
-      }
-    case 0x2000:
-      {
-        // 2nnn - CALL addr
-        // Call subroutine at nnn
-        reg.SP += 2;
-        memory.set16(reg.SP, reg.PC);
-        reg.PC = instruction & 0x0fff;
-        break;
-      }
-    case 0x3000:
-      {
-        // 3xkk - SE Vx, byte
-        // Skip next instruction if Vx = kk
-        unsigned int x = (instruction & 0x0f00)>>8;
-        unsigned int kk = (instruction & 0x00ff);
-        if (reg.V[x] == kk)
-          reg.PC += 2;
-        break;
-      }
-    case 0x4000:
-      {
-        // 4xkk - SNE Vx, byte
-        // Skip next instruction if Vx != kk
-        unsigned int x = (instruction & 0x0f00)>>8;
-        unsigned int kk = (instruction & 0x00ff);
-        if (reg.V[x] != kk)
-          reg.PC += 2;
-        break;
-      }
-    case 0x5000:
-      {
-        // 5xy0 - SE Vx, Vy
-        // Skip next instruction if Vx = Vy
-        unsigned int x = (instruction & 0x0f00)>>8;
-        unsigned int y = (instruction & 0x00f0)>>4;
-        if (reg.V[x] == reg.V[y])
-          reg.PC += 2;
-        break;
-      }
-    case 0x6000:
-      {
-        // 6xkk - LD Vx, byte
-        // Set Vx = kk
-        unsigned int x = (instruction & 0x0f00)>>8;
-        unsigned int kk = (instruction & 0x00ff);
-        reg.V[x] = kk;
-        break;
-      }
-    case 0x7000:
-      {
-        // 7xkk - ADD Vx, byte
-        // Set Vx = Vx + kk
-        unsigned int x = (instruction & 0x0f00)>>8;
-        unsigned int kk = (instruction & 0x00ff);
-        reg.V[x] += kk;
-        break;
-      }
+    case 0x1000: Ops::jp(*this, op); break;
+    case 0x2000: Ops::call(*this, op); break;
+    case 0x3000: Ops::se_vx_byte(*this, op); break;
+    case 0x4000: Ops::sne_vx_byte(*this, op); break;
+    case 0x5000: Ops::se_vx_vy(*this, op); break;
+    case 0x6000: Ops::ld_vx_byte(*this, op); break;
+    case 0x7000: Ops::add_vx_byte(*this, op); break;
     case 0x8000:
       {
-        // 8xyo - (o) Vx, Vy
-        // Set Vx = Vx (o) Vy
-        unsigned int x = (instruction & 0x0f00)>>8;
-        unsigned int y = (instruction & 0x00f0)>>4;
         switch (instruction & 0x000f)
         {
-          case 0: // LD Vx, Vy
-            reg.V[x] = reg.V[y];
-            break;
-          case 1: // OR
-            reg.V[x] |= reg.V[y];
-            break;
-          case 2: // AND
-            reg.V[x] &= reg.V[y];
-            break;
-          case 3: // XOR
-            reg.V[x] ^= reg.V[y];
-            break;
-          case 4: // ADD
-            {
-              if (reg.V[x] > 0xff - reg.V[y])
-                reg.V[0xf] = 1;
-              else
-                reg.V[0xf] = 0;
-              reg.V[x] += reg.V[y];
-              break;
-            }
-          case 5: // SUB
-            {
-              if (reg.V[x] < reg.V[y])
-                reg.V[0xf] = 0;
-              else
-                reg.V[0xf] = 1;
-              reg.V[x] -= reg.V[y];
-              break;
-            }
-          case 6: // SHR
-            reg.V[0xf] = reg.V[x] & 0x0001;
-            reg.V[x] >>= 1;
-            break;
-          case 7: // SUBN
-            {
-              if (reg.V[y] < reg.V[x])
-                reg.V[0xf] = 0;
-              else
-                reg.V[0xf] = 1;
-              reg.V[x] = reg.V[y] - reg.V[x];
-              break;
-            }
-          case 0xe: // SHL
-            reg.V[0xf] = reg.V[x] & 0x8000;
-            reg.V[x] <<= 1;
-            break;
-          default:
-            printf("Unknown instruction: %04X\n", instruction);
-            abort();
+          case 0x0: Ops::ld_vx_vy(*this, op); break;
+          case 0x1: Ops::or_vx_vy(*this, op); break;
+          case 0x2: Ops::and_vx_vy(*this, op); break;
+          case 0x3: Ops::xor_vx_vy(*this, op); break;
+          case 0x4: Ops::add_vx_vy(*this, op); break;
+          case 0x5: Ops::sub_vx_vy(*this, op); break;
+          case 0x6: Ops::shr_vx<Q>(*this, op); break;
+          case 0x7: Ops::subn_vx_vy(*this, op); break;
+          case 0xe: Ops::shl_vx<Q>(*this, op); break;
+          default:  Ops::unknown(*this, op);
         }
         break;
       }
-    case 0x9000:
-      {
-        // 9xy0 - SNE Vx, Vy
-        // Skip next instruction if Vx != Vy
-        unsigned int x = (instruction & 0x0f00)>>8;
-        unsigned int y = (instruction & 0x00f0)>>4;
-        if (reg.V[x] != reg.V[y])
-          reg.PC += 2;
-        break;
-      }
-    case 0xa000:
+    case 0x9000: Ops::sne_vx_vy(*this, op); break;
+    case 0xa000: Ops::ld_i_addr(*this, op); break;
+    case 0xb000: Ops::jp_v0_addr<Q>(*this, op); break;
+    case 0xc000: Ops::rnd_vx_byte(*this, op); break;
+    case 0xd000: Ops::drw<Q>(*this, op); break;
+    case 0xe000:
       {
-        // Annn - LD I, addr
-        // Set I = nnn
-        reg.I = instruction & 0x0fff;
+        switch (instruction & 0x00ff)
+        {
+          case 0x009e: Ops::skp_vx(*this, op); break;
+          case 0x00a1: Ops::sknp_vx(*this, op); break;
+          default:     Ops::unknown(*this, op);
+        }
         break;
       }
-    case 0xb000:
+    case 0xf000:
       {
-        // Bnnn - JP V0, addr
-        // Jump to location nnn + V0
-        reg.PC = reg.V[0] + (instruction & 0x0fff);
+        switch (instruction & 0x00ff)
+        {
+          case 0x0007: Ops::ld_vx_dt(*this, op); break;
+          case 0x000a: Ops::ld_vx_k(*this, op); break;
+          case 0x0015: Ops::ld_dt_vx(*this, op); break;
+          case 0x0018: Ops::ld_st_vx(*this, op); break;
+          case 0x001e: Ops::add_i_vx<Q>(*this, op); break;
+          case 0x0029: Ops::ld_f_vx(*this, op); break;
+          case 0x0030: Ops::ld_hf_vx(*this, op); break;
+          case 0x0033: Ops::ld_b_vx(*this, op); break;
+          case 0x0055: Ops::ld_i_vx<Q>(*this, op); break;
+          case 0x0065: Ops::ld_vx_i<Q>(*this, op); break;
+          case 0x0075: Ops::ld_r_vx(*this, op); break;
+          case 0x0085: Ops::ld_vx_r(*this, op); break;
+          default:     Ops::unknown(*this, op);
+        }
         break;
       }
-    case 0xc000:
+  }
+}
+
+template <class Q>
+Chip8::Handler Chip8::decode(uint16_t instruction)
+{
+  switch (instruction & 0xf000)
+  {
+    case 0x0000:
       {
-        // Cxkk - RND Vx, byte
-        // Set Vx = random byte AND kk
-        unsigned int x = (instruction & 0x0f00)>>8;
-        unsigned int kk = (instruction & 0x00ff);
-        unsigned int r = rand_byte(rng);
-        reg.V[x] = r & kk;
+        if ((instruction & 0x00f0) == 0x00c0)
+          return Ops::scd;
+        switch (instruction & 0x00ff)
+        {
+          case 0x00e0: return Ops::cls;
+          case 0x00ee: return Ops::ret;
+          case 0x00fb: return Ops::scr;
+          case 0x00fc: return Ops::scl;
+          case 0x00fd: return Ops::exit;
+          case 0x00fe: return Ops::low;
+          case 0x00ff: return Ops::high;
+        }
         break;
       }
-    case 0xd000:
+    case 0x1000: return Ops::jp;
+    case 0x2000: return Ops::call;
+    case 0x3000: return Ops::se_vx_byte;
+    case 0x4000: return Ops::sne_vx_byte;
+    case 0x5000: return Ops::se_vx_vy;
+    case 0x6000: return Ops::ld_vx_byte;
+    case 0x7000: return Ops::add_vx_byte;
+    case 0x8000:
       {
-        // Dxyn - DRW Vx, Vy, nibble
-        // Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision
-        // SUPER-CHIP If N=0 and extended mode, show 16x16 sprite.
-        unsigned int x = (instruction & 0x0f00)>>8;
-        unsigned int y = (instruction & 0x00f0)>>4;
-        unsigned int n = (instruction & 0x000f);
-        reg.V[0xf] = 0;
-        if (extendedMode)
-        {
-          if (n == 0)
-          {
-            // Draw a 16x16 sprite
-            for (unsigned int row=0; row<16; row++)
-            {
-              uint16_t sprite_row = memory.get16(reg.I + row*2);
-              for (unsigned int col=0; col<16; col++)
-              {
-                if (sprite_row & (0x8000 >> col))
-                {
-                  if (extDisplay[(reg.V[y]+row)%extHeight][(reg.V[x]+col)%extWidth])
-                  {
-                    reg.V[0xf] = 1;
-                    extDisplay[(reg.V[y]+row)%extHeight][(reg.V[x]+col)%extWidth] = 0;
-                  }
-                  else
-                  {
-                    extDisplay[(reg.V[y]+row)%extHeight][(reg.V[x]+col)%extWidth] = 0xff;
-                  }
-                }
-              }
-            }
-          }
-          else
-          {
-            // Draw an n-byte sprite in extended mode
-            for (unsigned int row=0; row<n; row++)
-            {
-              uint8_t sprite_row = memory.get8(reg.I + row);
-              for (unsigned int col=0; col<8; col++)
-              {
-                if (sprite_row & (0x80 >> col))
-                {
-                  if (extDisplay[(reg.V[y]+row)%extHeight][(reg.V[x]+col)%extWidth])
-                  {
-                    reg.V[0xf] = 1;
-                    extDisplay[(reg.V[y]+row)%extHeight][(reg.V[x]+col)%extWidth] = 0;
-                  }
-                  else
-                  {
-                    extDisplay[(reg.V[y]+row)%extHeight][(reg.V[x]+col)%extWidth] = 0xff;
-                  }
-                }
-              }
-          }
-          }
-        }
-        else
+        switch (instruction & 0x000f)
         {
-          // Draw an n-byte sprite in normal mode
-          for (unsigned int row=0; row<n; row++)
-          {
-            uint8_t sprite_row = memory.get8(reg.I + row);
-            for (unsigned int col=0; col<8; col++)
-            {
-              if (sprite_row & (0x80 >> col))
-              {
-                if (display[(reg.V[y]+row)%height][(reg.V[x]+col)%width])
-                {
-                  reg.V[0xf] = 1;
-                  display[(reg.V[y]+row)%height][(reg.V[x]+col)%width] = 0;
-                }
-                else
-                {
-                  display[(reg.V[y]+row)%height][(reg.V[x]+col)%width] = 0xff;
-                }
-              }
-            }
-          }
+          case 0x0: return Ops::ld_vx_vy;
+          case 0x1: return Ops::or_vx_vy;
+          case 0x2: return Ops::and_vx_vy;
+          case 0x3: return Ops::xor_vx_vy;
+          case 0x4: return Ops::add_vx_vy;
+          case 0x5: return Ops::sub_vx_vy;
+          case 0x6: return Ops::shr_vx<Q>;
+          case 0x7: return Ops::subn_vx_vy;
+          case 0xe: return Ops::shl_vx<Q>;
         }
         break;
       }
+    case 0x9000: return Ops::sne_vx_vy;
+    case 0xa000: return Ops::ld_i_addr;
+    case 0xb000: return Ops::jp_v0_addr<Q>;
+    case 0xc000: return Ops::rnd_vx_byte;
+    case 0xd000: return Ops::drw<Q>;
     case 0xe000:
       {
-        unsigned int x = (instruction & 0x0f00)>>8;
         switch (instruction & 0x00ff)
         {
-          case 0x009e:
-            {
-              // Ex9E - SKP Vx
-              // Skip next instruction if key with the value of Vx is pressed
-              if (keys[reg.V[x]])
-                reg.PC += 2;
-              break;
-            }
-          case 0x00a1:
-            // ExA1 - SKNP Vx
-            // Skip next instruction if key with the value of Vx is not pressed
-            if (!keys[reg.V[x]])
-              reg.PC += 2;
-            break;
-          default:
-            printf("Unknown instruction: %04X\n", instruction);
-            abort();
+          case 0x009e: return Ops::skp_vx;
+          case 0x00a1: return Ops::sknp_vx;
         }
         break;
       }
     case 0xf000:
       {
-        unsigned int x = (instruction & 0x0f00)>>8;
         switch (instruction & 0x00ff)
         {
-          case 0x0007:
-            {
-              // Fx07 - LD Vx, DT
-              // Set Vx = delay timer value
-              reg.V[x] = reg.timerD;
-              break;
-            }
-          case 0x000a:
-            {
-              // Fx0A - LD Vx, K
-              // Wait for a key press, store the value of the key in Vx
-              bool key_pressed = false;
-              for (unsigned int i=0; i<16; i++)
-              {
-                if (keys[i])
-                {
-                  reg.V[x] = i;
-                  key_pressed = true;
-                  break;
-                }
-              }
-              if (!key_pressed)
-                reg.PC -= 2; // stay on this instruction
-
-              break;
-            }
-          case 0x0015:
-            {
-              // Fx15 - LD DT, Vx
-              // Set delay timer = Vx
-              reg.timerD = reg.V[x];
-              break;
-            }
-          case 0x0018:
-            {
-              // Fx18 - LD ST, Vx
-              // Set sound timer = Vx
-              reg.timerS = reg.V[x];
-              break;
-            }
-          case 0x001e:
-            {
-              // Fx1E - ADD I, Vx
-              // Set I = I + Vx
-              if (reg.I + reg.V[x] > 0xfff)
-                reg.V[0xf] = 1;
-              else
-                reg.V[0xf] = 0;
-              reg.I += reg.V[x];
-              break;
-            }
-          case 0x0029:
-            {
-              // Fx29 - LD F, Vx
-              // Point I to 5-byte font sprite for hex character VX
-              reg.I = 0x100 + reg.V[x]*5; // 0x100 is address of '0' digit
-              break;
-            }
-          case 0x0030:
-            {
-              // SUPER-CHIP
-              // Fx30 - LD HF, Vx
-              // Point I to 10-byte font sprite for digit VX (0..9)
-              reg.I = 0x150 + reg.V[x]*10; // 0x150 is address of '0' digit
-              break;
-            }
-          case 0x0033:
-            {
-              // Fx33 - LD B, Vx
-              // Store BCD representation of Vx in memory locations I, I+1, and I+2
-              memory.set8(reg.I,    reg.V[x]/100);
-              memory.set8(reg.I+1, (reg.V[x]%100)/10);
-              memory.set8(reg.I+2,  reg.V[x]%10);
-              break;
-            }
-          case 0x0055:
-            {
-              // Fx55 - LD [I], Vx
-              // Store registers V0 through Vx in memory starting at location I
-              uint16_t I = reg.I;
-              for (unsigned int j=0; j<=x; j++)
-              {
-                memory.set8(I, reg.V[j]);
-                I += 1;
-              }
-              break;
-            }
-          case 0x0065:
-            {
-              // Fx65 - LD Vx, [I]
-              // Read registers V0 through Vx from memory starting at location I
-              uint16_t I = reg.I;
-              for (unsigned int j=0; j<=x; j++)
-              {
-                reg.V[j] = memory.get8(I);
-                I += 1;
-              }
-              break;
-            }
-          case 0x0075:
-            {
-              // SUPER-CHIP
-              // Fx75 - LD R, Vx
-              // Store V0..VX in RPL user flags (X <= 7)
-              x = x & 7;
-              for (unsigned int i=0; i<x; i++)
-              {
-                reg.hp_48_flags[i] = reg.V[i];
-              }
-              break;
-            }
-          case 0x0085:
-            {
-              // SUPER-CHIP
-              // Fx85 - LD Vx, R
-              // Read V0..VX from RPL user flags (X <= 7)
-              x = x & 7;
-              for (unsigned int i=0; i<x; i++)
-              {
-                reg.V[i] = reg.hp_48_flags[i];
-              }
-              break;
-            }
-          default:
-            printf("Unknown instruction: %04X\n", instruction);
-            abort();
+          case 0x0007: return Ops::ld_vx_dt;
+          case 0x000a: return Ops::ld_vx_k;
+          case 0x0015: return Ops::ld_dt_vx;
+          case 0x0018: return Ops::ld_st_vx;
+          case 0x001e: return Ops::add_i_vx<Q>;
+          case 0x0029: return Ops::ld_f_vx;
+          case 0x0030: return Ops::ld_hf_vx;
+          case 0x0033: return Ops::ld_b_vx;
+          case 0x0055: return Ops::ld_i_vx<Q>;
+          case 0x0065: return Ops::ld_vx_i<Q>;
+          case 0x0075: return Ops::ld_r_vx;
+          case 0x0085: return Ops::ld_vx_r;
         }
         break;
       }
-    default:
-      printf("Unknown instruction: %04X\n", instruction);
-      abort();
   }
+  return Ops::unknown;
+}
+
+template <class Q>
+const Chip8::Handler *Chip8::handler_table()
+{
+  // One entry for every possible 16-bit instruction, so dispatch is a single
+  // indexed load. Built on first use, which is thread-safe in C++11.
+  static const std::vector<Handler> table = [] {
+    std::vector<Handler> t(0x10000);
+    for (unsigned int i=0; i<0x10000; i++)
+      t[i] = decode<Q>(i);
+    return t;
+  }();
+  return table.data();
+}
+
+template <class Q>
+Chip8::MicroOp Chip8::decode_op(uint16_t instruction)
+{
+  MicroOp op = operands(instruction);
+  op.handler = handler_table<Q>()[instruction];
+  return op;
+}
+
+Chip8::Status Chip8::step()
+{
+  return step(instructions_per_step);
+}
+
+Chip8::Status Chip8::step(unsigned int instructions)
+{
+  if (status != Status::Running)
+    return status;
+  // Superinstructions are decoded for the settings as they were, so start
+  // again if they've changed
+  if (quirks != decoded_quirks || fusion != decoded_fusion || idle_skip != decoded_idle_skip)
+  {
+    invalidate_decode_cache();
+    decoded_quirks = quirks;
+    decoded_fusion = fusion;
+    decoded_idle_skip = idle_skip;
+  }
+  switch (quirks)
+  {
+    case Quirks::Legacy:    step<LegacyQuirks>(instructions); break;
+    case Quirks::Vip:       step<VipQuirks>(instructions); break;
+    case Quirks::SuperChip: step<SuperChipQuirks>(instructions); break;
+  }
+  return status;
+}
+
+void Chip8::print_status()
+{
+  switch (status)
+  {
+    case Status::Running: break;
+    case Status::Halted:  printf("Exited at 0x%03X\n", reg.PC); break;
+    case Status::Faulted:
+      printf("Unknown instruction: %04X at 0x%03X\n", memory.get16(reg.PC), reg.PC);
+      break;
+  }
+}
+
+void Chip8::execute(uint16_t instruction)
+{
+  switch (quirks)
+  {
+    case Quirks::Legacy:    execute<LegacyQuirks>(instruction); break;
+    case Quirks::Vip:       execute<VipQuirks>(instruction); break;
+    case Quirks::SuperChip: execute<SuperChipQuirks>(instruction); break;
+  }
+}
+
+void Chip8::invalidate_decode_cache()
+{
+  memset(decode_cache, 0, sizeof(decode_cache));
 }
 
 void Chip8::update_timers()
@@ -640,24 +1625,12 @@ void Chip8::update_timers()
   if (reg.timerD > 0)
     --reg.timerD;
 
-  if (!muted)
-  {
-    static bool playing = false;
-    if (reg.timerS > 0)
-    {
-      --reg.timerS;
-      if (!playing)
-      {
-        audio.play();
-        playing = true;
-      }
-    }
-    else
-    {
-      audio.stop();
-      playing = false;
-    }
-  }
+  // The tone sounds for as many ticks as the sound timer was set to. It
+  // counts down even when muted.
+  if (!muted && audio)
+    audio->tick(reg.timerS > 0);
+  if (reg.timerS > 0)
+    --reg.timerS;
 }
 
 void Chip8::print_registers()
@@ -671,22 +1644,26 @@ void Chip8::print_registers()
   printf("I:  %04X\n", reg.I);
 }
 
+bool Chip8::take_display_changes(unsigned int &first, unsigned int &last)
+{
+  uint64_t rows = changed_rows;
+  changed_rows = 0;
+  if (!rows)
+    return false;
+  first = __builtin_ctzll(rows);
+  last = 64 - __builtin_clzll(rows);
+  return true;
+}
+
 void Chip8::print_screen()
 {
-  unsigned int w, h;
-  uint8_t *disp;
-  if (extendedMode)
-  {
-    w = extWidth;
-    h = extHeight;
-    disp = &extDisplay[0][0];
-  }
-  else
-  {
-    w = width;
-    h = height;
-    disp = &display[0][0];
-  }
+  uint8_t pixels[max_display_pixels];
+  auto screen = get_display(pixels);
+  unsigned int w = std::get<0>(screen);
+  unsigned int h = std::get<1>(screen);
+  uint8_t *disp = std::get<2>(screen);
+  // In the normal mode, one character per 2x2 block
+  unsigned int step = extendedMode ? 1 : 2;
   if (extendedMode)
   {
     printf("/--------------------------------------------------------------------------------------------------------------------------------\\\n");
@@ -695,10 +1672,10 @@ void Chip8::print_screen()
   {
     printf("/----------------------------------------------------------------\\\n");
   }
-  for (unsigned int y=0; y<h; y++)
+  for (unsigned int y=0; y<h; y+=step)
   {
     printf("|");
-    for (unsigned int x=0; x<w; x++)
+    for (unsigned int x=0; x<w; x+=step)
     {
       if (*(disp+y*w+x))
         printf("0");
@@ -717,225 +1694,19 @@ void Chip8::print_screen()
   }
 }
 
-std::tuple<unsigned int, unsigned int, uint8_t*> Chip8::get_display()
+std::tuple<unsigned int, unsigned int, uint8_t*> Chip8::get_display(uint8_t *pixels) const
 {
-  unsigned int w, h;
-  uint8_t *disp;
-  if (extendedMode)
-  {
-    w = extWidth;
-    h = extHeight;
-    disp = &extDisplay[0][0];
-  }
-  else
+  const uint64_t *rows = &display[0][0];
+  uint8_t *disp = pixels;
+  for (unsigned int i=0; i<extWidth*extHeight/64; i++)
   {
-    w = width;
-    h = height;
-    disp = &display[0][0];
+    for (unsigned int b=0; b<64; b++)
+      *disp++ = (rows[i] >> (63 - b)) & 1 ? 0xff : 0;
   }
-
-  return std::make_tuple(w, h, disp);
+  return std::make_tuple(extWidth, extHeight, pixels);
 }
 
-void run_frame(void *c8)
+void Chip8::get_display_bits(uint8_t *bits) const
 {
-  auto chip8 = static_cast<Chip8 *>(c8);
-  chip8->step();
-
-  auto screen = chip8->get_display();
-  unsigned int w = std::get<0>(screen);
-  unsigned int h = std::get<1>(screen);
-  uint8_t *disp  = std::get<2>(screen);
-
-  glClear(GL_COLOR_BUFFER_BIT);
-#ifdef __EMSCRIPTEN__
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, w, h, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, disp);
-#else
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, disp);
-#endif
-  glUniform1i(glGetUniformLocation(shader_program, "display"), 0);
-  glDrawArrays(GL_TRIANGLES, 0, 6);
-}
-
-void Chip8::run()
-{
-  //
-  // Set up window
-  //
-  unsigned int screenWidth  = width * scaleFactor;
-  unsigned int screenHeight = height * scaleFactor;
-  if (!glfwInit()) {
-    fprintf(stderr, "Failed to initialise GLFW\n");
-    abort();
-  }
-
-  glfwWindowHint(GLFW_SAMPLES, 4);
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-  glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
-
-  window = glfwCreateWindow(screenWidth, screenHeight, "Chip8 Emulator", NULL, NULL);
-  if (window == NULL) {
-    fprintf(stderr, "Failed to open window.\n");
-    glfwTerminate();
-    abort();
-  }
-  glfwMakeContextCurrent(window);
-  glfwSetWindowUserPointer(window, this);
-  glfwSetKeyCallback(window, key_callback);
-
-  glewExperimental = true;
-  if (glewInit() != GLEW_OK) {
-    fprintf(stderr, "Failed to initialise GLEW.\n");
-    abort();
-  }
-
-  //
-  // OpenGL settings
-  //
-  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-
-  //
-  // Shaders
-  //
-  const GLchar *vertex_shader_source =
-    "attribute vec2 position;"
-    "attribute vec2 texCoord;"
-    "varying vec2 TexCoord;"
-    "void main()"
-    "{"
-    "  gl_Position = vec4(position, 0.0, 1.0);"
-    "  TexCoord = texCoord;"
-    "}";
-
-  const GLchar *fragment_shader_source =
-#ifdef __EMSCRIPTEN__
-    "precision mediump float;"
-#endif
-    "varying vec2 TexCoord;"
-    "uniform sampler2D display;"
-    "void main()"
-    "{"
-    "  gl_FragColor = texture2D(display, TexCoord);"
-    "}";
-
-  GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vertex_shader, 1, &vertex_shader_source, NULL);
-  glCompileShader(vertex_shader);
-  GLint status;
-  glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &status);
-  if (!status)
-  {
-    char error_buffer[512];
-    glGetShaderInfoLog(vertex_shader, 512, NULL, error_buffer);
-    fprintf(stderr, "Vertex shader error:\n%s\n", error_buffer);
-    abort();
-  }
-
-  GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fragment_shader, 1, &fragment_shader_source, NULL);
-  glCompileShader(fragment_shader);
-  glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &status);
-  if (!status)
-  {
-    char error_buffer[512];
-    glGetShaderInfoLog(fragment_shader, 512, NULL, error_buffer);
-    fprintf(stderr, "Fragment shader error:\n%s\n", error_buffer);
-    abort();
-  }
-
-  shader_program = glCreateProgram();
-  glAttachShader(shader_program, vertex_shader);
-  glAttachShader(shader_program, fragment_shader);
-  glLinkProgram(shader_program);
-  glGetProgramiv(shader_program, GL_LINK_STATUS, &status);
-  if (!status)
-  {
-    char error_buffer[512];
-    glGetProgramInfoLog(shader_program, 512, NULL, error_buffer);
-    fprintf(stderr, "Shader link error:\n%s\n", error_buffer);
-    abort();
-  }
-  glUseProgram(shader_program);
-
-  //
-  // Buffers
-  //
-  GLfloat display_vertices[] = {
-    // Pos          Tex
-   -1.0f,-1.0f,  0.0f, 1.0f,
-   -1.0f, 1.0f,  0.0f, 0.0f,
-    1.0f,-1.0f,  1.0f, 1.0f,
-    1.0f, 1.0f,  1.0f, 0.0f,
-    1.0f,-1.0f,  1.0f, 1.0f,
-   -1.0f, 1.0f,  0.0f, 0.0f,
-  };
-
-  GLuint vao, vbo;
-  glGenVertexArrays(1, &vao);
-  glGenBuffers(1, &vbo);
-
-  glBindVertexArray(vao);
-
-  glBindBuffer(GL_ARRAY_BUFFER, vbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(display_vertices), display_vertices, GL_STATIC_DRAW);
-
-  // Position attribute
-  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat), 0);
-  glEnableVertexAttribArray(0);
-
-  // TexCoord attribute
-  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat), (GLvoid*)(2*sizeof(GLfloat)));
-  glEnableVertexAttribArray(1);
-
-  //
-  // Texture
-  //
-  GLuint texture;
-  glGenTextures(1, &texture);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-#ifdef __EMSCRIPTEN__
-  emscripten_set_main_loop_arg(run_frame, this, 0, 1);
-#else
-  while (!glfwWindowShouldClose(window))
-  {
-    run_frame(this);
-    glfwSwapBuffers(window);
-    glfwPollEvents();
-  }
-#endif
-}
-
-void key_callback(GLFWwindow *window, int key, int scancode, int action, int mode)
-{
-  Chip8 *chip8 = (Chip8 *)glfwGetWindowUserPointer(window);
-  bool pressed = (action != GLFW_RELEASE);
-  switch (key)
-  {
-    case GLFW_KEY_1: chip8->keys[0x1] = pressed; break;
-    case GLFW_KEY_2: chip8->keys[0x2] = pressed; break;
-    case GLFW_KEY_3: chip8->keys[0x3] = pressed; break;
-    case GLFW_KEY_4: chip8->keys[0xc] = pressed; break;
-    case GLFW_KEY_Q: chip8->keys[0x4] = pressed; break;
-    case GLFW_KEY_W: chip8->keys[0x5] = pressed; break;
-    case GLFW_KEY_E: chip8->keys[0x6] = pressed; break;
-    case GLFW_KEY_R: chip8->keys[0xd] = pressed; break;
-    case GLFW_KEY_A: chip8->keys[0x7] = pressed; break;
-    case GLFW_KEY_S: chip8->keys[0x8] = pressed; break;
-    case GLFW_KEY_D: chip8->keys[0x9] = pressed; break;
-    case GLFW_KEY_F: chip8->keys[0xe] = pressed; break;
-    case GLFW_KEY_Z: chip8->keys[0xa] = pressed; break;
-    case GLFW_KEY_X: chip8->keys[0x0] = pressed; break;
-    case GLFW_KEY_C: chip8->keys[0xb] = pressed; break;
-    case GLFW_KEY_V: chip8->keys[0xf] = pressed; break;
-    case GLFW_KEY_ENTER:
-      chip8->reset();
-      break;
-  }
+  put_rows(bits, &display[0][0], extHeight*extWidth/64);
 }
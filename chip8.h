@@ -5,56 +5,316 @@
 #include <istream>
 #include <random>
 #include <tuple>
+#include <memory>
+#include <vector>
 
 #include "memory.h"
+#include "registers.h"
+#include "quirks.h"
+#include "rng.h"
+#include "jit.h"
 #include "audio.h"
+#include "handoff.h"
+
+class MovieWriter;
+class MoviePlayer;
+class Rewind;
+class FrameDump;
+class TermView;
 
 class Chip8
 {
-  struct
+  friend struct Ops;
+  friend struct Fused;
+  template <unsigned int Lanes> friend class Lockstep;
+  struct MicroOp;
+  typedef void (*Handler)(Chip8 &, const MicroOp &);
+
+  // A decoded instruction: its handler plus pre-extracted operands
+  struct MicroOp
   {
-    uint16_t PC = 0x200;
-    uint16_t I;
-    uint8_t V[16];
-    uint8_t timerD, timerS;
-    uint8_t SP = 0;
-    uint8_t hp_48_flags[8];
-  } reg;
+    Handler handler;
+    uint16_t instruction;
+    uint16_t nnn;
+    uint8_t x, y, n, kk;
+    uint8_t fused; // Superinstruction starting here (index into fusions)
+  };
+
+  // A superinstruction: a common sequence of instructions run as one
+  // operation. Returns the number of instructions executed, which for idle
+  // loops can be the whole of budget.
+  struct Fusion
+  {
+    unsigned int (*run)(Chip8 &, const MicroOp *, unsigned int budget);
+    unsigned int length; // Instructions in the sequence
+    const char *name;
+  };
+  static const Fusion fusions[];
+  static const unsigned int max_fusion = 4;
+  uint64_t fused_instructions[16] = {}; // Dynamic count per fusion
+
+  Registers reg;
 
-  Memory<0x1000> memory; // 4KB
-  Audio audio;
+  Chip8Memory memory; // 4KB
+  MicroOp decode_cache[0x1000/2]; // One per 2-byte slot of memory
+  std::unique_ptr<Jit> jit;       // Created on first use
+  std::unique_ptr<Audio> device; // Started by run() if audio isn't set
 
   static const unsigned int width = 64;
   static const unsigned int height = 32;
   static const unsigned int extWidth = width*2;
   static const unsigned int extHeight = height*2;
-  uint8_t display[height][width];
-  uint8_t extDisplay[extHeight][extWidth];
+  // One framebuffer at the extended resolution for both modes; in the
+  // normal mode each pixel is a 2x2 block of it. One bit per pixel, two
+  // 64-bit words per row; bit 63 of the first is the leftmost pixel.
+  uint64_t display[extHeight][extWidth/64] = {};
   bool extendedMode = false;
 
-  char *rom_file_name;
-  std::mt19937 rng;
+  // Checkpoint base image, and the rows of the display written since it
+  // was taken (memory tracks its own lines)
+  struct Image
+  {
+    uint8_t memory[0x1000];
+    uint64_t display[extHeight][extWidth/64];
+  };
+  std::shared_ptr<const Image> base;
+  uint64_t display_dirty = 0;
+
+  // Rows of the display changed since take_display_changes()
+  uint64_t changed_rows = ~(uint64_t)0;
+
+  void mark_display()
+  {
+    display_dirty = ~(uint64_t)0;
+    changed_rows = ~(uint64_t)0;
+  }
+
+  void restore_from(const std::shared_ptr<const Image> &from_base,
+                    uint64_t memory_lines, uint64_t display_rows,
+                    const uint8_t *data, const uint64_t *rows,
+                    const Chip8 *from);
+
+  // The loaded ROM, kept so reset() doesn't have to load it again
+  const char *rom_name = "";
+  const uint8_t *rom = nullptr;
+  size_t rom_size = 0;
+  std::shared_ptr<const std::vector<uint8_t>> rom_file; // Owns rom if read from a file
+  void load_rom();
+
+  Rng rng;
+
+  // Everything which runs instructions is compiled once per quirk profile
+  template <class Q> void step(unsigned int budget);
+  template <class Q> void execute(uint16_t instruction);
+  template <class Q> unsigned int execute_cached(unsigned int budget);
+  template <class Q> static Handler decode(uint16_t instruction);
+  template <class Q> static const Handler *handler_table();
+  template <class Q> static MicroOp decode_op(uint16_t instruction);
+  template <class Q> void decode_slot(unsigned int slot);
+  void execute(uint16_t instruction); // Using the profile in quirks
+  Quirks decoded_quirks = Quirks::Legacy; // Profile decode_cache is for
+  bool decoded_fusion = true;             // And fusion and idle_skip
+  bool decoded_idle_skip = true;
+  uint8_t find_fusion(unsigned int slot);
+  void invalidate_decode_cache();
+
+  void invalidate_slot(unsigned int slot)
+  {
+    // Superinstructions which include this slot are dropped too
+    decode_cache[slot].handler = nullptr;
+    for (unsigned int i=1; i<max_fusion && i<=slot; i++)
+    {
+      if (decode_cache[slot-i].fused)
+        decode_cache[slot-i].handler = nullptr;
+    }
+  }
+
+  static MicroOp operands(uint16_t instruction)
+  {
+    MicroOp op;
+    op.handler = nullptr;
+    op.instruction = instruction;
+    op.nnn = (instruction & 0x0fff);
+    op.x = (instruction & 0x0f00)>>8;
+    op.y = (instruction & 0x00f0)>>4;
+    op.n = (instruction & 0x000f);
+    op.kk = (instruction & 0x00ff);
+    op.fused = 0;
+    return op;
+  }
+
+  // All memory writes go through these so stale decoded instructions are
+  // dropped from decode_cache and the JIT (self-modifying code)
+  void write8(unsigned int address, uint8_t value)
+  {
+    memory.set8(address, value);
+    invalidate_slot((address>>1) & 0x7ff);
+    if (jit)
+      jit->invalidate(address & 0xfff);
+  }
 
-  void execute(uint16_t instruction);
+  void write16(unsigned int address, uint16_t value)
+  {
+    memory.set16(address, value);
+    invalidate_slot((address>>1) & 0x7ff);
+    invalidate_slot(((address+1)>>1) & 0x7ff);
+    if (jit)
+    {
+      jit->invalidate(address & 0xfff);
+      jit->invalidate((address+1) & 0xfff);
+    }
+  }
   void update_timers();
   void print_registers();
   void print_screen();
 
 public:
+  // How instructions are decoded and dispatched to their handlers
+  enum class Dispatch
+  {
+    Switch, // Nested switch statement
+    Table,  // Single lookup in a 64K-entry handler table
+    Cached, // Instructions decoded once per memory slot and cached
+    Jit     // Basic blocks translated to native code (x86-64 only)
+  };
+
   Chip8() {
-    // TODO is this needed here?
+    invalidate_decode_cache();
+    // Runs are only reproducible after seed()
     rng.seed(std::random_device()());
   }
   void loadProgram(char *rom);
+  // Load a ROM already in memory, e.g. from a RomPack. data must outlive
+  // this Chip8, as reset() loads it again.
+  void loadProgram(const uint8_t *data, size_t size, const char *name);
+  // Load the ROM other has loaded, sharing its copy of the file rather than
+  // reading it again
+  void loadProgram(const Chip8 &other);
   void reset();
+  void seed(uint32_t s) { rng.seed(s); }
+
+  // The whole machine state in a compact, versioned format (see
+  // chip8.cpp). load_state returns false if data isn't a state this
+  // version can read, and drops anything decoded or translated from the
+  // old memory. The path versions print why they failed.
+  void save_state(std::vector<uint8_t> &out) const;
+  bool load_state(const uint8_t *data, size_t size);
+  bool save_state(const char *path) const;
+  bool load_state(const char *path);
+
+  // Cheap checkpoints. set_base() keeps a copy of memory and the display
+  // as a base image; from then on writes mark 64-byte lines of memory and
+  // rows of the display dirty, and a checkpoint holds only those plus the
+  // registers. Restoring one copies back just the lines that differ;
+  // restore returns false, and changes nothing, if cp's state isn't valid.
+  struct Checkpoint
+  {
+    Registers reg;
+    bool extendedMode;
+    uint32_t rng;
+    bool keys[16];
+    std::shared_ptr<const Image> base;
+    uint64_t memory_lines; // Bit n: memory line n is in data
+    uint64_t display_rows; // Bit n: display row n is in rows
+    std::vector<uint8_t> data;  // Memory lines
+    std::vector<uint64_t> rows; // Display rows
+  };
+  void set_base();
+  void checkpoint(Checkpoint &out) const;
+  bool restore(const Checkpoint &cp);
+
+  // Become a copy of from's machine state. If both share a base only the
+  // dirty lines are copied.
+  void fork(const Chip8 &from);
+
+  // Apply the inputs for the next frame: queued input, movie playback or
+  // recording, reset_requested and rewinding. Called before each step() by
+  // the run loops; returns false if the frame was spent rewinding and
+  // shouldn't be stepped.
+  bool begin_frame();
+#ifndef CHIP8_HEADLESS
   void run();
-  void step();
-  std::tuple<unsigned int, unsigned int, uint8_t*> get_display();
+#endif
+  // dump, if given, is sent every frame, and view, if given, shows them at
+  // 60 frames/sec
+  void run_headless(uint64_t max_frames, uint64_t max_instructions,
+                    FrameDump *dump = nullptr, TermView *view = nullptr);
+  void print_stats(uint64_t instructions);
+  // Instructions step() has run, and how many of those idle loops were
+  // fast-forwarded over rather than executed
+  uint64_t instructions_run = 0;
+  uint64_t idle_instructions = 0;
 
+  // Whether the machine is still running instructions. 00FD halts it and an
+  // instruction it doesn't know faults it, leaving the PC on that
+  // instruction; step() then does nothing until loadProgram(), reset() or
+  // loading a state starts it again.
+  enum class Status
+  {
+    Running,
+    Halted,
+    Faulted
+  };
+  Status status = Status::Running;
+  // Run a frame of instructions_per_step instructions, or of instructions
+  // without changing the setting (e.g. for a Scheduler's uneven ticks)
+  Status step();
+  Status step(unsigned int instructions);
+  // Say why the machine stopped, if it has
+  void print_status();
+  // The display at one byte per pixel (0 or 0xff), unpacked into pixels,
+  // which must hold max_display_pixels. Returns the width, height and
+  // pixels, which are always at the extended resolution.
+  static const unsigned int display_width = 128;
+  static const unsigned int display_height = 64;
+  static const unsigned int max_display_pixels = display_width*display_height;
+  std::tuple<unsigned int, unsigned int, uint8_t*> get_display(uint8_t *pixels) const;
+  // The same display packed at one bit per pixel, 16 bytes per row with
+  // the leftmost pixel in the top bit, into display_bytes bytes
+  static const unsigned int display_bytes = max_display_pixels/8;
+  void get_display_bits(uint8_t *bits) const;
+
+  // The rows of the display changed since the last call, as [first, last),
+  // so a renderer can skip unchanged frames and upload only those rows.
+  // Returns false if nothing changed.
+  bool take_display_changes(unsigned int &first, unsigned int &last);
+
+  Dispatch dispatch = Dispatch::Cached;
+  Quirks quirks = Quirks::Legacy;
+  bool fusion = true;    // Superinstructions in the Cached and Jit dispatch
+  bool idle_skip = true; // Fast-forward idle loops to the end of the frame
   unsigned int instructions_per_step = 10;
+  // If set, the speed in real time (the window and --term), spread over
+  // the ticks by a Scheduler in place of instructions_per_step
+  unsigned int instructions_per_second = 0;
   unsigned int scaleFactor = 20;
-  bool keys[16];
+  bool keys[16] = {};
   bool muted = false;
+  // Where the tone goes. If not set, the window plays it on the sound
+  // device, which is only opened the first time the tone sounds, so runs
+  // that never beep never touch it; headless runs discard it.
+  Audio *audio = nullptr;
+  bool reset_requested = false; // Reset at the start of the next frame
+  MovieWriter *recorder = nullptr;
+  MoviePlayer *player = nullptr;
+  Rewind *rewinder = nullptr;   // History for rewinding, if any
+  bool rewinding = false;       // Go back a frame each frame instead of running
+
+  // Input from another thread (the window's), which mustn't touch the
+  // fields above while the emulator runs. begin_frame() applies it.
+  struct Input
+  {
+    enum Type : uint8_t
+    {
+      Key,    // keys[key] = pressed
+      Reset,  // reset_requested = true
+      Rewind  // rewinding = pressed
+    };
+    Type type;
+    uint8_t key;
+    bool pressed;
+  };
+  SpscQueue<Input, 256> input;
 };
 
 #endif
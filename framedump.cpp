@@ -0,0 +1,340 @@
+#include "framedump.h"
+#include "chip8.h"
+
+#include <string.h>
+#include <string>
+
+static const unsigned int frame_width = 128;
+static const unsigned int frame_height = 64;
+static const unsigned int row_bytes = frame_width/8;
+static const unsigned int batch_frames = 64; // Most encoded per write
+
+static_assert(Chip8::display_bytes == frame_width*frame_height/8,
+              "frames are the packed 128x64 display");
+
+static void put32_be(std::vector<uint8_t> &out, uint32_t v)
+{
+  for (int i=3; i>=0; i--)
+    out.push_back(v >> (i*8));
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size)
+{
+  static const std::vector<uint32_t> table = []
+  {
+    std::vector<uint32_t> t(256);
+    for (uint32_t n=0; n<256; n++)
+    {
+      uint32_t c = n;
+      for (int k=0; k<8; k++)
+        c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      t[n] = c;
+    }
+    return t;
+  }();
+  uint32_t c = 0xffffffff;
+  for (size_t i=0; i<size; i++)
+    c = table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+  return c ^ 0xffffffff;
+}
+
+static uint32_t adler32(const uint8_t *data, size_t size)
+{
+  uint32_t a = 1, b = 0;
+  for (size_t i=0; i<size; i++)
+  {
+    a = (a + data[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  return (b << 16) | a;
+}
+
+// A PNG chunk is begun with its type, then its data is appended to out and
+// end_chunk() fills in the length and adds the CRC
+static size_t begin_chunk(std::vector<uint8_t> &out, const char *type)
+{
+  size_t start = out.size();
+  out.insert(out.end(), 4, 0);
+  out.insert(out.end(), type, type + 4);
+  return start;
+}
+
+static void end_chunk(std::vector<uint8_t> &out, size_t start)
+{
+  uint32_t length = out.size() - start - 8;
+  for (int i=0; i<4; i++)
+    out[start + i] = length >> ((3 - i)*8);
+  put32_be(out, crc32(&out[start + 4], length + 4));
+}
+
+FrameDump::Format FrameDump::format_for(const char *path)
+{
+  const char *dot = strrchr(path, '.');
+  if (dot && strcmp(dot, ".y4m") == 0)
+    return Format::Y4m;
+  if (dot && strcmp(dot, ".png") == 0)
+    return Format::Png;
+  return Format::Raw;
+}
+
+// Split a PNG path such as frames/%06u.png around its frame number. The
+// number must be at most one integer conversion, with only the - and 0
+// flags and a width; %% is a literal %. spec is the conversion, rewritten
+// to take an unsigned int, or empty if there isn't one, in which case
+// prefix is the whole name.
+static bool parse_pattern(const char *path, std::string &prefix,
+                          std::string &spec, std::string &suffix)
+{
+  prefix.clear();
+  spec.clear();
+  suffix.clear();
+  bool found = false;
+  for (const char *p = path; *p; p++)
+  {
+    std::string &out = found ? suffix : prefix;
+    if (*p != '%')
+    {
+      out += *p;
+      continue;
+    }
+    if (p[1] == '%')
+    {
+      out += '%';
+      p++;
+      continue;
+    }
+    if (found)
+      return false;
+    const char *start = p++;
+    while (*p == '-' || *p == '0')
+      p++;
+    while (*p >= '0' && *p <= '9')
+      p++;
+    if (!*p || !strchr("diuxXo", *p))
+      return false;
+    spec.assign(start, p);
+    spec += *p == 'd' || *p == 'i' ? 'u' : *p;
+    found = true;
+  }
+  return true;
+}
+
+FrameDump::~FrameDump()
+{
+  finish();
+}
+
+bool FrameDump::open(const char *path, Format format, unsigned int queue_frames)
+{
+  this->path = path;
+  this->format = format;
+  // Only PNG paths are patterns; anything else is opened as it is
+  const char *name = path;
+  per_file = false;
+  if (format == Format::Png)
+  {
+    if (!parse_pattern(path, name_prefix, name_spec, name_suffix))
+    {
+      fprintf(stderr, "'%s' isn't a valid PNG pattern: it takes one frame number, such as %%06u, "
+              "and %%%% for a literal %%\n", path);
+      return false;
+    }
+    per_file = !name_spec.empty();
+    name = name_prefix.c_str();
+  }
+  if (!per_file)
+  {
+    file = fopen(name, "wb");
+    if (!file)
+    {
+      fprintf(stderr, "Couldn't open '%s' for the frame dump\n", name);
+      return false;
+    }
+    setvbuf(file, nullptr, _IOFBF, 1 << 20);
+    if (format == Format::Y4m)
+    {
+      fprintf(file, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 Cmono\n",
+              frame_width, frame_height);
+    }
+  }
+
+  capacity = queue_frames ? queue_frames : 1;
+  queue.resize((size_t)capacity*Chip8::display_bytes);
+  repeats.resize(capacity);
+  writer = std::thread(&FrameDump::write_frames, this);
+  return true;
+}
+
+void FrameDump::push(Chip8 &c)
+{
+  uint64_t h = head.load(std::memory_order_relaxed);
+  if (h - seen_tail == capacity)
+  {
+    // Only look at the writer's position when the queue seems full, to keep
+    // its cache line out of this loop
+    seen_tail = tail.load(std::memory_order_acquire);
+    if (h - seen_tail == capacity)
+    {
+      dropped_frames++;
+      return;
+    }
+  }
+  // Most frames draw nothing, and those are queued as repeats without
+  // copying the display
+  unsigned int first_row, last_row;
+  bool changed = c.take_display_changes(first_row, last_row);
+  repeats[h % capacity] = !changed;
+  if (changed)
+    c.get_display_bits(&queue[(h % capacity)*Chip8::display_bytes]);
+  head.store(h + 1);
+  // The writer sleeps until a whole batch is queued
+  if (h + 1 >= wake_at.load())
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ready.notify_one();
+  }
+}
+
+bool FrameDump::finish()
+{
+  if (!writer.joinable())
+    return ok;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closing = true;
+    ready.notify_one();
+  }
+  writer.join();
+  if (file)
+  {
+    ok &= fclose(file) == 0;
+    file = nullptr;
+  }
+  if (!ok)
+    fprintf(stderr, "Couldn't write the frame dump to '%s'\n", path);
+  if (dropped_frames)
+  {
+    fprintf(stderr, "Frame dump fell behind and dropped %llu frames\n",
+            (unsigned long long)dropped_frames);
+  }
+  return ok;
+}
+
+void FrameDump::write_frames()
+{
+  std::vector<uint8_t> out;
+  std::vector<uint8_t> last_frame; // Encoded, for repeats
+  for (;;)
+  {
+    // closing is set after the last push(), so once it's seen head is final
+    bool done = closing;
+    uint64_t first = tail.load(std::memory_order_relaxed);
+    uint64_t last = head.load(std::memory_order_acquire);
+    if (last - first < batch_frames && !done)
+    {
+      // Sleep until push() has a batch ready, or finish()
+      std::unique_lock<std::mutex> lock(mutex);
+      wake_at = first + batch_frames;
+      while (head.load() < first + batch_frames && !closing)
+        ready.wait(lock);
+      wake_at = UINT64_MAX;
+      continue;
+    }
+    if (first == last)
+      return;
+    if (last - first > batch_frames)
+      last = first + batch_frames;
+
+    out.clear();
+    for (uint64_t i=first; i<last; i++)
+    {
+      if (!repeats[i % capacity] || last_frame.empty())
+      {
+        last_frame.clear();
+        encode(&queue[(i % capacity)*Chip8::display_bytes], last_frame);
+      }
+      out.insert(out.end(), last_frame.begin(), last_frame.end());
+      if (per_file)
+      {
+        ok = write(out, i) && ok;
+        out.clear();
+      }
+    }
+    // Encoded, so push() can reuse the slots
+    tail.store(last, std::memory_order_release);
+    if (!per_file)
+      ok = write(out, 0) && ok;
+  }
+}
+
+void FrameDump::encode(const uint8_t *bits, std::vector<uint8_t> &out)
+{
+  switch (format)
+  {
+    case Format::Y4m:
+      {
+        static const char tag[] = "FRAME\n";
+        out.insert(out.end(), tag, tag + 6);
+      }
+      // Fall through: the plane is the same as a raw frame
+    case Format::Raw:
+      {
+        size_t start = out.size();
+        out.resize(start + frame_width*frame_height);
+        uint8_t *p = &out[start];
+        for (unsigned int i=0; i<Chip8::display_bytes; i++)
+        {
+          for (int b=7; b>=0; b--)
+            *p++ = (bits[i] >> b) & 1 ? 0xff : 0;
+        }
+        break;
+      }
+    case Format::Png:
+      {
+        // Rows are already 1-bit greyscale, leftmost pixel in the top bit.
+        // Compression would cost more time than it saves on a 1KB image,
+        // so they go in a single stored deflate block.
+        static const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        out.insert(out.end(), signature, signature + 8);
+
+        size_t chunk = begin_chunk(out, "IHDR");
+        put32_be(out, frame_width);
+        put32_be(out, frame_height);
+        out.insert(out.end(), {1, 0, 0, 0, 0}); // Depth 1, grey, no interlace
+        end_chunk(out, chunk);
+
+        const uint16_t raw_size = frame_height*(1 + row_bytes);
+        chunk = begin_chunk(out, "IDAT");
+        out.insert(out.end(), {0x78, 0x01, 0x01}); // zlib header, final stored block
+        out.insert(out.end(), {(uint8_t)raw_size, (uint8_t)(raw_size >> 8),
+                               (uint8_t)~raw_size, (uint8_t)(~raw_size >> 8)});
+        size_t raw = out.size();
+        for (unsigned int y=0; y<frame_height; y++)
+        {
+          out.push_back(0); // No filter
+          out.insert(out.end(), bits + y*row_bytes, bits + (y + 1)*row_bytes);
+        }
+        put32_be(out, adler32(&out[raw], raw_size));
+        end_chunk(out, chunk);
+
+        end_chunk(out, begin_chunk(out, "IEND"));
+        break;
+      }
+  }
+}
+
+bool FrameDump::write(const std::vector<uint8_t> &out, uint64_t index)
+{
+  if (!per_file)
+    return fwrite(out.data(), 1, out.size(), file) == out.size();
+
+  // name_spec was checked by parse_pattern to take just this number
+  char number[64];
+  snprintf(number, sizeof(number), name_spec.c_str(), (unsigned int)index);
+  std::string name = name_prefix + number + name_suffix;
+  FILE *f = fopen(name.c_str(), "wb");
+  if (!f)
+    return false;
+  bool written = fwrite(out.data(), 1, out.size(), f) == out.size();
+  return (fclose(f) == 0) && written;
+}
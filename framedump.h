@@ -0,0 +1,97 @@
+#ifndef FRAMEDUMP_H
+#define FRAMEDUMP_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Chip8;
+
+// Writes every frame of the display to a file or pipe, for archiving runs
+// or feeding a video encoder.
+//
+// push() only copies the packed display (1KB) into a bounded queue; a
+// background thread encodes and writes it, so the emulator never waits on
+// I/O. If the writer falls a whole queue behind, frames are dropped and
+// counted rather than stalling the emulator.
+//
+// Every format is 128x64, with normal-mode pixels as 2x2 blocks:
+//
+//   raw  8-bit grey, 0 or 255, frames back to back
+//   y4m  YUV4MPEG2, mono at 60 frames/sec, which ffmpeg and most encoders read
+//   png  1-bit greyscale PNGs, one file per frame if the path has a printf
+//        pattern with one integer conversion (e.g. frames/%06u.png),
+//        otherwise back to back in one file (which ffmpeg reads with
+//        -f image2pipe). %% in a PNG path is a literal %; other formats
+//        take the path as it is.
+class FrameDump
+{
+public:
+  enum class Format
+  {
+    Raw,
+    Y4m,
+    Png
+  };
+
+  FrameDump() {}
+  ~FrameDump();
+  FrameDump(const FrameDump &) = delete;
+  FrameDump &operator=(const FrameDump &) = delete;
+
+  // Returns false (after printing why) if path can't be written
+  bool open(const char *path, Format format, unsigned int queue_frames = 4096);
+
+  // Queue c's display as the next frame. This takes c's display changes
+  // (see Chip8::take_display_changes) to spot unchanged frames.
+  void push(Chip8 &c);
+
+  // Write out everything queued and close the file. Returns false if any of
+  // it couldn't be written.
+  bool finish();
+
+  uint64_t frames() const { return head; }
+  uint64_t dropped() const { return dropped_frames; }
+
+  // From path's extension; raw if there's no recognised one
+  static Format format_for(const char *path);
+
+private:
+  Format format = Format::Raw;
+  const char *path = nullptr;
+  bool per_file = false; // A file per frame, named by the pattern in path
+  std::string name_prefix, name_spec, name_suffix; // path split around the number
+  FILE *file = nullptr;
+
+  // Single-producer, single-consumer ring of packed frames. head and tail
+  // count frames queued and written; only push() advances head and only
+  // the writer advances tail. Each side's fields get their own cache line,
+  // so one writing doesn't slow the other down.
+  std::vector<uint8_t> queue;
+  std::vector<uint8_t> repeats; // The same as the frame before; no display copied
+  unsigned int capacity = 0;
+
+  alignas(64) std::atomic<uint64_t> head{0};
+  uint64_t seen_tail = 0; // push()'s last look at tail
+  uint64_t dropped_frames = 0;
+
+  alignas(64) std::atomic<uint64_t> tail{0};
+  std::atomic<uint64_t> wake_at{UINT64_MAX}; // head the sleeping writer waits for
+  bool ok = true; // Owned by the writer until it's joined
+
+  alignas(64) std::atomic<bool> closing{false};
+  std::thread writer;
+  std::mutex mutex;
+  std::condition_variable ready;
+
+  void write_frames();
+  void encode(const uint8_t *bits, std::vector<uint8_t> &out);
+  bool write(const std::vector<uint8_t> &out, uint64_t index);
+};
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+#include <atomic>
+
+// Lock-free ways of passing data between exactly two threads, one writing
+// and one reading, without either ever waiting on the other.
+
+// The latest of a stream of values, e.g. frames. The writer fills back()
+// and publishes it; the reader gets the newest published value, skipping
+// any it was too slow to see. Three slots mean each side always has one to
+// itself, with the third in between.
+template <class T>
+class TripleBuffer
+{
+public:
+  // Writer
+  T &back() { return slots[back_index]; }
+  void publish()
+  {
+    back_index = middle.exchange(back_index | fresh, std::memory_order_acq_rel) & index_mask;
+  }
+
+  // Reader: the newest value, or nullptr if none has been published since
+  // the last call
+  const T *read()
+  {
+    if (!(middle.load(std::memory_order_relaxed) & fresh))
+      return nullptr;
+    front_index = middle.exchange(front_index, std::memory_order_acq_rel) & index_mask;
+    return &slots[front_index];
+  }
+
+private:
+  static const uint8_t index_mask = 3;
+  static const uint8_t fresh = 4; // Set in middle when it holds a new value
+
+  T slots[3];
+  std::atomic<uint8_t> middle{1};
+  uint8_t back_index = 0;  // Only used by the writer
+  uint8_t front_index = 2; // Only used by the reader
+};
+
+// A bounded first-in, first-out queue. N must be a power of two.
+template <class T, unsigned int N>
+class SpscQueue
+{
+  static_assert((N & (N - 1)) == 0, "queue size must be a power of two");
+
+public:
+  // Returns false, dropping value, if the queue is full
+  bool push(const T &value)
+  {
+    unsigned int h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == N)
+      return false;
+    items[h % N] = value;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false if the queue is empty
+  bool pop(T &value)
+  {
+    unsigned int t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire))
+      return false;
+    value = items[t % N];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  T items[N];
+  std::atomic<unsigned int> head{0}; // Only advanced by push()
+  std::atomic<unsigned int> tail{0}; // Only advanced by pop()
+};
+
+#endif
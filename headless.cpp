@@ -0,0 +1,75 @@
+#include "chip8.h"
+#include "scheduler.h"
+#ifdef CHIP8_HEADLESS
+#include "framedump.h"
+#include "termview.h"
+#endif
+
+#include <stdio.h>
+#include <chrono>
+
+void Chip8::run_headless(uint64_t max_frames, uint64_t max_instructions,
+                         FrameDump *dump, TermView *view)
+{
+  // Run without a window or vsync, as fast as the host allows, or in real
+  // time when shown on a terminal. Stops after max_frames frames or
+  // max_instructions instructions, whichever comes first (0 means no
+  // limit), or when the machine halts or faults.
+  uint64_t frames = 0;
+  uint64_t instructions = 0;
+  uint64_t run_before = instructions_run, idle_before = idle_instructions;
+  Scheduler schedule;
+
+  auto start = std::chrono::steady_clock::now();
+  while ((max_frames == 0 || frames < max_frames) &&
+         (max_instructions == 0 || instructions < max_instructions))
+  {
+#ifdef CHIP8_HEADLESS
+    if (view)
+    {
+      while (schedule.due() == 0)
+        schedule.wait();
+    }
+#endif
+    unsigned int per_second = instructions_per_second ? instructions_per_second
+                                                      : instructions_per_step*Scheduler::tick_rate;
+    unsigned int n = schedule.tick(per_second);
+    // Shorten the last frame so exactly max_instructions are executed
+    if (max_instructions != 0 && max_instructions - instructions < n)
+      n = max_instructions - instructions;
+
+    bool stopped = begin_frame() && step(n) != Status::Running;
+#ifdef CHIP8_HEADLESS
+    if (dump)
+      dump->push(*this);
+    if (view)
+      view->draw(*this);
+#endif
+    instructions += n;
+    frames++;
+    if (stopped)
+    {
+      print_status();
+      break;
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+#ifdef CHIP8_HEADLESS
+  if (view)
+    view->finish();
+#endif
+
+  // Instructions fast-forwarded over in idle loops weren't executed, so
+  // aren't counted in the speed
+  uint64_t run = instructions_run - run_before;
+  uint64_t skipped = idle_instructions - idle_before;
+  uint64_t executed = run - skipped;
+  double seconds = std::chrono::duration<double>(end - start).count();
+  printf("Executed %llu instructions in %llu frames\n",
+         (unsigned long long)executed, (unsigned long long)frames);
+  if (skipped)
+    printf("Skipped %llu more in idle loops\n", (unsigned long long)skipped);
+  printf("Elapsed time: %.3f s (%.0f instructions/sec, %.0f frames/sec)\n",
+         seconds, executed/seconds, frames/seconds);
+  print_stats(run);
+}
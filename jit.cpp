@@ -0,0 +1,720 @@
+#include "jit.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__unix__) && !defined(__EMSCRIPTEN__)
+#define JIT_X86_64
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef JIT_X86_64
+
+namespace
+{
+
+// x86-64 register numbers
+enum
+{
+  RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Host registers available for guest V registers. RDI holds the Registers
+// pointer, RAX/RCX/RDX are scratch and R11 holds I.
+const int v_pool[] = {RBX, RBP, R12, R13, R14, R15, RSI, R8, R9, R10};
+const unsigned int v_pool_size = sizeof(v_pool)/sizeof(v_pool[0]);
+const int i_reg = R11;
+
+// Callee-saved registers which have to be preserved around a block
+const int saved_regs[] = {RBX, RBP, R12, R13, R14, R15};
+
+// Condition codes for setcc/cmovcc
+enum
+{
+  CC_E = 0x4, CC_AE = 0x3, CC_A = 0x7
+};
+
+// ALU operations: the /digit for "op r/m32, imm32" and the opcode for
+// "op r/m32, r32"
+struct Alu
+{
+  uint8_t ext;
+  uint8_t op;
+};
+const Alu ADD = {0, 0x01};
+const Alu OR  = {1, 0x09};
+const Alu AND = {4, 0x21};
+const Alu SUB = {5, 0x29};
+const Alu XOR = {6, 0x31};
+const Alu CMP = {7, 0x39};
+
+// Minimal x86-64 instruction encoder. All register operations are 32-bit;
+// memory operands are always [rdi + disp32].
+class Emitter
+{
+  std::vector<uint8_t> &out;
+
+  void byte(uint8_t b) { out.push_back(b); }
+
+  void imm16(uint16_t v)
+  {
+    byte(v & 0xff);
+    byte(v >> 8);
+  }
+
+  void imm32(uint32_t v)
+  {
+    for (int i=0; i<4; i++)
+      byte((v >> (i*8)) & 0xff);
+  }
+
+  // REX prefix for reg (ModRM.reg) and rm (ModRM.rm), if needed. force
+  // emits it even when empty, to select sil/dil/bpl/spl for byte operations.
+  void rex(int reg, int rm, bool force=false)
+  {
+    uint8_t r = 0x40 | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+    if (r != 0x40 || force)
+      byte(r);
+  }
+
+  void modrm_reg(int reg, int rm)
+  {
+    byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+  }
+
+  void modrm_mem(int reg, int32_t disp)
+  {
+    // [rdi + disp32]
+    byte(0x80 | ((reg & 7) << 3) | RDI);
+    imm32(disp);
+  }
+
+public:
+  Emitter(std::vector<uint8_t> &out) : out(out) {}
+
+  void push(int r) { rex(0, r); byte(0x50 | (r & 7)); }
+  void pop(int r)  { rex(0, r); byte(0x58 | (r & 7)); }
+  void ret()       { byte(0xc3); }
+
+  // mov dst, src
+  void mov(int dst, int src)
+  {
+    rex(src, dst);
+    byte(0x89);
+    modrm_reg(src, dst);
+  }
+
+  // mov dst, imm32
+  void mov_imm(int dst, uint32_t imm)
+  {
+    rex(0, dst);
+    byte(0xb8 | (dst & 7));
+    imm32(imm);
+  }
+
+  // op dst, src
+  void alu(Alu a, int dst, int src)
+  {
+    rex(src, dst);
+    byte(a.op);
+    modrm_reg(src, dst);
+  }
+
+  // op dst, imm32
+  void alu_imm(Alu a, int dst, uint32_t imm)
+  {
+    rex(0, dst);
+    byte(0x81);
+    modrm_reg(a.ext, dst);
+    imm32(imm);
+  }
+
+  // shl/shr dst, imm8
+  void shl(int dst, uint8_t n) { rex(0, dst); byte(0xc1); modrm_reg(4, dst); byte(n); }
+  void shr(int dst, uint8_t n) { rex(0, dst); byte(0xc1); modrm_reg(5, dst); byte(n); }
+
+  // imul dst, src, imm8
+  void imul_imm(int dst, int src, int8_t imm)
+  {
+    rex(dst, src);
+    byte(0x6b);
+    modrm_reg(dst, src);
+    byte(imm);
+  }
+
+  // setcc dst8; movzx dst, dst8
+  void setcc(uint8_t cc, int dst)
+  {
+    rex(0, dst, true);
+    byte(0x0f);
+    byte(0x90 | cc);
+    modrm_reg(0, dst);
+    rex(dst, dst, true);
+    byte(0x0f);
+    byte(0xb6);
+    modrm_reg(dst, dst);
+  }
+
+  // cmovcc dst, src
+  void cmov(uint8_t cc, int dst, int src)
+  {
+    rex(dst, src);
+    byte(0x0f);
+    byte(0x40 | cc);
+    modrm_reg(dst, src);
+  }
+
+  // movzx dst, byte/word [rdi + disp]
+  void load8(int dst, int32_t disp)
+  {
+    rex(dst, 0);
+    byte(0x0f);
+    byte(0xb6);
+    modrm_mem(dst, disp);
+  }
+
+  void load16(int dst, int32_t disp)
+  {
+    rex(dst, 0);
+    byte(0x0f);
+    byte(0xb7);
+    modrm_mem(dst, disp);
+  }
+
+  // mov byte/word [rdi + disp], src
+  void store8(int32_t disp, int src)
+  {
+    rex(src, 0, true);
+    byte(0x88);
+    modrm_mem(src, disp);
+  }
+
+  void store16(int32_t disp, int src)
+  {
+    byte(0x66);
+    rex(src, 0);
+    byte(0x89);
+    modrm_mem(src, disp);
+  }
+
+  // mov word [rdi + disp], imm16
+  void store16_imm(int32_t disp, uint16_t imm)
+  {
+    byte(0x66);
+    byte(0xc7);
+    modrm_mem(0, disp);
+    imm16(imm);
+  }
+};
+
+const int32_t off_PC = offsetof(Registers, PC);
+const int32_t off_I = offsetof(Registers, I);
+const int32_t off_V = offsetof(Registers, V);
+const int32_t off_timerD = offsetof(Registers, timerD);
+const int32_t off_timerS = offsetof(Registers, timerS);
+
+// Work out whether an instruction can be translated, which V registers it
+// uses, whether it uses I and whether it ends a block
+bool translatable(uint16_t instruction, const QuirkFlags &quirks,
+                  uint16_t &vregs, bool &uses_i, bool &terminator)
+{
+  unsigned int x = (instruction & 0x0f00)>>8;
+  unsigned int y = (instruction & 0x00f0)>>4;
+  vregs = 0;
+  uses_i = false;
+  terminator = false;
+  switch (instruction & 0xf000)
+  {
+    case 0x1000:
+      terminator = true;
+      return true;
+    case 0x3000:
+    case 0x4000:
+      vregs = 1 << x;
+      terminator = true;
+      return true;
+    case 0x5000:
+    case 0x9000:
+      if (instruction & 0x000f)
+        return false;
+      vregs = (1 << x) | (1 << y);
+      terminator = true;
+      return true;
+    case 0x6000:
+    case 0x7000:
+      vregs = 1 << x;
+      return true;
+    case 0x8000:
+      switch (instruction & 0x000f)
+      {
+        case 0x0: case 0x1: case 0x2: case 0x3:
+          vregs = (1 << x) | (1 << y);
+          return true;
+        case 0x4: case 0x5: case 0x7:
+          vregs = (1 << x) | (1 << y) | (1 << 0xf);
+          return true;
+        case 0x6: case 0xe:
+          vregs = (1 << x) | (1 << 0xf);
+          if (quirks.shift_vy)
+            vregs |= 1 << y;
+          return true;
+      }
+      return false;
+    case 0xa000:
+      uses_i = true;
+      return true;
+    case 0xb000:
+      vregs = 1 << (quirks.jump_vx ? x : 0);
+      terminator = true;
+      return true;
+    case 0xf000:
+      switch (instruction & 0x00ff)
+      {
+        case 0x07: case 0x15: case 0x18:
+          vregs = 1 << x;
+          return true;
+        case 0x1e:
+          vregs = 1 << x;
+          if (quirks.add_i_vf)
+            vregs |= 1 << 0xf;
+          uses_i = true;
+          return true;
+        case 0x29: case 0x30:
+          vregs = 1 << x;
+          uses_i = true;
+          return true;
+      }
+      return false;
+  }
+  return false;
+}
+
+// Length in bytes of an idle loop starting at pc, or 0 if there isn't one.
+// These are left to the interpreter, which fast-forwards them to the end of
+// the frame instead of running them over and over.
+unsigned int idle_loop(uint16_t pc, Chip8Memory &memory)
+{
+  auto op = [&](unsigned int i, uint16_t mask, uint16_t value)
+  {
+    unsigned int addr = pc + 2*i;
+    return addr + 1 < 0x1000 && (memory.get16(addr) & mask) == value;
+  };
+  uint16_t jump_back = 0x1000 | pc;
+  if (op(0, 0xffff, jump_back))
+    return 2; // 1nnn to self
+  if ((op(0, 0xf000, 0x3000) || op(0, 0xf000, 0x4000)) && op(1, 0xffff, jump_back))
+    return 4; // 3xkk/4xkk + 1nnn
+  if (op(0, 0xf0ff, 0xf007) && (op(1, 0xf000, 0x3000) || op(1, 0xf000, 0x4000)) &&
+      (memory.get16(pc) & 0x0f00) == (memory.get16(pc+2) & 0x0f00) &&
+      op(2, 0xffff, jump_back))
+    return 6; // Fx07 + 3xkk/4xkk + 1nnn
+  return 0;
+}
+
+unsigned int popcount(uint16_t v)
+{
+  unsigned int n = 0;
+  for (; v; v &= v-1)
+    n++;
+  return n;
+}
+
+// Set the protection of the pages holding bytes [at, at+n) of code
+void protect(uint8_t *code, size_t at, size_t n, int prot)
+{
+  static const size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = at - at%page;
+  if (mprotect(code + start, at + n - start, prot) != 0)
+  {
+    perror("JIT: mprotect");
+    abort();
+  }
+}
+
+} // namespace
+
+Jit::Jit()
+{
+  flush();
+  // The code buffer is never writable and executable at once (W^X): it's
+  // executable, except for the pages compile() is copying a block into
+  void *mem = mmap(NULL, code_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem != MAP_FAILED && mprotect(mem, code_size, PROT_READ | PROT_EXEC) != 0)
+  {
+    munmap(mem, code_size);
+    mem = MAP_FAILED;
+  }
+  if (mem == MAP_FAILED)
+  {
+    fprintf(stderr, "JIT: couldn't map executable memory, using the interpreter\n");
+    return;
+  }
+  code = static_cast<uint8_t *>(mem);
+}
+
+Jit::~Jit()
+{
+  if (code)
+    munmap(code, code_size);
+}
+
+bool Jit::available()
+{
+  return true;
+}
+
+const Jit::Block *Jit::compile(uint16_t pc, Chip8Memory &memory)
+{
+  if (!code)
+    return nullptr;
+
+  //
+  // Find the extent of the block and the registers it uses
+  //
+  uint16_t instructions[max_block_limit];
+  unsigned int n = 0;
+  uint16_t vregs = 0;
+  bool uses_i = false;
+  unsigned int addr = pc;
+  unsigned int idle = idle_loop(pc, memory);
+  while (idle == 0 && n < max_block && addr + 1 < 0x1000)
+  {
+    uint16_t instruction = memory.get16(addr);
+    uint16_t v;
+    bool i, terminator;
+    if (!translatable(instruction, quirks, v, i, terminator))
+      break;
+    if (popcount(vregs | v) > v_pool_size)
+      break;
+    vregs |= v;
+    uses_i |= i;
+    instructions[n++] = instruction;
+    addr += 2;
+    if (terminator)
+      break;
+  }
+
+  Block &b = blocks[pc];
+  if (n == 0)
+  {
+    // Leave this one to the interpreter, until its code changes
+    b.failed = true;
+    b.bytes = idle ? idle : 2;
+    for (unsigned int a=pc; a<pc+b.bytes && a<0x1000; a++)
+      covered[a]++;
+    return nullptr;
+  }
+
+  //
+  // Assign host registers
+  //
+  int host[16];
+  unsigned int next = 0;
+  for (unsigned int v=0; v<16; v++)
+  {
+    host[v] = -1;
+    if (vregs & (1 << v))
+      host[v] = v_pool[next++];
+  }
+
+  //
+  // Emit code
+  //
+  buf.clear();
+  Emitter e(buf);
+  for (unsigned int r=0; r<sizeof(saved_regs)/sizeof(saved_regs[0]); r++)
+    e.push(saved_regs[r]);
+  for (unsigned int v=0; v<16; v++)
+  {
+    if (host[v] >= 0)
+      e.load8(host[v], off_V + v);
+  }
+  if (uses_i)
+    e.load16(i_reg, off_I);
+
+  uint16_t written = 0;  // V registers which need storing back
+  bool pc_written = false;
+  addr = pc;
+  for (unsigned int k=0; k<n; k++)
+  {
+    uint16_t instruction = instructions[k];
+    unsigned int x = (instruction & 0x0f00)>>8;
+    unsigned int y = (instruction & 0x00f0)>>4;
+    uint8_t kk = (instruction & 0x00ff);
+    uint16_t nnn = (instruction & 0x0fff);
+    int vx = host[x];
+    int vy = host[y];
+    int vf = host[0xf];
+    addr += 2;
+
+    switch (instruction & 0xf000)
+    {
+      case 0x1000:
+        // 1nnn - JP addr
+        e.store16_imm(off_PC, nnn);
+        pc_written = true;
+        break;
+      case 0x3000:
+      case 0x4000:
+      case 0x5000:
+      case 0x9000:
+        {
+          // 3xkk/4xkk/5xy0/9xy0 - skip next instruction
+          bool skip_if_equal = ((instruction & 0xf000) == 0x3000 || (instruction & 0xf000) == 0x5000);
+          if ((instruction & 0xf000) == 0x3000 || (instruction & 0xf000) == 0x4000)
+            e.alu_imm(CMP, vx, kk);
+          else
+            e.alu(CMP, vx, vy);
+          // PC = (Vx == operand) ? RCX : RAX
+          e.mov_imm(RAX, skip_if_equal ? addr : addr + 2);
+          e.mov_imm(RCX, skip_if_equal ? addr + 2 : addr);
+          e.cmov(CC_E, RAX, RCX);
+          e.store16(off_PC, RAX);
+          pc_written = true;
+          break;
+        }
+      case 0x6000:
+        // 6xkk - LD Vx, byte
+        e.mov_imm(vx, kk);
+        written |= 1 << x;
+        break;
+      case 0x7000:
+        // 7xkk - ADD Vx, byte
+        e.alu_imm(ADD, vx, kk);
+        e.alu_imm(AND, vx, 0xff);
+        written |= 1 << x;
+        break;
+      case 0x8000:
+        // VF is always written before Vx, as in the interpreter
+        switch (instruction & 0x000f)
+        {
+          case 0x0:
+            e.mov(vx, vy);
+            break;
+          case 0x1:
+            e.alu(OR, vx, vy);
+            break;
+          case 0x2:
+            e.alu(AND, vx, vy);
+            break;
+          case 0x3:
+            e.alu(XOR, vx, vy);
+            break;
+          case 0x4:
+            // VF = carry
+            e.mov(RCX, vx);
+            e.alu(ADD, RCX, vy);
+            e.shr(RCX, 8);
+            e.mov(vf, RCX);
+            e.alu(ADD, vx, vy);
+            e.alu_imm(AND, vx, 0xff);
+            break;
+          case 0x5:
+            // VF = NOT borrow
+            e.alu(CMP, vx, vy);
+            e.setcc(CC_AE, RCX);
+            e.mov(vf, RCX);
+            e.alu(SUB, vx, vy);
+            e.alu_imm(AND, vx, 0xff);
+            break;
+          case 0x6:
+            {
+              int from = quirks.shift_vy ? vy : vx;
+              e.mov(RCX, from);
+              e.alu_imm(AND, RCX, 1);
+              e.mov(vf, RCX);
+              e.mov(RAX, from);
+              e.shr(RAX, 1);
+              e.mov(vx, RAX);
+              break;
+            }
+          case 0x7:
+            e.alu(CMP, vy, vx);
+            e.setcc(CC_AE, RCX);
+            e.mov(vf, RCX);
+            e.mov(RAX, vy);
+            e.alu(SUB, RAX, vx);
+            e.alu_imm(AND, RAX, 0xff);
+            e.mov(vx, RAX);
+            break;
+          case 0xe:
+            {
+              int from = quirks.shift_vy ? vy : vx;
+              if (quirks.original_vf)
+                e.mov_imm(vf, 0);
+              else
+              {
+                e.mov(RCX, from);
+                e.shr(RCX, 7);
+                e.mov(vf, RCX);
+              }
+              e.mov(RAX, from);
+              e.shl(RAX, 1);
+              e.alu_imm(AND, RAX, 0xff);
+              e.mov(vx, RAX);
+              break;
+            }
+        }
+        written |= 1 << x;
+        if ((instruction & 0x000f) >= 0x4)
+          written |= 1 << 0xf;
+        break;
+      case 0xa000:
+        // Annn - LD I, addr
+        e.mov_imm(i_reg, nnn);
+        break;
+      case 0xb000:
+        // Bnnn - JP V0, addr (or Bxnn - JP Vx, addr)
+        e.mov(RAX, host[quirks.jump_vx ? x : 0]);
+        e.alu_imm(ADD, RAX, nnn);
+        e.store16(off_PC, RAX);
+        pc_written = true;
+        break;
+      case 0xf000:
+        switch (instruction & 0x00ff)
+        {
+          case 0x07:
+            // Fx07 - LD Vx, DT
+            e.load8(vx, off_timerD);
+            written |= 1 << x;
+            break;
+          case 0x15:
+            // Fx15 - LD DT, Vx
+            e.store8(off_timerD, vx);
+            break;
+          case 0x18:
+            // Fx18 - LD ST, Vx
+            e.store8(off_timerS, vx);
+            break;
+          case 0x1e:
+            // Fx1E - ADD I, Vx
+            if (quirks.add_i_vf)
+            {
+              e.mov(RCX, i_reg);
+              e.alu(ADD, RCX, vx);
+              e.alu_imm(CMP, RCX, 0xfff);
+              e.setcc(CC_A, RCX);
+              e.mov(vf, RCX);
+              written |= 1 << 0xf;
+            }
+            e.alu(ADD, i_reg, vx);
+            e.alu_imm(AND, i_reg, 0xffff);
+            break;
+          case 0x29:
+            // Fx29 - LD F, Vx
+            e.imul_imm(i_reg, vx, 5);
+            e.alu_imm(ADD, i_reg, 0x100);
+            break;
+          case 0x30:
+            // Fx30 - LD HF, Vx
+            e.imul_imm(i_reg, vx, 10);
+            e.alu_imm(ADD, i_reg, 0x150);
+            break;
+        }
+        break;
+    }
+  }
+
+  if (!pc_written)
+    e.store16_imm(off_PC, addr);
+  for (unsigned int v=0; v<16; v++)
+  {
+    if (written & (1 << v))
+      e.store8(off_V + v, host[v]);
+  }
+  if (uses_i)
+    e.store16(off_I, i_reg);
+  for (int r=sizeof(saved_regs)/sizeof(saved_regs[0])-1; r>=0; r--)
+    e.pop(saved_regs[r]);
+  e.ret();
+
+  //
+  // Copy into the executable buffer
+  //
+  if (code_used + buf.size() > code_size)
+    flush();
+  protect(code, code_used, buf.size(), PROT_READ | PROT_WRITE);
+  memcpy(code + code_used, buf.data(), buf.size());
+  protect(code, code_used, buf.size(), PROT_READ | PROT_EXEC);
+  b.code = reinterpret_cast<Code>(code + code_used);
+  b.bytes = addr - pc;
+  b.instructions = n;
+  b.failed = false;
+  code_used += buf.size();
+  for (unsigned int a=pc; a<addr; a++)
+    covered[a]++;
+
+  return &b;
+}
+
+#else
+
+Jit::Jit()
+{
+  flush();
+}
+
+Jit::~Jit()
+{
+}
+
+bool Jit::available()
+{
+  return false;
+}
+
+const Jit::Block *Jit::compile(uint16_t pc, Chip8Memory &memory)
+{
+  return nullptr;
+}
+
+#endif
+
+void Jit::invalidate_slow(unsigned int address)
+{
+  unsigned int first = address >= 2*max_block_limit ? address - 2*max_block_limit + 1 : 0;
+  for (unsigned int start=first; start<=address; start++)
+  {
+    Block &b = blocks[start];
+    if ((b.code || b.failed) && start + b.bytes > address)
+    {
+      for (unsigned int a=start; a<start+b.bytes && a<0x1000; a++)
+        covered[a]--;
+      b.code = nullptr;
+      b.failed = false;
+    }
+  }
+}
+
+void Jit::flush()
+{
+  memset(blocks, 0, sizeof(blocks));
+  memset(covered, 0, sizeof(covered));
+  code_used = 0;
+}
+
+void Jit::set_quirks(const QuirkFlags &q)
+{
+  if (q != quirks)
+  {
+    quirks = q;
+    flush();
+  }
+}
+
+void Jit::set_max_instructions(unsigned int n)
+{
+  if (n > max_block_limit)
+    n = max_block_limit;
+  if (n == 0)
+    n = 1;
+  if (n != max_block)
+  {
+    max_block = n;
+    flush();
+  }
+}
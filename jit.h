@@ -0,0 +1,84 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "memory.h"
+#include "quirks.h"
+#include "registers.h"
+
+// Dynamic recompiler: translates straight-line runs of Chip-8 instructions
+// (basic blocks) into native x86-64 code. Guest V registers and I are kept
+// in host registers for the length of a block.
+//
+// Only register-only instructions are translated. Blocks end at jumps and
+// skips, and just before anything that touches memory, the display, keys
+// or the RNG - those run in the interpreter.
+class Jit
+{
+public:
+  typedef void (*Code)(Registers *);
+
+  struct Block
+  {
+    Code code;             // nullptr if not translated yet
+    uint16_t bytes;        // Guest bytes covered by the block
+    uint8_t instructions;  // Guest instructions executed per run
+    bool failed;           // First instruction can't be translated
+  };
+
+  Jit();
+  ~Jit();
+
+  // Returns a translated block starting at pc, or nullptr if the
+  // instruction at pc must be interpreted
+  const Block *block(uint16_t pc, Chip8Memory &memory)
+  {
+    if (pc >= 0x1000)
+      return nullptr;
+    Block &b = blocks[pc];
+    if (b.code)
+      return &b;
+    if (b.failed)
+      return nullptr;
+    return compile(pc, memory);
+  }
+
+  // Drop every block containing address (self-modifying code)
+  void invalidate(unsigned int address)
+  {
+    if (address < 0x1000 && covered[address])
+      invalidate_slow(address);
+  }
+
+  void flush();
+
+  // Blocks are never longer than this many guest instructions
+  void set_max_instructions(unsigned int n);
+  unsigned int max_instructions() const { return max_block; }
+
+  // Blocks are translated for one quirk profile
+  void set_quirks(const QuirkFlags &q);
+
+  static bool available();
+
+private:
+  static const unsigned int max_block_limit = 64;
+  static const size_t code_size = 1 << 20; // 1MB
+
+  Block blocks[0x1000];         // Indexed by guest start address
+  uint8_t covered[0x1000];      // Number of blocks covering each guest byte
+  unsigned int max_block = max_block_limit;
+  QuirkFlags quirks = quirk_flags(Quirks::Legacy);
+
+  uint8_t *code = nullptr;      // Executable code buffer
+  size_t code_used = 0;
+  std::vector<uint8_t> buf;     // Code being emitted
+
+  const Block *compile(uint16_t pc, Chip8Memory &memory);
+  void invalidate_slow(unsigned int address);
+};
+
+#endif
@@ -0,0 +1,1115 @@
+#include "lockstep.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+// The register file is worked on with AVX2 intrinsics, compiled for AVX2
+// whatever the baseline is, and used if the host has it
+#if defined(__GNUC__) && defined(__x86_64__)
+#define LOCKSTEP_SIMD
+#define LOCKSTEP_TARGET __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+
+template <unsigned int Lanes>
+Lockstep<Lanes>::Lockstep(const Chip8 &settings)
+{
+  instructions_per_step = settings.instructions_per_step;
+  quirks = quirk_flags(settings.quirks);
+  for (unsigned int l=0; l<Lanes; l++)
+  {
+    lanes[l].reset(new Chip8());
+    lanes[l]->dispatch = Chip8::Dispatch::Switch;
+    lanes[l]->quirks = settings.quirks;
+    lanes[l]->instructions_per_step = settings.instructions_per_step;
+    lanes[l]->muted = true;
+  }
+#ifdef LOCKSTEP_SIMD
+  simd = __builtin_cpu_supports("avx2");
+#else
+  simd = false;
+#endif
+  memset(&reg, 0, sizeof(reg));
+  checked_out = Lanes == 32 ? ~0u : (1u << Lanes) - 1;
+  running = checked_out;
+}
+
+template <unsigned int Lanes>
+void Lockstep<Lanes>::loadProgram(char *rom)
+{
+  // The file is read once, and shared
+  lane(0).loadProgram(rom);
+  for (unsigned int l=1; l<Lanes; l++)
+    lane(l).loadProgram(*lanes[0]);
+}
+
+template <unsigned int Lanes>
+void Lockstep<Lanes>::loadProgram(const uint8_t *data, size_t size, const char *name)
+{
+  for (unsigned int l=0; l<Lanes; l++)
+    lane(l).loadProgram(data, size, name);
+}
+
+template <unsigned int Lanes>
+Chip8 &Lockstep<Lanes>::lane(unsigned int l)
+{
+  // Retired lanes are already in their Chip8s
+  if (simd && !(checked_out & (1u << l)))
+  {
+    if (running & (1u << l))
+      store(l);
+    checked_out |= 1u << l;
+  }
+  return *lanes[l];
+}
+
+// Copy lane l's state from its Chip8 into the register file
+template <unsigned int Lanes>
+void Lockstep<Lanes>::load(unsigned int l)
+{
+  const Chip8 &c = *lanes[l];
+  reg.PC[l] = c.reg.PC;
+  reg.I[l] = c.reg.I;
+  for (unsigned int v=0; v<16; v++)
+    reg.V[v][l] = c.reg.V[v];
+  reg.timerD[l] = c.reg.timerD;
+  reg.timerS[l] = c.reg.timerS;
+  reg.SP[l] = c.reg.SP;
+  for (unsigned int f=0; f<8; f++)
+    reg.hp_48_flags[f][l] = c.reg.hp_48_flags[f];
+  for (unsigned int k=0; k<16; k++)
+    reg.keys[k][l] = c.keys[k];
+  reg.extendedMode[l] = c.extendedMode;
+  reg.rng[l] = c.rng.state;
+  const uint8_t *memory = c.memory.data();
+  for (unsigned int a=0; a<0x1000; a++)
+    reg.memory[a][l] = memory[a];
+  memcpy(display[l], c.display, sizeof(display[l]));
+}
+
+// Copy lane l's state from the register file back to its Chip8, writing
+// only what changed so its dirty lines and rows stay accurate
+template <unsigned int Lanes>
+void Lockstep<Lanes>::store(unsigned int l)
+{
+  Chip8 &c = *lanes[l];
+  c.reg.PC = reg.PC[l];
+  c.reg.I = reg.I[l];
+  for (unsigned int v=0; v<16; v++)
+    c.reg.V[v] = reg.V[v][l];
+  c.reg.timerD = reg.timerD[l];
+  c.reg.timerS = reg.timerS[l];
+  c.reg.SP = reg.SP[l];
+  for (unsigned int f=0; f<8; f++)
+    c.reg.hp_48_flags[f] = reg.hp_48_flags[f][l];
+  for (unsigned int k=0; k<16; k++)
+    c.keys[k] = reg.keys[k][l];
+  c.extendedMode = reg.extendedMode[l];
+  c.rng.state = reg.rng[l];
+  const uint8_t *memory = c.memory.data();
+  for (unsigned int a=0; a<0x1000; a++)
+  {
+    if (memory[a] != reg.memory[a][l])
+      c.write8(a, reg.memory[a][l]);
+  }
+  for (unsigned int y=0; y<Chip8::extHeight; y++)
+  {
+    if (memcmp(c.display[y], display[l][y], sizeof(display[l][y])) != 0)
+    {
+      memcpy(c.display[y], display[l][y], sizeof(display[l][y]));
+      c.display_dirty |= (uint64_t)1 << y;
+      c.changed_rows |= (uint64_t)1 << y;
+    }
+  }
+}
+
+// Ops::drw_original for lane l
+template <unsigned int Lanes>
+void Lockstep<Lanes>::draw_original(unsigned int l, unsigned int x, unsigned int y, unsigned int n)
+{
+  uint8_t &VF = reg.V[0xf][l];
+  VF = 0;
+  bool extended = reg.extendedMode[l];
+  bool big = extended && n == 0;
+  unsigned int rows = big ? 16 : n;
+  unsigned int cols = big ? 16 : 8;
+  unsigned int w = extended ? Chip8::extWidth : Chip8::width;
+  unsigned int h = extended ? Chip8::extHeight : Chip8::height;
+  unsigned int scale = extended ? 1 : 2;
+  for (unsigned int row=0; row<rows; row++)
+  {
+    unsigned int a = big ? reg.I[l] + row*2 : reg.I[l] + row;
+    uint16_t bits = reg.memory[a & 0xfff][l] << 8;
+    if (big)
+      bits |= reg.memory[(a+1) & 0xfff][l];
+    for (unsigned int col=0; col<cols; col++)
+    {
+      if (!(bits & (0x8000 >> col)))
+        continue;
+      unsigned int px = (reg.V[x][l] + col)%w * scale;
+      unsigned int py = (reg.V[y][l] + row)%h * scale;
+      uint64_t mask = (uint64_t)1 << (63 - px%64);
+      if (display[l][py][px/64] & mask)
+        VF = 1;
+      for (unsigned int i=0; i<scale; i++)
+      {
+        for (unsigned int j=0; j<scale; j++)
+          display[l][py + i][(px + j)/64] ^= mask >> j;
+      }
+    }
+  }
+}
+
+// Ops::scd, scr and scl for lane l
+template <unsigned int Lanes>
+void Lockstep<Lanes>::scroll(unsigned int l, uint16_t instruction)
+{
+  uint64_t (*rows)[2] = display[l];
+  bool extended = reg.extendedMode[l];
+  if ((instruction & 0x00f0) == 0x00c0)
+  {
+    unsigned int n = extended ? instruction & 0xf : (instruction & 0xf)*2;
+    memmove(rows[n], rows[0], sizeof(rows[0])*(Chip8::extHeight - n));
+    memset(rows, 0, sizeof(rows[0])*n);
+    return;
+  }
+  unsigned int n = extended ? 4 : 8;
+  for (unsigned int y=0; y<Chip8::extHeight; y++)
+  {
+    uint64_t *row = rows[y];
+    if (instruction == 0x00fb)
+    {
+      row[1] = (row[1] >> n) | (row[0] << (64 - n));
+      row[0] >>= n;
+    }
+    else
+    {
+      row[0] = (row[0] << n) | (row[1] >> (64 - n));
+      row[1] <<= n;
+    }
+  }
+}
+
+#ifdef LOCKSTEP_SIMD
+
+//
+// Rows of the register file: one byte, or half of the 16-bit words, per lane
+//
+namespace {
+
+typedef __m256i Row;
+
+// Returned by execute() when the lanes go to different PCs, and when they
+// stop at the instruction (00FD, or one that's unknown)
+const uint32_t diverged = 0x10000;
+const uint32_t halted = 0x20000;
+const uint32_t faulted = 0x30000;
+
+LOCKSTEP_TARGET inline Row ld(const void *p)
+{
+  return _mm256_loadu_si256(static_cast<const Row *>(p));
+}
+
+LOCKSTEP_TARGET inline void st(void *p, Row v)
+{
+  _mm256_storeu_si256(static_cast<Row *>(p), v);
+}
+
+LOCKSTEP_TARGET inline Row splat(uint8_t b) { return _mm256_set1_epi8(b); }
+LOCKSTEP_TARGET inline Row splat16(uint16_t w) { return _mm256_set1_epi16(w); }
+
+// One bit per lane, set where m is
+LOCKSTEP_TARGET inline uint32_t lane_bits(Row m)
+{
+  return _mm256_movemask_epi8(m);
+}
+
+// 0xff where a >= b, unsigned
+LOCKSTEP_TARGET inline Row ge(Row a, Row b)
+{
+  return _mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a);
+}
+
+LOCKSTEP_TARGET inline Row ge16(Row a, Row b)
+{
+  return _mm256_cmpeq_epi16(_mm256_max_epu16(a, b), a);
+}
+
+// Bytes to words for lanes 0-15 and 16-31: masks sign extended, values
+// zero extended
+LOCKSTEP_TARGET inline Row mask_lo(Row m) { return _mm256_cvtepi8_epi16(_mm256_castsi256_si128(m)); }
+LOCKSTEP_TARGET inline Row mask_hi(Row m) { return _mm256_cvtepi8_epi16(_mm256_extracti128_si256(m, 1)); }
+LOCKSTEP_TARGET inline Row word_lo(Row v) { return _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)); }
+LOCKSTEP_TARGET inline Row word_hi(Row v) { return _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)); }
+
+// And back: the packs work within 128-bit halves, so put the quarters back
+// in lane order
+LOCKSTEP_TARGET inline Row pack_masks(Row lo, Row hi)
+{
+  return _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xd8);
+}
+
+LOCKSTEP_TARGET inline Row pack_bytes(Row lo, Row hi)
+{
+  return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8);
+}
+
+// Write v to the lanes in m of a row. Full: m is every lane, so there's
+// nothing to blend.
+template <bool Full>
+LOCKSTEP_TARGET inline void put(uint8_t *row, Row m, Row v)
+{
+  st(row, Full ? v : _mm256_blendv_epi8(ld(row), v, m));
+}
+
+template <bool Full>
+LOCKSTEP_TARGET inline void put16(uint16_t *row, Row m, Row lo, Row hi)
+{
+  if (!Full)
+  {
+    lo = _mm256_blendv_epi8(ld(row), lo, mask_lo(m));
+    hi = _mm256_blendv_epi8(ld(row + 16), hi, mask_hi(m));
+  }
+  st(row, lo);
+  st(row + 16, hi);
+}
+
+// Whether the lanes in bits all have the same value in a row
+LOCKSTEP_TARGET inline bool same(const uint8_t *row, uint32_t bits)
+{
+  Row eq = _mm256_cmpeq_epi8(ld(row), splat(row[__builtin_ctz(bits)]));
+  return (lane_bits(eq) & bits) == bits;
+}
+
+LOCKSTEP_TARGET inline bool same16(const uint16_t *row, uint32_t bits)
+{
+  Row w = splat16(row[__builtin_ctz(bits)]);
+  Row eq = pack_masks(_mm256_cmpeq_epi16(ld(row), w),
+                      _mm256_cmpeq_epi16(ld(row + 16), w));
+  return (lane_bits(eq) & bits) == bits;
+}
+
+// The lanes in bits go to to where taken is set and otherwise elsewhere.
+// Returns where they all go, or diverged with each lane's PC in next.
+LOCKSTEP_TARGET inline uint32_t branch(Row taken, uint32_t bits, uint16_t to,
+                                       uint16_t otherwise, uint16_t *next)
+{
+  uint32_t t = lane_bits(taken) & bits;
+  if (t == bits)
+    return to;
+  if (!t)
+    return otherwise;
+  Row a = splat16(to);
+  Row b = splat16(otherwise);
+  st(next, _mm256_blendv_epi8(b, a, mask_lo(taken)));
+  st(next + 16, _mm256_blendv_epi8(b, a, mask_hi(taken)));
+  return diverged;
+}
+
+}
+
+// Refresh shared and differs for an address after a write
+template <unsigned int Lanes>
+LOCKSTEP_TARGET void Lockstep<Lanes>::compare(unsigned int address)
+{
+  if (!running)
+    return;
+  shared[address] = reg.memory[address][__builtin_ctz(running)];
+  differs[address] = !same(reg.memory[address], running);
+}
+
+// Ops::drw for the lanes in bits, all in one display mode. Where each
+// sprite row goes in each lane's display is worked out for all the lanes
+// at once, then each lane XORs the rows into its display.
+template <unsigned int Lanes>
+LOCKSTEP_TARGET void Lockstep<Lanes>::draw(uint32_t bits, unsigned int x, unsigned int y,
+                                           unsigned int n, bool extended)
+{
+  static const unsigned int groups = (Lanes + 3)/4; // Lanes in 64-bit words
+  static const uint8_t clipped = 0xff; // Row in at for nothing drawn
+  bool clip = quirks.clip_sprites;
+  unsigned int rows = extended && n == 0 ? 16 : n;
+  uint8_t size = extended ? Chip8::extHeight : Chip8::height;
+
+  // Each lane's x as a shift within a display word, and whether it starts
+  // in the second word
+  Row vx = ld(reg.V[x]);
+  if (!extended)
+    vx = _mm256_add_epi8(_mm256_and_si256(vx, splat(0x3f)), _mm256_and_si256(vx, splat(0x3f)));
+  Row shift[groups], second[groups];
+  for (unsigned int g=0; g<groups; g++)
+  {
+    Row to = _mm256_cvtepu8_epi64(_mm256_castsi256_si128(
+      _mm256_permutevar8x32_epi32(vx, _mm256_set1_epi32(g))));
+    shift[g] = _mm256_and_si256(to, _mm256_set1_epi64x(0x3f));
+    second[g] = _mm256_cmpeq_epi64(_mm256_and_si256(to, _mm256_set1_epi64x(0x40)),
+                                   _mm256_set1_epi64x(0x40));
+  }
+
+  uint64_t first[16][Lanes], spill[16][Lanes];
+  uint8_t at[16][columns];
+  bool same_i = same16(reg.I, bits);
+  Row vy = ld(reg.V[y]);
+  for (unsigned int row=0; row<rows; row++)
+  {
+    // The sprite row's bytes
+    Row upper, lower;
+    if (same_i)
+    {
+      uint16_t I = reg.I[__builtin_ctz(bits)];
+      unsigned int a = extended && n == 0 ? I + row*2 : I + row;
+      upper = ld(reg.memory[a & 0xfff]);
+      lower = ld(reg.memory[(a+1) & 0xfff]);
+    }
+    else
+    {
+      uint8_t u[columns] = {}, v[columns] = {};
+      for (uint32_t b=bits; b; b&=b-1)
+      {
+        unsigned int l = __builtin_ctz(b);
+        unsigned int a = extended && n == 0 ? reg.I[l] + row*2 : reg.I[l] + row;
+        u[l] = reg.memory[a & 0xfff][l];
+        v[l] = reg.memory[(a+1) & 0xfff][l];
+      }
+      upper = ld(u);
+      lower = ld(v);
+    }
+
+    // Which display row it goes on, or clipped for rows off the bottom
+    Row py;
+    if (clip)
+    {
+      py = _mm256_add_epi8(_mm256_and_si256(vy, splat(size-1)), splat(row));
+      Row inside = _mm256_cmpeq_epi8(_mm256_min_epu8(py, splat(size-1)), py);
+      py = _mm256_or_si256(py, _mm256_andnot_si256(inside, splat(clipped)));
+    }
+    else
+      py = _mm256_and_si256(_mm256_add_epi8(vy, splat(row)), splat(size-1));
+    st(at[row], py);
+
+    // As 16 bits, the leftmost pixel in the top bit
+    Row pattern[2];
+    for (unsigned int h=0; h<2; h++)
+    {
+      Row p = h ? word_hi(upper) : word_lo(upper);
+      if (!extended)
+      {
+        // Each pixel doubled
+        p = _mm256_and_si256(_mm256_or_si256(p, _mm256_slli_epi16(p, 4)), splat16(0x0f0f));
+        p = _mm256_and_si256(_mm256_or_si256(p, _mm256_slli_epi16(p, 2)), splat16(0x3333));
+        p = _mm256_and_si256(_mm256_or_si256(p, _mm256_slli_epi16(p, 1)), splat16(0x5555));
+        p = _mm256_or_si256(p, _mm256_slli_epi16(p, 1));
+      }
+      else if (n == 0)
+        p = _mm256_or_si256(_mm256_slli_epi16(p, 8), h ? word_hi(lower) : word_lo(lower));
+      else
+        p = _mm256_slli_epi16(p, 8);
+      pattern[h] = p;
+    }
+
+    // Shifted into place four lanes at a time: the part in the first word
+    // and the part spilling into the next, which wraps around to the left
+    // edge unless sprites are clipped
+    for (unsigned int g=0; g<groups; g++)
+    {
+      Row pick = _mm256_setr_epi32(g%4*2, g%4*2 + 1, 0, 0, 0, 0, 0, 0);
+      Row p = _mm256_permutevar8x32_epi32(pattern[g/4], pick);
+      p = _mm256_slli_epi64(_mm256_cvtepu16_epi64(_mm256_castsi256_si128(p)), 48);
+      Row left = _mm256_srlv_epi64(p, shift[g]);
+      Row right = _mm256_sllv_epi64(p, _mm256_sub_epi64(_mm256_set1_epi64x(64), shift[g]));
+      Row wrapped = clip ? _mm256_setzero_si256() : right;
+      Row a = _mm256_blendv_epi8(left, wrapped, second[g]);
+      Row b = _mm256_blendv_epi8(right, left, second[g]);
+      if (g*4 + 4 <= Lanes)
+      {
+        st(first[row] + g*4, a);
+        st(spill[row] + g*4, b);
+      }
+      else
+      {
+        // Fewer than four lanes left
+        uint64_t wa[4], wb[4];
+        st(wa, a);
+        st(wb, b);
+        memcpy(first[row] + g*4, wa, (Lanes - g*4)*sizeof(uint64_t));
+        memcpy(spill[row] + g*4, wb, (Lanes - g*4)*sizeof(uint64_t));
+      }
+    }
+  }
+
+  unsigned int count = extended ? 1 : 2; // Display rows per sprite row
+  for (uint32_t b=bits; b; b&=b-1)
+  {
+    unsigned int l = __builtin_ctz(b);
+    uint64_t (*rows_l)[2] = display[l];
+    uint64_t hit = 0;
+    for (unsigned int row=0; row<rows; row++)
+    {
+      if (at[row][l] == clipped)
+        continue;
+      uint64_t a = first[row][l], c = spill[row][l];
+      for (unsigned int i=0; i<count; i++)
+      {
+        uint64_t *d = rows_l[at[row][l]*count + i];
+        hit |= (d[0] & a) | (d[1] & c);
+        d[0] ^= a;
+        d[1] ^= c;
+      }
+    }
+    reg.V[0xf][l] = hit != 0;
+  }
+}
+
+// Run instruction, at pc, for the lanes in mask (0xff per lane; bits has
+// the same as a bit per lane). Full: mask is every lane. Returns the PC the
+// lanes go to next, or diverged if that isn't the same for all of them.
+//
+// Each lane must see exactly what Ops would do to it, including the order
+// VF is written in when x or y is F.
+template <unsigned int Lanes>
+template <bool Full>
+LOCKSTEP_TARGET inline uint32_t Lockstep<Lanes>::execute(uint16_t instruction, const uint8_t *mask,
+                                                         uint32_t bits, uint16_t pc)
+{
+  unsigned int x = (instruction & 0x0f00)>>8;
+  unsigned int y = (instruction & 0x00f0)>>4;
+  uint8_t kk = instruction & 0x00ff;
+  uint16_t nnn = instruction & 0x0fff;
+  uint8_t *Vx = reg.V[x];
+  uint8_t *Vy = reg.V[y];
+  uint8_t *VF = reg.V[0xf];
+  unsigned int first = __builtin_ctz(bits);
+  Row m = ld(mask);
+  Row one = splat(1);
+  uint16_t after = pc + 2;
+  uint16_t skip = pc + 4;
+
+  switch (instruction & 0xf000)
+  {
+    case 0x0000:
+      switch (instruction & 0x00ff)
+      {
+        case 0x00e0:
+          for (uint32_t b=bits; b; b&=b-1)
+            memset(display[__builtin_ctz(b)], 0, sizeof(display[0]));
+          return after;
+        case 0x00ee:
+          {
+            uint8_t sp = reg.SP[first];
+            uint32_t to;
+            if (same(reg.SP, bits) && !differs[sp] && !differs[sp+1])
+              to = shared[sp] << 8 | shared[sp+1];
+            else
+            {
+              for (uint32_t b=bits; b; b&=b-1)
+              {
+                unsigned int l = __builtin_ctz(b);
+                next[l] = reg.memory[reg.SP[l]][l] << 8 | reg.memory[reg.SP[l] + 1][l];
+              }
+              to = same16(next, bits) ? next[first] : diverged;
+            }
+            put<Full>(reg.SP, m, _mm256_sub_epi8(ld(reg.SP), splat(2)));
+            return to;
+          }
+        case 0x00fb:
+        case 0x00fc:
+          for (uint32_t b=bits; b; b&=b-1)
+            scroll(__builtin_ctz(b), instruction);
+          return after;
+        case 0x00fd:
+          return halted;
+        case 0x00fe:
+          put<Full>(reg.extendedMode, m, splat(0));
+          return after;
+        case 0x00ff:
+          put<Full>(reg.extendedMode, m, one);
+          return after;
+      }
+      if ((instruction & 0x00f0) == 0x00c0)
+      {
+        for (uint32_t b=bits; b; b&=b-1)
+          scroll(__builtin_ctz(b), instruction);
+        return after;
+      }
+      break;
+    case 0x1000:
+      return nnn;
+    case 0x2000:
+      {
+        put<Full>(reg.SP, m, _mm256_add_epi8(ld(reg.SP), splat(2)));
+        if (same(reg.SP, bits))
+        {
+          uint8_t sp = reg.SP[first];
+          put<Full>(reg.memory[sp], m, splat(after >> 8));
+          put<Full>(reg.memory[sp+1], m, splat(after & 0xff));
+          compare(sp);
+          compare(sp+1);
+        }
+        else
+        {
+          for (uint32_t b=bits; b; b&=b-1)
+          {
+            unsigned int l = __builtin_ctz(b);
+            uint8_t sp = reg.SP[l];
+            reg.memory[sp][l] = after >> 8;
+            reg.memory[sp+1][l] = after & 0xff;
+            compare(sp);
+            compare(sp+1);
+          }
+        }
+        return nnn;
+      }
+    case 0x3000:
+      return branch(_mm256_cmpeq_epi8(ld(Vx), splat(kk)), bits, skip, after, next);
+    case 0x4000:
+      return branch(_mm256_cmpeq_epi8(ld(Vx), splat(kk)), bits, after, skip, next);
+    case 0x5000:
+      return branch(_mm256_cmpeq_epi8(ld(Vx), ld(Vy)), bits, skip, after, next);
+    case 0x6000:
+      put<Full>(Vx, m, splat(kk));
+      return after;
+    case 0x7000:
+      put<Full>(Vx, m, _mm256_add_epi8(ld(Vx), splat(kk)));
+      return after;
+    case 0x8000:
+      {
+        // Any VF result is written first, as Ops does, so the operation
+        // itself reads Vx and Vy again
+        const uint8_t *from = quirks.shift_vy ? Vy : Vx;
+        switch (instruction & 0x000f)
+        {
+          case 0x0:
+            put<Full>(Vx, m, ld(Vy));
+            return after;
+          case 0x1:
+            put<Full>(Vx, m, _mm256_or_si256(ld(Vx), ld(Vy)));
+            return after;
+          case 0x2:
+            put<Full>(Vx, m, _mm256_and_si256(ld(Vx), ld(Vy)));
+            return after;
+          case 0x3:
+            put<Full>(Vx, m, _mm256_xor_si256(ld(Vx), ld(Vy)));
+            return after;
+          case 0x4:
+            {
+              // Carried if the saturating sum isn't the wrapped one
+              Row a = ld(Vx), b = ld(Vy);
+              Row wrapped = _mm256_cmpeq_epi8(_mm256_adds_epu8(a, b), _mm256_add_epi8(a, b));
+              put<Full>(VF, m, _mm256_andnot_si256(wrapped, one));
+              put<Full>(Vx, m, _mm256_add_epi8(ld(Vx), ld(Vy)));
+              return after;
+            }
+          case 0x5:
+            put<Full>(VF, m, _mm256_and_si256(ge(ld(Vx), ld(Vy)), one));
+            put<Full>(Vx, m, _mm256_sub_epi8(ld(Vx), ld(Vy)));
+            return after;
+          case 0x6:
+            put<Full>(VF, m, _mm256_and_si256(ld(from), one));
+            put<Full>(Vx, m, _mm256_and_si256(_mm256_srli_epi16(ld(from), 1), splat(0x7f)));
+            return after;
+          case 0x7:
+            put<Full>(VF, m, _mm256_and_si256(ge(ld(Vy), ld(Vx)), one));
+            put<Full>(Vx, m, _mm256_sub_epi8(ld(Vy), ld(Vx)));
+            return after;
+          case 0xe:
+            put<Full>(VF, m, quirks.original_vf ? _mm256_setzero_si256()
+                                                : _mm256_and_si256(_mm256_srli_epi16(ld(from), 7), one));
+            put<Full>(Vx, m, _mm256_add_epi8(ld(from), ld(from)));
+            return after;
+        }
+        break;
+      }
+    case 0x9000:
+      return branch(_mm256_cmpeq_epi8(ld(Vx), ld(Vy)), bits, after, skip, next);
+    case 0xa000:
+      put16<Full>(reg.I, m, splat16(nnn), splat16(nnn));
+      return after;
+    case 0xb000:
+      {
+        const uint8_t *V0 = reg.V[quirks.jump_vx ? x : 0];
+        if (same(V0, bits))
+          return (uint16_t)(V0[first] + nnn);
+        Row v = ld(V0);
+        st(next, _mm256_add_epi16(word_lo(v), splat16(nnn)));
+        st(next + 16, _mm256_add_epi16(word_hi(v), splat16(nnn)));
+        return diverged;
+      }
+    case 0xc000:
+      {
+        // xorshift32 (see Rng) eight lanes at a time, keeping the top byte
+        Row top[4];
+        for (unsigned int q=0; q<4; q++)
+        {
+          Row s = ld(reg.rng + q*8);
+          Row r = _mm256_xor_si256(s, _mm256_slli_epi32(s, 13));
+          r = _mm256_xor_si256(r, _mm256_srli_epi32(r, 17));
+          r = _mm256_xor_si256(r, _mm256_slli_epi32(r, 5));
+          if (!Full)
+          {
+            Row mq = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(mask + q*8)));
+            r = _mm256_blendv_epi8(s, r, mq);
+          }
+          st(reg.rng + q*8, r);
+          top[q] = _mm256_srli_epi32(r, 24);
+        }
+        Row bytes = _mm256_packus_epi16(_mm256_packus_epi32(top[0], top[1]),
+                                        _mm256_packus_epi32(top[2], top[3]));
+        bytes = _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        put<Full>(Vx, m, _mm256_and_si256(bytes, splat(kk)));
+        return after;
+      }
+    case 0xd000:
+      {
+        if (quirks.original_vf && (x == 0xf || y == 0xf))
+        {
+          for (uint32_t b=bits; b; b&=b-1)
+            draw_original(__builtin_ctz(b), x, y, instruction & 0x000f);
+          return after;
+        }
+        uint32_t extended = lane_bits(_mm256_cmpeq_epi8(ld(reg.extendedMode), one)) & bits;
+        if (bits & ~extended)
+          draw(bits & ~extended, x, y, instruction & 0x000f, false);
+        if (extended)
+          draw(extended, x, y, instruction & 0x000f, true);
+        return after;
+      }
+    case 0xe000:
+      if (kk == 0x9e || kk == 0xa1)
+      {
+        uint8_t pressed[columns] = {};
+        for (uint32_t b=bits; b; b&=b-1)
+        {
+          unsigned int l = __builtin_ctz(b);
+          pressed[l] = reg.keys[Vx[l] & 0xf][l] ? 0xff : 0;
+        }
+        if (kk == 0x9e)
+          return branch(ld(pressed), bits, skip, after, next);
+        return branch(ld(pressed), bits, after, skip, next);
+      }
+      break;
+    case 0xf000:
+      switch (kk)
+      {
+        case 0x07:
+          put<Full>(Vx, m, ld(reg.timerD));
+          return after;
+        case 0x0a:
+          {
+            // Lanes with no key pressed stay on this instruction
+            uint8_t pressed[columns] = {};
+            for (uint32_t b=bits; b; b&=b-1)
+            {
+              unsigned int l = __builtin_ctz(b);
+              for (unsigned int k=0; k<16; k++)
+              {
+                if (reg.keys[k][l])
+                {
+                  Vx[l] = k;
+                  pressed[l] = 0xff;
+                  break;
+                }
+              }
+            }
+            return branch(ld(pressed), bits, after, pc, next);
+          }
+        case 0x15:
+          put<Full>(reg.timerD, m, ld(Vx));
+          return after;
+        case 0x18:
+          put<Full>(reg.timerS, m, ld(Vx));
+          return after;
+        case 0x1e:
+          {
+            if (quirks.add_i_vf)
+            {
+              // I + Vx past 0xfff, where I may already be
+              Row v = ld(Vx);
+              Row lo = ld(reg.I), hi = ld(reg.I + 16);
+              Row limit = splat16(0x1000);
+              Row over_lo = _mm256_or_si256(ge16(lo, limit), ge16(_mm256_add_epi16(lo, word_lo(v)), limit));
+              Row over_hi = _mm256_or_si256(ge16(hi, limit), ge16(_mm256_add_epi16(hi, word_hi(v)), limit));
+              put<Full>(VF, m, _mm256_and_si256(pack_masks(over_lo, over_hi), one));
+            }
+            Row v = ld(Vx);
+            put16<Full>(reg.I, m, _mm256_add_epi16(ld(reg.I), word_lo(v)),
+                        _mm256_add_epi16(ld(reg.I + 16), word_hi(v)));
+            return after;
+          }
+        case 0x29:
+        case 0x30:
+          {
+            // Font sprites: 5 bytes a digit at 0x100, 10 at 0x150
+            Row base = splat16(kk == 0x29 ? 0x100 : 0x150);
+            Row size = splat16(kk == 0x29 ? 5 : 10);
+            Row v = ld(Vx);
+            put16<Full>(reg.I, m, _mm256_add_epi16(base, _mm256_mullo_epi16(word_lo(v), size)),
+                        _mm256_add_epi16(base, _mm256_mullo_epi16(word_hi(v), size)));
+            return after;
+          }
+        case 0x33:
+          if (same16(reg.I, bits))
+          {
+            // v/100 is v*41 >> 12 and v/10 is v*205 >> 11, for bytes
+            Row v[2] = {word_lo(ld(Vx)), word_hi(ld(Vx))};
+            Row digits[3][2];
+            for (unsigned int h=0; h<2; h++)
+            {
+              Row hundreds = _mm256_srli_epi16(_mm256_mullo_epi16(v[h], splat16(41)), 12);
+              Row rest = _mm256_sub_epi16(v[h], _mm256_mullo_epi16(hundreds, splat16(100)));
+              Row tens = _mm256_srli_epi16(_mm256_mullo_epi16(rest, splat16(205)), 11);
+              digits[0][h] = hundreds;
+              digits[1][h] = tens;
+              digits[2][h] = _mm256_sub_epi16(rest, _mm256_mullo_epi16(tens, splat16(10)));
+            }
+            uint16_t I = reg.I[first];
+            for (unsigned int d=0; d<3; d++)
+            {
+              unsigned int a = (I + d) & 0xfff;
+              put<Full>(reg.memory[a], m, pack_bytes(digits[d][0], digits[d][1]));
+              compare(a);
+            }
+          }
+          else
+          {
+            for (uint32_t b=bits; b; b&=b-1)
+            {
+              unsigned int l = __builtin_ctz(b);
+              uint8_t v = Vx[l];
+              uint8_t digits[3] = {(uint8_t)(v/100), (uint8_t)((v%100)/10), (uint8_t)(v%10)};
+              for (unsigned int d=0; d<3; d++)
+              {
+                unsigned int a = (reg.I[l] + d) & 0xfff;
+                reg.memory[a][l] = digits[d];
+                compare(a);
+              }
+            }
+          }
+          return after;
+        case 0x55:
+        case 0x65:
+          {
+            if (same16(reg.I, bits))
+            {
+              uint16_t I = reg.I[first];
+              for (unsigned int j=0; j<=x; j++)
+              {
+                unsigned int a = (I + j) & 0xfff;
+                if (kk == 0x55)
+                {
+                  put<Full>(reg.memory[a], m, ld(reg.V[j]));
+                  compare(a);
+                }
+                else
+                  put<Full>(reg.V[j], m, ld(reg.memory[a]));
+              }
+            }
+            else
+            {
+              for (uint32_t b=bits; b; b&=b-1)
+              {
+                unsigned int l = __builtin_ctz(b);
+                for (unsigned int j=0; j<=x; j++)
+                {
+                  unsigned int a = (reg.I[l] + j) & 0xfff;
+                  if (kk == 0x55)
+                  {
+                    reg.memory[a][l] = reg.V[j][l];
+                    compare(a);
+                  }
+                  else
+                    reg.V[j][l] = reg.memory[a][l];
+                }
+              }
+            }
+            if (quirks.load_store_i)
+            {
+              Row n = splat16(x + 1);
+              put16<Full>(reg.I, m, _mm256_add_epi16(ld(reg.I), n), _mm256_add_epi16(ld(reg.I + 16), n));
+            }
+            return after;
+          }
+        case 0x75:
+          for (unsigned int i=0; i<(x & 7); i++)
+            put<Full>(reg.hp_48_flags[i], m, ld(reg.V[i]));
+          return after;
+        case 0x85:
+          for (unsigned int i=0; i<(x & 7); i++)
+            put<Full>(reg.V[i], m, ld(reg.hp_48_flags[i]));
+          return after;
+      }
+      break;
+  }
+  return faulted;
+}
+
+template <unsigned int Lanes>
+LOCKSTEP_TARGET void Lockstep<Lanes>::update_timers()
+{
+  st(reg.timerD, _mm256_subs_epu8(ld(reg.timerD), splat(1)));
+  st(reg.timerS, _mm256_subs_epu8(ld(reg.timerS), splat(1)));
+}
+
+// Run every running lane for count instructions, at most 0xffff
+template <unsigned int Lanes>
+LOCKSTEP_TARGET void Lockstep<Lanes>::run(unsigned int count)
+{
+  // Retired lanes and the padding columns are never run, and are written
+  // to freely when every lane is together (they're reloaded when a lane
+  // is restarted)
+  uint32_t all = running;
+  if (!all)
+    return;
+  uint8_t every[columns];
+  for (unsigned int l=0; l<columns; l++)
+    every[l] = (all >> l) & 1 ? 0xff : 0;
+  Row lanes_lo = mask_lo(ld(every));
+  Row lanes_hi = mask_hi(ld(every));
+  Row zero = _mm256_setzero_si256();
+
+  // Instructions left for each lane, while they're apart (0 for the lanes
+  // which aren't run)
+  uint16_t left[columns];
+  unsigned int together_left = count;
+  uint16_t pc = reg.PC[__builtin_ctz(all)];
+  bool together = same16(reg.PC, all);
+  if (!together)
+  {
+    st(left, _mm256_and_si256(splat16(count), lanes_lo));
+    st(left + 16, _mm256_and_si256(splat16(count), lanes_hi));
+  }
+
+  for (;;)
+  {
+    // While every lane is at the same PC, with the same number of
+    // instructions left, the PC is a scalar and there's nothing to blend
+    if (together)
+    {
+      bool branched = false;
+      for (; together_left; together_left--)
+      {
+        unsigned int a = pc & 0xfff, b = (pc+1) & 0xfff;
+        if (differs[a] | differs[b])
+          break;
+        uint16_t instruction = shared[a] << 8 | shared[b];
+        uint32_t to = execute<true>(instruction, every, all, pc);
+        decoded++;
+        lane_instructions += __builtin_popcount(all);
+        if (to > diverged)
+        {
+          retire(all, pc, to == halted ? Chip8::Status::Halted : Chip8::Status::Faulted);
+          return;
+        }
+        if (to == diverged)
+        {
+          together_left--;
+          branched = true;
+          break;
+        }
+        pc = to;
+      }
+
+      // The lanes are apart if they branched, leaving each lane's PC in
+      // next, or if their code differs at pc
+      if (!branched)
+      {
+        st(next, splat16(pc));
+        st(next + 16, splat16(pc));
+      }
+      st(reg.PC, ld(next));
+      st(reg.PC + 16, ld(next + 16));
+      if (!together_left)
+        return;
+      st(left, _mm256_and_si256(splat16(together_left), lanes_lo));
+      st(left + 16, _mm256_and_si256(splat16(together_left), lanes_hi));
+      together = false;
+    }
+
+    // Otherwise run the lowest PC of the lanes which haven't finished, so
+    // the ones behind catch up
+    for (;;)
+    {
+      Row left_lo = ld(left), left_hi = ld(left + 16);
+      Row done_lo = _mm256_cmpeq_epi16(left_lo, zero);
+      Row done_hi = _mm256_cmpeq_epi16(left_hi, zero);
+      if (lane_bits(_mm256_and_si256(done_lo, done_hi)) == ~0u)
+        return;
+
+      // Finished lanes count as 0xffff, so never come lowest unless an
+      // unfinished one is there too
+      Row pc_lo = ld(reg.PC), pc_hi = ld(reg.PC + 16);
+      Row key = _mm256_min_epu16(_mm256_or_si256(pc_lo, done_lo), _mm256_or_si256(pc_hi, done_hi));
+      __m128i key8 = _mm_min_epu16(_mm256_castsi256_si128(key), _mm256_extracti128_si256(key, 1));
+      uint16_t lowest = _mm_cvtsi128_si32(_mm_minpos_epu16(key8));
+      Row at = splat16(lowest);
+      Row m = pack_masks(_mm256_andnot_si256(done_lo, _mm256_cmpeq_epi16(pc_lo, at)),
+                         _mm256_andnot_si256(done_hi, _mm256_cmpeq_epi16(pc_hi, at)));
+      uint32_t bits = lane_bits(m);
+
+      // Lanes whose code differs at the PC wait for a later round
+      unsigned int a = lowest & 0xfff, b = (lowest+1) & 0xfff;
+      uint16_t instruction;
+      if (differs[a] | differs[b])
+      {
+        unsigned int first = __builtin_ctz(bits);
+        uint8_t upper = reg.memory[a][first];
+        uint8_t lower = reg.memory[b][first];
+        m = _mm256_and_si256(m, _mm256_and_si256(_mm256_cmpeq_epi8(ld(reg.memory[a]), splat(upper)),
+                                                 _mm256_cmpeq_epi8(ld(reg.memory[b]), splat(lower))));
+        bits = lane_bits(m);
+        instruction = upper << 8 | lower;
+      }
+      else
+        instruction = shared[a] << 8 | shared[b];
+
+      uint8_t mask[columns];
+      st(mask, m);
+      uint32_t to = execute<false>(instruction, mask, bits, lowest);
+      decoded++;
+      lane_instructions += __builtin_popcount(bits);
+
+      if (to > diverged)
+      {
+        // These lanes stop; the rest carry on without them
+        retire(bits, lowest, to == halted ? Chip8::Status::Halted : Chip8::Status::Faulted);
+        for (unsigned int a=0; a<0x1000; a++)
+          compare(a);
+        Row ran_lo = mask_lo(m), ran_hi = mask_hi(m);
+        st(left, _mm256_andnot_si256(ran_lo, left_lo));
+        st(left + 16, _mm256_andnot_si256(ran_hi, left_hi));
+        all = running;
+        if (!all)
+          return;
+        for (unsigned int l=0; l<columns; l++)
+          every[l] = (all >> l) & 1 ? 0xff : 0;
+        lanes_lo = mask_lo(ld(every));
+        lanes_hi = mask_hi(ld(every));
+        continue;
+      }
+
+      Row to_lo = to == diverged ? ld(next) : splat16(to);
+      Row to_hi = to == diverged ? ld(next + 16) : splat16(to);
+      Row ran_lo = mask_lo(m), ran_hi = mask_hi(m);
+      st(reg.PC, _mm256_blendv_epi8(pc_lo, to_lo, ran_lo));
+      st(reg.PC + 16, _mm256_blendv_epi8(pc_hi, to_hi, ran_hi));
+      st(left, _mm256_add_epi16(left_lo, ran_lo));
+      st(left + 16, _mm256_add_epi16(left_hi, ran_hi));
+
+      // Back together?
+      if (bits == all && same16(reg.PC, all) && same16(left, all))
+      {
+        together = true;
+        pc = reg.PC[__builtin_ctz(all)];
+        together_left = left[__builtin_ctz(all)];
+        break;
+      }
+    }
+  }
+}
+
+#endif
+
+// The lanes in bits, which stopped at pc, are retired: handed back to
+// their Chip8s, which say why, until they're restarted
+template <unsigned int Lanes>
+void Lockstep<Lanes>::retire(uint32_t bits, uint16_t pc, Chip8::Status status)
+{
+  for (uint32_t b=bits; b; b&=b-1)
+  {
+    unsigned int l = __builtin_ctz(b);
+    reg.PC[l] = pc;
+    store(l);
+    lanes[l]->status = status;
+  }
+  running &= ~bits;
+}
+
+template <unsigned int Lanes>
+uint32_t Lockstep<Lanes>::step()
+{
+#ifdef LOCKSTEP_SIMD
+  if (simd)
+  {
+    // Take back the lanes that were handed out, which may have changed,
+    // and may have been restarted or stopped
+    if (checked_out)
+    {
+      for (unsigned int l=0; l<Lanes; l++)
+      {
+        if (!(checked_out & (1u << l)))
+          continue;
+        load(l);
+        if (lanes[l]->status == Chip8::Status::Running)
+          running |= 1u << l;
+        else
+          running &= ~(1u << l);
+      }
+      for (unsigned int a=0; a<0x1000; a++)
+        compare(a);
+      checked_out = 0;
+    }
+    update_timers();
+    for (unsigned int done=0; done<instructions_per_step; )
+    {
+      unsigned int n = instructions_per_step - done;
+      n = n < 0xffff ? n : 0xffff;
+      run(n);
+      done += n;
+    }
+    return running;
+  }
+#endif
+  running = 0;
+  for (unsigned int l=0; l<Lanes; l++)
+  {
+    if (lanes[l]->step() == Chip8::Status::Running)
+      running |= 1u << l;
+  }
+  return running;
+}
+
+template <unsigned int Lanes>
+void Lockstep<Lanes>::run_headless(uint64_t max_frames)
+{
+  // Each lane counts up to the frame it stopped in, if it did
+  uint64_t frames = 0, lane_frames = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (frames < max_frames && running)
+  {
+    lane_frames += __builtin_popcount(running);
+    step();
+    frames++;
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  uint64_t instructions = lane_frames * instructions_per_step;
+  double seconds = std::chrono::duration<double>(end - start).count();
+  printf("Executed %llu instructions in %llu frames on %u lanes\n",
+         (unsigned long long)instructions, (unsigned long long)frames, Lanes);
+  printf("Elapsed time: %.3f s (%.0f instructions/sec, %.0f frames/sec)\n",
+         seconds, instructions/seconds, lane_frames/seconds);
+  for (unsigned int l=0; l<Lanes; l++)
+  {
+    if (!(running & (1u << l)))
+    {
+      printf("Lane %u: ", l);
+      lane(l).print_status();
+    }
+  }
+  if (decoded)
+  {
+    printf("Instructions decoded: %llu, for %.1f lanes each\n",
+           (unsigned long long)decoded, (double)lane_instructions/decoded);
+  }
+  else if (!simd)
+    printf("No AVX2: ran the lanes one at a time\n");
+}
+
+template class Lockstep<8>;
+template class Lockstep<16>;
+template class Lockstep<32>;
+// Lane counts which leave the last group of four part full, for
+// tests/lockstep.cpp
+template class Lockstep<5>;
+template class Lockstep<13>;
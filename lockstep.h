@@ -0,0 +1,98 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdint.h>
+#include <memory>
+
+#include "chip8.h"
+
+// Runs Lanes copies of the same ROM side by side, for when many instances
+// mostly execute the same code (e.g. rollouts with different inputs).
+//
+// The lanes' whole machine state - registers, timers, stack, memory, RNG,
+// display - lives in a struct-of-arrays register file, one column per lane,
+// padded to a 32-byte AVX2 vector. Each instruction is decoded once and
+// run for every lane at the lowest PC, so lanes that branch apart
+// reconverge once the ones behind catch up. Register, timer, memory and RNG
+// instructions are AVX2 operations on whole rows of the file; drawing,
+// scrolling and keys go a lane at a time, but still on the file.
+//
+// Every lane executes exactly instructions_per_step instructions a frame,
+// so the results are the same as stepping Lanes separate Chip8 instances,
+// which is what it does on hosts without AVX2. A lane which halts or faults
+// is retired and the rest carry on; its Chip8's status says why, and it
+// rejoins at the next step() if it's restarted (e.g. by loadProgram).
+template <unsigned int Lanes>
+class Lockstep
+{
+  static_assert(Lanes <= 32, "Lanes must fit in a vector of bytes");
+
+public:
+  // Lanes take their settings (instructions_per_step, quirks) from settings
+  explicit Lockstep(const Chip8 &settings);
+
+  void loadProgram(char *rom);
+  void loadProgram(const uint8_t *data, size_t size, const char *name);
+  // Run a frame, returning a bit for each lane still running
+  uint32_t step();
+  // Run until max_frames or every lane has stopped
+  void run_headless(uint64_t max_frames);
+
+  // Lane l as a Chip8, e.g. to set its keys or save its state. Its state is
+  // copied out of the register file, and copied back in, with any changes,
+  // at the next step().
+  Chip8 &lane(unsigned int l);
+
+private:
+  static const unsigned int columns = 32;
+
+  struct RegisterFile
+  {
+    uint16_t PC[columns];
+    uint16_t I[columns];
+    uint8_t V[16][columns];
+    uint8_t timerD[columns];
+    uint8_t timerS[columns];
+    uint8_t SP[columns];
+    uint8_t hp_48_flags[8][columns];
+    uint8_t keys[16][columns];
+    uint8_t extendedMode[columns];
+    uint32_t rng[columns];
+    uint8_t memory[0x1000][columns];
+  };
+
+  RegisterFile reg;
+  uint64_t display[Lanes][Chip8::extHeight][Chip8::extWidth/64];
+
+  // Each address's byte if every lane has the same one there, in which
+  // case differs is 0; otherwise instructions there have to be fetched for
+  // each lane
+  uint8_t shared[0x1000];
+  uint8_t differs[0x1000];
+
+  uint16_t next[columns]; // Each lane's PC, when execute() branches apart
+
+  std::unique_ptr<Chip8> lanes[Lanes];
+  uint32_t checked_out = 0; // Lanes handed out by lane() since the last step
+  uint32_t running = 0;     // Lanes not halted or faulted
+  bool simd;                // Run on the register file, rather than lanes
+  unsigned int instructions_per_step;
+  QuirkFlags quirks;
+
+  uint64_t decoded = 0;           // Instructions decoded
+  uint64_t lane_instructions = 0; // Lane instructions run by them
+
+  void load(unsigned int l);
+  void store(unsigned int l);
+  void compare(unsigned int address);
+  void draw(uint32_t bits, unsigned int x, unsigned int y, unsigned int n, bool extended);
+  void draw_original(unsigned int l, unsigned int x, unsigned int y, unsigned int n);
+  void scroll(unsigned int l, uint16_t instruction);
+  template <bool Full>
+  uint32_t execute(uint16_t instruction, const uint8_t *mask, uint32_t bits, uint16_t pc);
+  void update_timers();
+  void run(unsigned int instructions);
+  void retire(uint32_t bits, uint16_t pc, Chip8::Status status);
+};
+
+#endif
@@ -1,29 +1,151 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <memory>
+#include <random>
 #include "chip8.h"
+#include "movie.h"
+#include "rompack.h"
+#include "rewind.h"
+#include "scheduler.h"
+#include "wavaudio.h"
+#ifdef CHIP8_HEADLESS
+#include "batch.h"
+#include "framedump.h"
+#include "lockstep.h"
+#include "termview.h"
+#endif
 
 static char *name;
-static Chip8 chip8;
+#ifdef __EMSCRIPTEN__
+static Chip8 *emulator; // For the speed controls exported to the page
+#endif
 
 void usage()
 {
   printf("Usage: %s [options] rom\n", name);
+  printf("       %s --make-pack FILE rom...\n", name);
   printf("Options:\n");
   printf("  -i  Instructions per step (default: 10)\n");
+  printf("  --speed N  Instructions per second, in place of -i\n");
   printf("  -s  Screen scale factor (default: 20)\n");
   printf("  -m  Mute audio\n");
+  printf("  --wav FILE  Write the sound to a WAV file instead of playing it\n");
+  printf("  -d  Instruction dispatch: switch, table, cached or jit (default: cached)\n");
+  printf("  -q  Quirks: legacy, vip or schip (default: legacy)\n");
+  printf("  -f  Frames to run in headless mode (default: 600)\n");
+  printf("  -n  Instructions to run in headless mode (default: unlimited)\n");
+#ifdef CHIP8_HEADLESS
+  printf("  -b  Run this many instances at once, for -f frames each\n");
+  printf("  -j  Threads for -b (default: one per hardware thread)\n");
+  printf("  -l  Run 8, 16 or 32 instances in lockstep, for -f frames each\n");
+  printf("  --dump FILE  Write every frame to FILE (raw, .y4m or .png; see README)\n");
+  printf("  --dump-format F  raw, y4m or png (default: from the file extension)\n");
+  printf("  --term  Show the display on the terminal, at 60 frames/sec\n");
+#endif
+#ifndef CHIP8_HEADLESS
+  printf("  --headless  Run without a window or audio and report instructions/sec\n");
+#endif
+  printf("  --no-fusion  Don't combine common instruction sequences into superinstructions\n");
+  printf("  --no-idle-skip  Don't fast-forward idle loops to the next frame\n");
+  printf("  --seed N  Seed the random number generator, for reproducible runs\n");
+  printf("  --record FILE  Record the keys pressed to an input movie\n");
+  printf("  --replay FILE  Replay an input movie (headless: to its end by default)\n");
+  printf("  --seek N  Start the replay from frame N\n");
+#ifndef CHIP8_HEADLESS
+  printf("  --rewind MB  Memory for rewinding with Backspace (default: 4, 0 to disable)\n");
+#endif
+  printf("  --load-state FILE  Start from a saved state\n");
+  printf("  --save-state FILE  Save the state when the emulator stops\n");
+  printf("  --pack FILE  Load rom (a name or hash) from a ROM pack\n");
+#ifdef CHIP8_HEADLESS
+  printf("               With -b and no rom, run every ROM in the pack\n");
+#endif
+  printf("  --make-pack FILE  Pack the given ROMs into FILE\n");
 }
 
+#ifdef CHIP8_HEADLESS
+template <unsigned int Lanes>
+void run_lockstep(const Chip8 &settings, char *rom, const PackedRom *packed, uint64_t frames)
+{
+  std::unique_ptr<Lockstep<Lanes>> lockstep(new Lockstep<Lanes>(settings));
+  if (packed)
+    lockstep->loadProgram(packed->data, packed->size, packed->name);
+  else
+    lockstep->loadProgram(rom);
+  lockstep->run_headless(frames);
+}
+#endif
+
 int main(int argc, char* argv[])
 {
   name = argv[0];
+  // On the heap, as it's too big for some stacks (Emscripten's is 64KB).
+  // Under Emscripten, run() never returns and main's locals aren't
+  // destroyed, so it stays alive for the exported functions.
+  std::unique_ptr<Chip8> owner(new Chip8());
+  Chip8 &chip8 = *owner;
+#ifdef __EMSCRIPTEN__
+  emulator = &chip8;
+#endif
   if (argc < 2)
   {
     usage();
     return 1;
   }
+#ifdef CHIP8_HEADLESS
+  bool headless = true;
+#else
+  bool headless = false;
+#endif
+  uint64_t frames = 0;
+  uint64_t instructions = 0;
+  bool seeded = false;
+  uint32_t seed = 0;
+  const char *record = nullptr;
+  const char *replay = nullptr;
+  uint32_t seek = 0;
+  const char *pack_path = nullptr;
+  const char *load_state = nullptr;
+  const char *save_state = nullptr;
+  unsigned int rewind_mb = 4;
+  const char *make_pack = nullptr;
+  unsigned int speed = 0;
+  const char *wav_path = nullptr;
+#ifdef CHIP8_HEADLESS
+  unsigned int instances = 0;
+  unsigned int threads = 0;
+  unsigned int lanes = 0;
+  const char *dump_path = nullptr;
+  const char *dump_format = nullptr;
+  bool term = false;
+#endif
+
+  static struct option long_options[] = {
+    {"headless", no_argument, 0, 'H'},
+    {"no-fusion", no_argument, 0, 'U'},
+    {"no-idle-skip", no_argument, 0, 'W'},
+    {"seed", required_argument, 0, 'S'},
+    {"record", required_argument, 0, 'R'},
+    {"replay", required_argument, 0, 'P'},
+    {"seek", required_argument, 0, 'K'},
+    {"pack", required_argument, 0, 'A'},
+    {"load-state", required_argument, 0, 'L'},
+    {"rewind", required_argument, 0, 'B'},
+    {"save-state", required_argument, 0, 'V'},
+    {"make-pack", required_argument, 0, 'M'},
+    {"dump", required_argument, 0, 'D'},
+    {"dump-format", required_argument, 0, 'F'},
+    {"term", no_argument, 0, 'T'},
+    {"speed", required_argument, 0, 'C'},
+    {"wav", required_argument, 0, 'O'},
+    {0, 0, 0, 0}
+  };
+
   int c;
-  while ((c = getopt(argc, argv, "i:s:m")) != -1)
+  while ((c = getopt_long(argc, argv, "i:s:md:q:f:n:b:j:l:", long_options, NULL)) != -1)
   {
     switch (c)
     {
@@ -36,23 +158,334 @@ int main(int argc, char* argv[])
       case 'm':
         chip8.muted = true;
         break;
+      case 'd':
+        if (strcmp(optarg, "switch") == 0)
+          chip8.dispatch = Chip8::Dispatch::Switch;
+        else if (strcmp(optarg, "table") == 0)
+          chip8.dispatch = Chip8::Dispatch::Table;
+        else if (strcmp(optarg, "cached") == 0)
+          chip8.dispatch = Chip8::Dispatch::Cached;
+        else if (strcmp(optarg, "jit") == 0)
+          chip8.dispatch = Chip8::Dispatch::Jit;
+        else
+        {
+          usage();
+          return 1;
+        }
+        break;
+      case 'q':
+        if (strcmp(optarg, "legacy") == 0)
+          chip8.quirks = Quirks::Legacy;
+        else if (strcmp(optarg, "vip") == 0)
+          chip8.quirks = Quirks::Vip;
+        else if (strcmp(optarg, "schip") == 0)
+          chip8.quirks = Quirks::SuperChip;
+        else
+        {
+          usage();
+          return 1;
+        }
+        break;
+      case 'f':
+        frames = strtoull(optarg, NULL, 10);
+        break;
+      case 'n':
+        instructions = strtoull(optarg, NULL, 10);
+        break;
+#ifdef CHIP8_HEADLESS
+      case 'b':
+        instances = atoi(optarg);
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      case 'l':
+        lanes = atoi(optarg);
+        if (lanes != 8 && lanes != 16 && lanes != 32)
+        {
+          usage();
+          return 1;
+        }
+        break;
+      case 'D':
+        dump_path = optarg;
+        break;
+      case 'F':
+        dump_format = optarg;
+        break;
+      case 'T':
+        term = true;
+        break;
+#endif
+      case 'H':
+        headless = true;
+        break;
+      case 'U':
+        chip8.fusion = false;
+        break;
+      case 'W':
+        chip8.idle_skip = false;
+        break;
+      case 'S':
+        seeded = true;
+        seed = strtoul(optarg, NULL, 0);
+        break;
+      case 'R':
+        record = optarg;
+        break;
+      case 'P':
+        replay = optarg;
+        break;
+      case 'K':
+        seek = strtoul(optarg, NULL, 10);
+        break;
+      case 'A':
+        pack_path = optarg;
+        break;
+      case 'L':
+        load_state = optarg;
+        break;
+      case 'B':
+        rewind_mb = atoi(optarg);
+        break;
+      case 'V':
+        save_state = optarg;
+        break;
+      case 'M':
+        make_pack = optarg;
+        break;
+      case 'O':
+        wav_path = optarg;
+        break;
+      case 'C':
+        speed = atoi(optarg);
+        if (speed == 0)
+        {
+          usage();
+          return 1;
+        }
+        break;
       default:
         usage();
         return 1;
     }
   }
-  if (optind != argc-1)
+  if (make_pack)
+  {
+    if (optind == argc)
+    {
+      usage();
+      return 1;
+    }
+    std::vector<const char *> paths(argv + optind, argv + argc);
+    return RomPack::write(make_pack, paths) ? 0 : 1;
+  }
+
+  // A whole number of instructions a tick needs no spreading, and so works
+  // everywhere -i does. Anything else only makes sense in real time, and a
+  // movie has its speed built in.
+  if (speed && speed % Scheduler::tick_rate == 0)
+    chip8.instructions_per_step = speed / Scheduler::tick_rate;
+  else if (speed)
+    chip8.instructions_per_second = speed;
+  bool uneven_speed = chip8.instructions_per_second != 0;
+
+  bool whole_pack = false;
+#ifdef CHIP8_HEADLESS
+  whole_pack = pack_path && instances > 0 && optind == argc;
+#endif
+  if ((optind != argc-1 && !whole_pack) || (record && replay) || (seek && !replay) ||
+      (load_state && (record || replay)) || (speed && replay) || (uneven_speed && record))
   {
     usage();
     return 1;
   }
 
-  char *rom = argv[optind];
-  chip8.loadProgram(rom);
+  char *rom = whole_pack ? nullptr : argv[optind];
+  RomPack pack;
+  const PackedRom *packed = nullptr;
+  if (pack_path)
+  {
+    if (!pack.open(pack_path))
+      return 1;
+    if (rom)
+    {
+      packed = pack.find(rom);
+      char *end;
+      uint64_t hash = strtoull(rom, &end, 16);
+      if (!packed && *end == '\0')
+        packed = pack.find(hash);
+      if (!packed)
+      {
+        fprintf(stderr, "No ROM named '%s' in '%s'\n", rom, pack_path);
+        return 1;
+      }
+    }
+    else if (pack.size() == 0)
+    {
+      fprintf(stderr, "'%s' is empty\n", pack_path);
+      return 1;
+    }
+  }
+#ifdef CHIP8_HEADLESS
+  FrameDump dump;
+  if (dump_path)
+  {
+    FrameDump::Format format = FrameDump::format_for(dump_path);
+    if (dump_format && strcmp(dump_format, "raw") == 0)
+      format = FrameDump::Format::Raw;
+    else if (dump_format && strcmp(dump_format, "y4m") == 0)
+      format = FrameDump::Format::Y4m;
+    else if (dump_format && strcmp(dump_format, "png") == 0)
+      format = FrameDump::Format::Png;
+    else if (dump_format)
+    {
+      usage();
+      return 1;
+    }
+    if (instances > 0 || lanes > 0)
+    {
+      usage();
+      return 1;
+    }
+    if (!dump.open(dump_path, format))
+      return 1;
+  }
+  TermView view;
+  if ((term || uneven_speed || wav_path) && (instances > 0 || lanes > 0))
+  {
+    usage();
+    return 1;
+  }
+  if (instances > 0)
+  {
+    if (instructions != 0)
+    {
+      usage();
+      return 1;
+    }
+    printf("Running at %d instructions per step\n", chip8.instructions_per_step);
+    Batch batch(instances, chip8, threads);
+    if (whole_pack)
+      batch.loadProgram(pack);
+    else if (packed)
+      batch.loadProgram(*packed);
+    else
+      batch.loadProgram(rom);
+    batch.run(frames ? frames : 600);
+    return 0;
+  }
+  if (lanes > 0)
+  {
+    if (instructions != 0)
+    {
+      usage();
+      return 1;
+    }
+    printf("Running at %d instructions per step\n", chip8.instructions_per_step);
+    if (frames == 0)
+      frames = 600;
+    if (lanes == 8)
+      run_lockstep<8>(chip8, rom, packed, frames);
+    else if (lanes == 16)
+      run_lockstep<16>(chip8, rom, packed, frames);
+    else
+      run_lockstep<32>(chip8, rom, packed, frames);
+    return 0;
+  }
+#endif
+  if (packed)
+    chip8.loadProgram(packed->data, packed->size, packed->name);
+  else
+    chip8.loadProgram(rom);
+
+  // A recording needs to know its seed, so pick one now if none was given
+  if (record && !seeded)
+  {
+    seeded = true;
+    seed = std::random_device()();
+  }
+  if (seeded)
+    chip8.seed(seed);
+
+  if (load_state && !chip8.load_state(load_state))
+    return 1;
+
+  std::unique_ptr<MovieWriter> recorder;
+  MoviePlayer player;
+  if (record)
+  {
+    recorder.reset(new MovieWriter(record, chip8, seed));
+    chip8.recorder = recorder.get();
+  }
+  if (replay)
+  {
+    if (!player.open(replay) || !player.setup(chip8))
+      return 1;
+    if (seek && !player.seek(chip8, seek))
+    {
+      fprintf(stderr, "Can't seek to frame %u of %u\n", seek, player.frames());
+      return 1;
+    }
+    chip8.player = &player;
+  }
+
+  WavAudio wav;
+  if (wav_path)
+  {
+    if (!wav.open(wav_path))
+      return 1;
+    chip8.audio = &wav;
+  }
 
-  printf("Running at %d instructions per step\n", chip8.instructions_per_step);
-  chip8.run();
+  std::unique_ptr<Rewind> rewind;
+  if (!headless && rewind_mb > 0)
+  {
+    rewind.reset(new Rewind((size_t)rewind_mb << 20));
+    chip8.rewinder = rewind.get();
+  }
 
+  if (uneven_speed)
+    printf("Running at %d instructions per second\n", chip8.instructions_per_second);
+  else
+    printf("Running at %d instructions per step\n", chip8.instructions_per_step);
+  if (headless)
+  {
+    if (frames == 0 && instructions == 0)
+      frames = replay ? player.frames() - player.position() : 600;
+    if (!wav_path)
+      chip8.muted = true;
+    if (frames != 0 || instructions != 0)
+    {
+#ifdef CHIP8_HEADLESS
+      chip8.run_headless(frames, instructions, dump_path ? &dump : nullptr,
+                         term ? &view : nullptr);
+#else
+      chip8.run_headless(frames, instructions);
+#endif
+    }
+  }
+#ifndef CHIP8_HEADLESS
+  else
+  {
+    chip8.run();
+  }
+#endif
+
+  chip8.player = nullptr;
+  chip8.recorder = nullptr;
+  chip8.rewinder = nullptr;
+  chip8.audio = nullptr;
+  if (save_state && !chip8.save_state(save_state))
+    return 1;
+  if (recorder && !recorder->finish())
+    return 1;
+  if (!wav.finish())
+    return 1;
+#ifdef CHIP8_HEADLESS
+  if (!dump.finish())
+    return 1;
+#endif
   return 0;
 }
 
@@ -61,7 +494,13 @@ extern "C"
 {
   void set_instructions_per_step(int n)
   {
-    chip8.instructions_per_step = n;
+    emulator->instructions_per_step = n;
+    emulator->instructions_per_second = 0;
+  }
+
+  void set_instructions_per_second(int n)
+  {
+    emulator->instructions_per_second = n;
   }
 }
 #endif
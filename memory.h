@@ -3,83 +3,186 @@
 
 #include <array>
 #include <istream>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-template <std::size_t size>
+// Bounds policies for Memory: what happens on an access outside it.
+// Each provides wrap (mask addresses instead of checking them) and fault(),
+// which is called for out of range accesses when wrap is false and returns
+// the value a bad read gives.
+
+// Print the address and abort
+struct AbortOnFault
+{
+  static const bool wrap = false;
+  static uint8_t fault(const char *access, unsigned int address)
+  {
+    fprintf(stderr, "%s address = %u\n", access, address);
+    abort();
+  }
+};
+
+// Wrap addresses around, as if the address bus only had enough lines for
+// size bytes. There is no check or branch at all, so this is the fastest.
+struct WrapAddresses
+{
+  static const bool wrap = true;
+  static uint8_t fault(const char *, unsigned int) { return 0; }
+};
+
+// Ignore bad writes and read 0, and remember the first bad access in
+// Memory::fault so the caller can deal with it
+struct ReportFault
+{
+  static const bool wrap = false;
+  static uint8_t fault(const char *, unsigned int) { return 0; }
+};
+
+struct MemoryFault
+{
+  bool faulted = false;
+  const char *access = nullptr; // get8, set8, get16 or set16
+  unsigned int address = 0;
+};
+
+template <std::size_t size, class Policy = AbortOnFault>
 class Memory
 {
   static_assert((size % 2)==0, "size must be a multiple of 2");
+  static_assert(!Policy::wrap || (size & (size-1))==0,
+                "size must be a power of 2 to wrap addresses");
+
+public:
+  // Writes mark the line_size-byte line they're in as dirty, until clean()
+  static const std::size_t line_size = 64;
+  static const std::size_t lines = (size + line_size-1) / line_size;
+
+private:
+  uint8_t mem8[size] = {};
+  uint64_t dirty_lines[(lines+63) / 64] = {};
+
+  void mark(unsigned int address)
+  {
+    unsigned int line = address / line_size;
+    dirty_lines[line / 64] |= (uint64_t)1 << (line % 64);
+  }
+
+  static unsigned int mask(unsigned int address)
+  {
+    return Policy::wrap ? address & (size-1) : address;
+  }
+
+  bool in_range(unsigned int address, unsigned int bytes)
+  {
+    return Policy::wrap || address+bytes-1 < size;
+  }
 
-  uint8_t mem8[size];
+  uint8_t out_of_range(const char *access, unsigned int address)
+  {
+    if (!fault.faulted)
+    {
+      fault.faulted = true;
+      fault.access = access;
+      fault.address = address;
+    }
+    return Policy::fault(access, address);
+  }
 
 public:
+  // The first access out of range, under any policy. Only ReportFault
+  // carries on afterwards for the caller to see it: AbortOnFault stops
+  // there, and WrapAddresses never has one.
+  MemoryFault fault;
+
   void load(unsigned int address, std::size_t n, std::istream& src)
   {
     src.read(reinterpret_cast<char *>(&mem8[address]), n);
+    mark_range(address, n);
   }
 
-  void load(unsigned int address, std::size_t n, uint8_t *src)
+  void load(unsigned int address, std::size_t n, const uint8_t *src)
   {
     memcpy(&mem8[address], src, n);
+    mark_range(address, n);
+  }
+
+  const uint8_t *data() const { return mem8; }
+
+  bool dirty(unsigned int line) const
+  {
+    return (dirty_lines[line / 64] >> (line % 64)) & 1;
+  }
+
+  void mark_range(unsigned int address, std::size_t n)
+  {
+    for (std::size_t a=address - address%line_size; a<address+n; a+=line_size)
+      mark(a);
+  }
+
+  void clean()
+  {
+    memset(dirty_lines, 0, sizeof(dirty_lines));
   }
 
   void set8(unsigned int address, uint8_t value)
   {
-    if (address >=0 && address < size)
+    if (in_range(address, 1))
     {
-      mem8[address] = value;
+      mem8[mask(address)] = value;
+      mark(mask(address));
     }
     else
-    {
-      fprintf(stderr, "set8 address = %u\n", address);
-      abort();
-    }
+      out_of_range("set8", address);
   }
 
   uint8_t get8(unsigned int address)
   {
-    if (address >=0 && address < size)
-      return mem8[address];
-    fprintf(stderr, "get8 address = %u\n", address);
-    abort();
+    if (in_range(address, 1))
+      return mem8[mask(address)];
+    return out_of_range("get8", address);
   }
 
   void set16(unsigned int address, uint16_t value)
   {
-    if (address >=0 && address+1 < size)
+    if (in_range(address, 2))
     {
       uint8_t upper = (value & 0xff00) >> 8;
       uint8_t lower = (value & 0x00ff);
-      mem8[address] = upper;
-      mem8[address+1] = lower;
+      mem8[mask(address)] = upper;
+      mem8[mask(address+1)] = lower;
+      mark(mask(address));
+      mark(mask(address+1));
     }
     else
     {
-      fprintf(stderr, "set16 address = %u\n", address);
-      abort();
+      out_of_range("set16", address);
     }
   }
 
   uint16_t get16(unsigned int address)
   {
-    if (address >=0 && address+1 < size)
+    if (in_range(address, 2))
     {
-      uint8_t upper = mem8[address];
-      uint8_t lower = mem8[address+1];
+      uint8_t upper = mem8[mask(address)];
+      uint8_t lower = mem8[mask(address+1)];
       uint16_t value = (upper << 8) | lower;
       return value;
     }
-    fprintf(stderr, "get16 address = %u\n", address);
-    abort();
+    uint8_t value = out_of_range("get16", address);
+    return (value << 8) | value;
   }
 
   void print(unsigned int start, unsigned int range=10)
   {
     for (unsigned int i=start; i<start+range; i++)
     {
-      printf("0x%04X: 0x%02X\n", i, mem8[i]);
+      printf("0x%04X: 0x%02X\n", i, mem8[mask(i)]);
     }
   }
 };
 
+// The Chip-8's 4KB address space. Addresses wrap at 4KB, as on the VIP.
+typedef Memory<0x1000, WrapAddresses> Chip8Memory;
+
 #endif
@@ -0,0 +1,312 @@
+#include "movie.h"
+#include "chip8.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const uint16_t movie_version = 3;
+static const size_t header_size = 4 + 2 + 4 + 1 + 4 + 4 + 4;
+
+static uint32_t fnv1a(const uint8_t *data, size_t n)
+{
+  uint32_t h = 0x811c9dc5;
+  for (size_t i=0; i<n; i++)
+  {
+    h ^= data[i];
+    h *= 0x01000193;
+  }
+  return h;
+}
+
+static uint16_t pack_keys(const bool *keys)
+{
+  uint16_t k = 0;
+  for (unsigned int i=0; i<16; i++)
+    k |= keys[i] << i;
+  return k;
+}
+
+static void unpack_keys(uint16_t k, bool *keys)
+{
+  for (unsigned int i=0; i<16; i++)
+    keys[i] = (k >> i) & 1;
+}
+
+// c's state, with keys as given rather than c's own
+static void save_state_with_keys(Chip8 &c, uint16_t keys, std::vector<uint8_t> &out)
+{
+  bool current[16];
+  memcpy(current, c.keys, sizeof(current));
+  unpack_keys(keys, c.keys);
+  c.save_state(out);
+  memcpy(c.keys, current, sizeof(current));
+}
+
+static void put16(std::vector<uint8_t> &out, uint16_t v)
+{
+  out.push_back(v & 0xff);
+  out.push_back(v >> 8);
+}
+
+static void put32(std::vector<uint8_t> &out, uint32_t v)
+{
+  put16(out, v & 0xffff);
+  put16(out, v >> 16);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+  return get16(p) | ((uint32_t)get16(p+2) << 16);
+}
+
+//
+// Recording
+//
+MovieWriter::MovieWriter(const char *path, Chip8 &c, uint32_t seed,
+                         unsigned int keyframe_interval)
+  : path(path), seed(seed), keyframe_interval(keyframe_interval ? keyframe_interval : 1)
+{
+  quirks = static_cast<uint8_t>(c.quirks);
+  instructions_per_step = c.instructions_per_step;
+  std::vector<uint8_t> state;
+  save_state_with_keys(c, 0, state);
+  state_hash = fnv1a(state.data(), state.size());
+}
+
+MovieWriter::~MovieWriter()
+{
+  if (!finished)
+    finish();
+}
+
+void MovieWriter::frame(Chip8 &c, bool reset)
+{
+  if (frames % keyframe_interval == 0)
+  {
+    // The state before this frame's inputs, so the keys are the last ones
+    std::vector<uint8_t> state;
+    save_state_with_keys(c, last_keys, state);
+    MovieKeyframe k;
+    k.frame = frames;
+    k.state_offset = states.size(); // Made absolute in finish()
+    k.state_size = state.size();
+    k.event_offset = events.size();
+    k.last_event_frame = last_event_frame;
+    keyframes.push_back(k);
+    states.insert(states.end(), state.begin(), state.end());
+  }
+
+  uint16_t keys = pack_keys(c.keys);
+  if (reset || keys != last_keys)
+  {
+    uint32_t v = ((frames - last_event_frame) << 1) | reset;
+    for (; v >= 0x80; v >>= 7)
+      events.push_back((v & 0x7f) | 0x80);
+    events.push_back(v);
+    put16(events, keys ^ last_keys);
+    last_event_frame = frames;
+    last_keys = keys;
+  }
+  frames++;
+}
+
+bool MovieWriter::finish()
+{
+  finished = true;
+  std::vector<uint8_t> out;
+  out.insert(out.end(), {'C', '8', 'M', 'V'});
+  put16(out, movie_version);
+  put32(out, seed);
+  out.push_back(quirks);
+  put32(out, instructions_per_step);
+  put32(out, keyframe_interval);
+  put32(out, state_hash);
+  out.insert(out.end(), events.begin(), events.end());
+
+  uint32_t states_offset = out.size();
+  out.insert(out.end(), states.begin(), states.end());
+
+  uint32_t index_offset = out.size();
+  put32(out, frames);
+  put32(out, events.size());
+  put32(out, keyframes.size());
+  for (auto &k : keyframes)
+  {
+    put32(out, k.frame);
+    put32(out, states_offset + k.state_offset);
+    put32(out, k.state_size);
+    put32(out, k.event_offset);
+    put32(out, k.last_event_frame);
+  }
+  put32(out, index_offset);
+  out.insert(out.end(), {'C', '8', 'M', 'V'});
+
+  FILE *f = fopen(path, "wb");
+  if (!f)
+  {
+    fprintf(stderr, "Couldn't write movie to '%s'\n", path);
+    return false;
+  }
+  bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+  ok &= fclose(f) == 0;
+  if (!ok)
+    fprintf(stderr, "Couldn't write movie to '%s'\n", path);
+  return ok;
+}
+
+//
+// Playback
+//
+bool MoviePlayer::open(const char *path)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+  {
+    fprintf(stderr, "Couldn't load movie from '%s'\n", path);
+    return false;
+  }
+  file.clear();
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    file.insert(file.end(), buf, buf + n);
+  fclose(f);
+
+  const uint8_t *p = file.data();
+  size_t size = file.size();
+  if (size < header_size + 8 || memcmp(p, "C8MV", 4) != 0 ||
+      memcmp(p + size - 4, "C8MV", 4) != 0)
+  {
+    fprintf(stderr, "'%s' is not a movie\n", path);
+    return false;
+  }
+  if (get16(p + 4) != movie_version)
+  {
+    fprintf(stderr, "'%s' is movie version %u, expected %u\n", path,
+            get16(p + 4), movie_version);
+    return false;
+  }
+  seed = get32(p + 6);
+  quirks = static_cast<Quirks>(p[10]);
+  instructions_per_step = get32(p + 11);
+  state_hash = get32(p + 19);
+
+  uint32_t index_offset = get32(p + size - 8);
+  if (index_offset + 12 > size - 8)
+  {
+    fprintf(stderr, "'%s' is corrupt\n", path);
+    return false;
+  }
+  const uint8_t *index = p + index_offset;
+  total_frames = get32(index);
+  events_size = get32(index + 4);
+  uint32_t count = get32(index + 8);
+  events = p + header_size;
+  if (header_size + events_size > index_offset ||
+      index_offset + 12 + (size_t)count*20 > size - 8)
+  {
+    fprintf(stderr, "'%s' is corrupt\n", path);
+    return false;
+  }
+  keyframes.clear();
+  for (uint32_t i=0; i<count; i++)
+  {
+    const uint8_t *e = index + 12 + i*20;
+    MovieKeyframe k = {get32(e), get32(e+4), get32(e+8), get32(e+12), get32(e+16)};
+    if ((size_t)k.state_offset + k.state_size > index_offset || k.event_offset > events_size)
+    {
+      fprintf(stderr, "'%s' is corrupt\n", path);
+      return false;
+    }
+    keyframes.push_back(k);
+  }
+
+  pos = 0;
+  cursor = 0;
+  last_event_frame = 0;
+  keys = 0;
+  read_event_header();
+  return true;
+}
+
+bool MoviePlayer::setup(Chip8 &c)
+{
+  c.seed(seed);
+  c.quirks = quirks;
+  c.instructions_per_step = instructions_per_step;
+
+  std::vector<uint8_t> state;
+  save_state_with_keys(c, 0, state);
+  if (fnv1a(state.data(), state.size()) != state_hash)
+  {
+    fprintf(stderr, "The movie was recorded with a different ROM\n");
+    return false;
+  }
+  return true;
+}
+
+void MoviePlayer::read_event_header()
+{
+  uint32_t v = 0;
+  unsigned int shift = 0;
+  while (cursor < events_size && shift < 32)
+  {
+    uint8_t b = events[cursor++];
+    v |= (uint32_t)(b & 0x7f) << shift;
+    shift += 7;
+    if (!(b & 0x80))
+    {
+      next_event_frame = last_event_frame + (v >> 1);
+      next_event_reset = v & 1;
+      return;
+    }
+  }
+  next_event_frame = UINT32_MAX; // No more events
+}
+
+void MoviePlayer::frame(Chip8 &c)
+{
+  if (pos == next_event_frame && cursor + 2 <= events_size)
+  {
+    if (next_event_reset)
+      c.reset();
+    keys ^= get16(events + cursor);
+    cursor += 2;
+    last_event_frame = pos;
+    read_event_header();
+  }
+  unpack_keys(keys, c.keys);
+  pos++;
+}
+
+bool MoviePlayer::seek(Chip8 &c, uint32_t target)
+{
+  if (target > total_frames)
+    return false;
+  const MovieKeyframe *k = nullptr;
+  for (auto &kf : keyframes)
+  {
+    if (kf.frame <= target)
+      k = &kf;
+  }
+  if (!k || !c.load_state(file.data() + k->state_offset, k->state_size))
+    return false;
+
+  pos = k->frame;
+  cursor = k->event_offset;
+  last_event_frame = k->last_event_frame;
+  keys = pack_keys(c.keys);
+  read_event_header();
+
+  while (pos < target)
+  {
+    frame(c);
+    c.step();
+  }
+  return true;
+}
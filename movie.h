@@ -0,0 +1,116 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "quirks.h"
+
+class Chip8;
+
+// Input movies: everything needed to replay a run exactly - the seed and
+// settings it started with, and the keys pressed in every frame - plus a
+// keyframe of the whole machine state every so often, so a replay can seek
+// to any frame without running everything before it.
+//
+// File layout, all little-endian:
+//
+//   header     "C8MV" version:u16 seed:u32 quirks:u8 instructions_per_step:u32
+//              keyframe_interval:u32 state_hash:u32
+//   events     One for each frame in which the keys changed or the machine
+//              was reset: varint((frames since the last event << 1) | reset),
+//              then the keys XOR the keys before (u16, bit n = key n)
+//   keyframes  Chip8::save_state before the inputs of every
+//              keyframe_interval'th frame
+//   index      frames:u32 events_size:u32 keyframes:u32, then for each
+//              keyframe frame:u32 state_offset:u32 state_size:u32
+//              event_offset:u32 last_event_frame:u32
+//   footer     index_offset:u32 "C8MV"
+//
+// state_hash is a hash of the state at power-on, after loading the ROM,
+// so a movie isn't replayed against the wrong ROM.
+
+struct MovieKeyframe
+{
+  uint32_t frame;
+  uint32_t state_offset;
+  uint32_t state_size;
+  uint32_t event_offset;     // Next event, from the start of the events
+  uint32_t last_event_frame; // Frame of the event before that, or 0
+};
+
+class MovieWriter
+{
+public:
+  // c must have just loaded its ROM and been seeded with seed
+  MovieWriter(const char *path, Chip8 &c, uint32_t seed,
+              unsigned int keyframe_interval = 600);
+  ~MovieWriter();
+
+  // Record the inputs for the next frame: c's keys, and whether it's about
+  // to be reset
+  void frame(Chip8 &c, bool reset);
+
+  // Write the file. Returns false on error.
+  bool finish();
+
+private:
+  const char *path;
+  bool finished = false;
+  uint32_t seed;
+  uint8_t quirks;
+  uint32_t instructions_per_step;
+  uint32_t keyframe_interval;
+  uint32_t state_hash;
+
+  uint32_t frames = 0;
+  uint32_t last_event_frame = 0;
+  uint16_t last_keys = 0;
+  std::vector<uint8_t> events;
+  std::vector<uint8_t> states;
+  std::vector<MovieKeyframe> keyframes;
+};
+
+class MoviePlayer
+{
+public:
+  // Returns false (after printing why) if the file can't be read
+  bool open(const char *path);
+
+  // Apply the movie's seed and settings to c, which must have just loaded
+  // its ROM. Returns false if the ROM doesn't match.
+  bool setup(Chip8 &c);
+
+  // Apply the inputs for the next frame
+  void frame(Chip8 &c);
+
+  // Restore the nearest keyframe at or before target and run up to it, so
+  // the next frame() is for frame target
+  bool seek(Chip8 &c, uint32_t target);
+
+  uint32_t frames() const { return total_frames; }
+  uint32_t position() const { return pos; }
+
+private:
+  std::vector<uint8_t> file;
+  uint32_t seed = 0;
+  Quirks quirks = Quirks::Legacy;
+  uint32_t instructions_per_step = 10;
+  uint32_t state_hash = 0;
+  uint32_t total_frames = 0;
+  const uint8_t *events = nullptr;
+  size_t events_size = 0;
+  std::vector<MovieKeyframe> keyframes;
+
+  uint32_t pos = 0;         // Next frame
+  size_t cursor = 0;        // Next unread byte of events
+  uint32_t last_event_frame = 0;
+  uint32_t next_event_frame = 0;
+  bool next_event_reset = false;
+  uint16_t keys = 0;
+
+  void read_event_header();
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef QUIRKS_H
+#define QUIRKS_H
+
+// Behaviours which differ between Chip-8 interpreters, and so between the
+// ROMs written for them.
+//
+// The interpreter is compiled once for each profile below, with these as
+// compile-time constants, so the instruction handlers have no quirk checks
+// at run time. Chip8::quirks picks the profile used for a ROM.
+enum class Quirks
+{
+  Legacy,   // This emulator's original behaviour
+  Vip,      // The original COSMAC VIP interpreter
+  SuperChip // SUPER-CHIP 1.1 on the HP48
+};
+
+// The same behaviours as run-time values, for code which picks them once
+// rather than per instruction (e.g. the JIT, when translating a block)
+struct QuirkFlags
+{
+  bool shift_vy;     // 8xy6/8xyE shift Vy into Vx, rather than shifting Vx
+  bool load_store_i; // Fx55/Fx65 leave I pointing after the last register
+  bool jump_vx;      // Bxnn jumps to xnn + Vx, rather than Bnnn to nnn + V0
+  bool add_i_vf;     // Fx1E sets VF when I goes past 0xfff
+  bool clip_sprites; // Sprites are clipped at the screen edges, not wrapped
+  // VF as this emulator originally set it: 8xyE sets it to 0 rather than
+  // the bit shifted out, and Dxyn clears it before drawing and places each
+  // pixel from Vx and Vy as they are then, so when VF is one of them the
+  // first collision moves the rest of the sprite
+  bool original_vf;
+
+  bool operator==(const QuirkFlags &o) const
+  {
+    return shift_vy == o.shift_vy && load_store_i == o.load_store_i &&
+           jump_vx == o.jump_vx && add_i_vf == o.add_i_vf &&
+           clip_sprites == o.clip_sprites && original_vf == o.original_vf;
+  }
+  bool operator!=(const QuirkFlags &o) const { return !(*this == o); }
+};
+
+struct LegacyQuirks
+{
+  static constexpr bool shift_vy = false;
+  static constexpr bool load_store_i = false;
+  static constexpr bool jump_vx = false;
+  static constexpr bool add_i_vf = true;
+  static constexpr bool clip_sprites = false;
+  static constexpr bool original_vf = true;
+};
+
+struct VipQuirks
+{
+  static constexpr bool shift_vy = true;
+  static constexpr bool load_store_i = true;
+  static constexpr bool jump_vx = false;
+  static constexpr bool add_i_vf = false;
+  static constexpr bool clip_sprites = true;
+  static constexpr bool original_vf = false;
+};
+
+struct SuperChipQuirks
+{
+  static constexpr bool shift_vy = false;
+  static constexpr bool load_store_i = false;
+  static constexpr bool jump_vx = true;
+  static constexpr bool add_i_vf = false;
+  static constexpr bool clip_sprites = true;
+  static constexpr bool original_vf = false;
+};
+
+template <class Q>
+QuirkFlags quirk_flags()
+{
+  return {Q::shift_vy, Q::load_store_i, Q::jump_vx, Q::add_i_vf, Q::clip_sprites,
+          Q::original_vf};
+}
+
+inline QuirkFlags quirk_flags(Quirks quirks)
+{
+  switch (quirks)
+  {
+    case Quirks::Vip:       return quirk_flags<VipQuirks>();
+    case Quirks::SuperChip: return quirk_flags<SuperChipQuirks>();
+    default:                return quirk_flags<LegacyQuirks>();
+  }
+}
+
+#endif
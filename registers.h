@@ -0,0 +1,16 @@
+#ifndef REGISTERS_H
+#define REGISTERS_H
+
+#include <stdint.h>
+
+struct Registers
+{
+  uint16_t PC = 0x200;
+  uint16_t I = 0;
+  uint8_t V[16] = {};
+  uint8_t timerD = 0, timerS = 0;
+  uint8_t SP = 0;
+  uint8_t hp_48_flags[8] = {};
+};
+
+#endif
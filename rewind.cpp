@@ -0,0 +1,147 @@
+#include "rewind.h"
+#include "chip8.h"
+
+#include <string.h>
+
+// Deltas are a series of (zeros:varint, length:varint, bytes[length]):
+// skip that many unchanged bytes, then XOR in the changed ones
+static void put_varint(std::vector<uint8_t> &out, size_t v)
+{
+  for (; v >= 0x80; v >>= 7)
+    out.push_back((v & 0x7f) | 0x80);
+  out.push_back(v);
+}
+
+static size_t get_varint(const uint8_t *&p)
+{
+  size_t v = 0;
+  for (unsigned int shift=0; ; shift+=7)
+  {
+    uint8_t b = *p++;
+    v |= (size_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return v;
+  }
+}
+
+static void encode(std::vector<uint8_t> &out, const uint8_t *a, const uint8_t *b, size_t n)
+{
+  out.clear();
+  size_t i = 0;
+  while (i < n)
+  {
+    size_t start = i;
+    while (i < n && a[i] == b[i])
+      i++;
+    if (i == n)
+      break;
+    size_t zeros = i - start;
+
+    // A literal run ends at the next few unchanged bytes; shorter gaps are
+    // cheaper to carry as zeros than to start a new run
+    size_t literal = i;
+    size_t same = 0;
+    for (; i < n && same < 4; i++)
+    {
+      if (a[i] == b[i])
+        same++;
+      else
+        same = 0;
+    }
+    i -= same;
+    put_varint(out, zeros);
+    put_varint(out, i - literal);
+    for (size_t j=literal; j<i; j++)
+      out.push_back(a[j] ^ b[j]);
+  }
+}
+
+static void apply(uint8_t *state, size_t n, const uint8_t *delta, size_t size)
+{
+  const uint8_t *p = delta;
+  const uint8_t *end = delta + size;
+  size_t i = 0;
+  while (p < end)
+  {
+    i += get_varint(p);
+    size_t length = get_varint(p);
+    for (size_t j=0; j<length && i<n; j++)
+      state[i++] ^= *p++;
+  }
+}
+
+Rewind::Rewind(size_t capacity)
+  : ring(capacity)
+{
+}
+
+void Rewind::clear()
+{
+  head = 0;
+  entries.clear();
+  latest.clear();
+}
+
+void Rewind::push(const Chip8 &c)
+{
+  c.save_state(state);
+  if (latest.size() != state.size())
+  {
+    latest.swap(state);
+    entries.clear();
+    head = 0;
+    return;
+  }
+  encode(delta, latest.data(), state.data(), latest.size());
+  latest.swap(state);
+  if (delta.size() > ring.size())
+  {
+    // Too big to keep, so nothing before this can be reached either
+    entries.clear();
+    head = 0;
+    return;
+  }
+
+  if (head + delta.size() > ring.size())
+  {
+    // Wrap around, dropping the oldest deltas at the end of the ring
+    while (!entries.empty() && entries.front().offset >= head)
+      entries.pop_front();
+    head = 0;
+  }
+  while (!entries.empty() && entries.front().offset >= head &&
+         entries.front().offset < head + delta.size())
+    entries.pop_front();
+
+  memcpy(&ring[head], delta.data(), delta.size());
+  entries.push_back(Entry{head, delta.size()});
+  head += delta.size();
+}
+
+void Rewind::pop()
+{
+  if (entries.empty())
+  {
+    latest.clear();
+    return;
+  }
+  const Entry &e = entries.back();
+  apply(latest.data(), latest.size(), &ring[e.offset], e.size);
+  head = e.offset;
+  entries.pop_back();
+}
+
+unsigned int Rewind::rewind(Chip8 &c, unsigned int frames)
+{
+  unsigned int n = 0;
+  while (n + 1 < frames && !entries.empty())
+  {
+    pop();
+    n++;
+  }
+  if (latest.empty() || frames == 0)
+    return 0;
+  c.load_state(latest.data(), latest.size());
+  pop();
+  return n + 1;
+}
@@ -0,0 +1,52 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <vector>
+
+class Chip8;
+
+// A fixed-size history of machine states, one per frame, to go back to.
+//
+// Only the newest state is kept whole. Each older one is stored as the XOR
+// of it and the state after it (see Chip8::save_state), run-length encoded,
+// which is usually a few dozen bytes since a frame changes little. Going
+// back applies these deltas newest first, so when the buffer is full the
+// oldest can simply be dropped.
+class Rewind
+{
+public:
+  explicit Rewind(size_t capacity = 4 << 20); // Bytes of deltas
+
+  // Record c's state as the newest
+  void push(const Chip8 &c);
+
+  // Restore the state from frames pushes ago (1 is the newest) and forget
+  // everything after it. Returns how many frames back it went, which is
+  // less than frames if the history is shorter.
+  unsigned int rewind(Chip8 &c, unsigned int frames = 1);
+
+  // States that can be rewound to
+  unsigned int frames() const { return latest.empty() ? 0 : entries.size() + 1; }
+  void clear();
+
+private:
+  struct Entry
+  {
+    size_t offset;
+    size_t size;
+  };
+
+  std::vector<uint8_t> ring;
+  size_t head = 0;            // Where the next delta goes
+  std::deque<Entry> entries;  // Oldest first
+  std::vector<uint8_t> latest;
+  std::vector<uint8_t> state; // Scratch
+  std::vector<uint8_t> delta; // Scratch
+
+  void pop(); // Step latest back to the state before it
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// xorshift32: small and fast, and the whole state is one word so it's
+// trivial to save and restore (see Chip8::save_state)
+class Rng
+{
+public:
+  void seed(uint32_t s)
+  {
+    state = s ? s : 0x2545f491; // 0 would stay 0 forever
+  }
+
+  uint32_t operator()()
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+
+  // The low bits of xorshift are the weakest, so take the top ones
+  uint8_t byte() { return (*this)() >> 24; }
+
+  uint32_t state = 1;
+};
+
+#endif
@@ -0,0 +1,208 @@
+#include "rompack.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const uint32_t pack_version = 1;
+static const size_t header_size = 12;
+static const size_t entry_size = 24;
+
+static uint32_t get32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+  return get32(p) | ((uint64_t)get32(p+4) << 32);
+}
+
+static void put32(std::vector<uint8_t> &out, uint32_t v)
+{
+  for (unsigned int i=0; i<4; i++)
+    out.push_back(v >> (i*8));
+}
+
+static void put64(std::vector<uint8_t> &out, uint64_t v)
+{
+  put32(out, v & 0xffffffff);
+  put32(out, v >> 32);
+}
+
+uint64_t RomPack::hash(const uint8_t *data, size_t size)
+{
+  uint64_t h = 0xcbf29ce484222325;
+  for (size_t i=0; i<size; i++)
+  {
+    h ^= data[i];
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+RomPack::~RomPack()
+{
+  close();
+}
+
+void RomPack::close()
+{
+  if (map)
+    munmap(const_cast<uint8_t *>(map), map_size);
+  map = nullptr;
+  map_size = 0;
+  roms.clear();
+  names.clear();
+}
+
+bool RomPack::open(const char *path)
+{
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Couldn't open ROM pack '%s'\n", path);
+    return false;
+  }
+  struct stat st;
+  void *m = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  close();
+  if (m == MAP_FAILED)
+  {
+    fprintf(stderr, "Couldn't map ROM pack '%s'\n", path);
+    return false;
+  }
+  map = static_cast<const uint8_t *>(m);
+  map_size = st.st_size;
+
+  if (map_size < header_size || memcmp(map, "C8PK", 4) != 0 ||
+      get32(map + 4) != pack_version)
+  {
+    fprintf(stderr, "'%s' is not a ROM pack\n", path);
+    close();
+    return false;
+  }
+  uint32_t count = get32(map + 8);
+  if (header_size + (uint64_t)count*entry_size > map_size)
+  {
+    fprintf(stderr, "'%s' is corrupt\n", path);
+    close();
+    return false;
+  }
+  roms.reserve(count);
+  for (uint32_t i=0; i<count; i++)
+  {
+    const uint8_t *e = map + header_size + i*entry_size;
+    uint32_t offset = get32(e + 8);
+    uint32_t size = get32(e + 12);
+    uint32_t name_offset = get32(e + 16);
+    uint32_t name_length = get32(e + 20);
+    uint64_t hash = get64(e);
+    // find() binary searches the index, so it must be in order
+    if ((uint64_t)offset + size > map_size ||
+        (uint64_t)name_offset + name_length + 1 > map_size ||
+        map[name_offset + name_length] != '\0' ||
+        (i > 0 && hash < roms.back().hash))
+    {
+      fprintf(stderr, "'%s' is corrupt\n", path);
+      close();
+      return false;
+    }
+    PackedRom rom;
+    rom.name = reinterpret_cast<const char *>(map + name_offset);
+    rom.hash = hash;
+    rom.data = map + offset;
+    rom.size = size;
+    roms.push_back(rom);
+    names.emplace(std::string(rom.name, name_length), i);
+  }
+  return true;
+}
+
+const PackedRom *RomPack::find(const char *name) const
+{
+  auto it = names.find(name);
+  return it == names.end() ? nullptr : &roms[it->second];
+}
+
+const PackedRom *RomPack::find(uint64_t hash) const
+{
+  auto it = std::lower_bound(roms.begin(), roms.end(), hash,
+                             [](const PackedRom &r, uint64_t h) { return r.hash < h; });
+  return it == roms.end() || it->hash != hash ? nullptr : &*it;
+}
+
+bool RomPack::write(const char *path, const std::vector<const char *> &paths)
+{
+  struct Input
+  {
+    const char *name;
+    std::vector<uint8_t> data;
+    uint64_t hash;
+  };
+  std::vector<Input> inputs;
+  for (const char *p : paths)
+  {
+    std::ifstream file(p, std::ios::binary);
+    if (!file.is_open())
+    {
+      fprintf(stderr, "Couldn't load ROM from '%s'\n", p);
+      return false;
+    }
+    Input in;
+    in.name = p;
+    in.data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    in.hash = hash(in.data.data(), in.data.size());
+    inputs.push_back(std::move(in));
+  }
+  std::sort(inputs.begin(), inputs.end(),
+            [](const Input &a, const Input &b) { return a.hash < b.hash; });
+
+  size_t names_size = 0;
+  for (auto &in : inputs)
+    names_size += strlen(in.name) + 1;
+  uint32_t name_offset = header_size + inputs.size()*entry_size;
+  uint32_t offset = name_offset + names_size;
+
+  std::vector<uint8_t> out;
+  out.insert(out.end(), {'C', '8', 'P', 'K'});
+  put32(out, pack_version);
+  put32(out, inputs.size());
+  for (auto &in : inputs)
+  {
+    size_t name_length = strlen(in.name);
+    put64(out, in.hash);
+    put32(out, offset);
+    put32(out, in.data.size());
+    put32(out, name_offset);
+    put32(out, name_length);
+    offset += in.data.size();
+    name_offset += name_length + 1;
+  }
+  for (auto &in : inputs)
+    out.insert(out.end(), in.name, in.name + strlen(in.name) + 1);
+  for (auto &in : inputs)
+    out.insert(out.end(), in.data.begin(), in.data.end());
+
+  FILE *f = fopen(path, "wb");
+  if (!f)
+  {
+    fprintf(stderr, "Couldn't write ROM pack to '%s'\n", path);
+    return false;
+  }
+  bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+  ok &= fclose(f) == 0;
+  if (!ok)
+    fprintf(stderr, "Couldn't write ROM pack to '%s'\n", path);
+  return ok;
+}
@@ -0,0 +1,65 @@
+#ifndef ROMPACK_H
+#define ROMPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A library of ROMs in one file, mapped into memory once so loading a ROM
+// from it is a lookup and a memcpy with no file access.
+//
+// File layout, all little-endian:
+//
+//   header  "C8PK" version:u32 count:u32
+//   index   count entries, sorted by hash:
+//           hash:u64 offset:u32 size:u32 name_offset:u32 name_length:u32
+//   names   NUL-terminated
+//   data    The ROMs
+//
+// Offsets are from the start of the file, and hash is the 64-bit FNV-1a
+// hash of the ROM.
+
+struct PackedRom
+{
+  const char *name;
+  uint64_t hash;
+  const uint8_t *data;
+  uint32_t size;
+};
+
+class RomPack
+{
+public:
+  RomPack() {}
+  ~RomPack();
+  RomPack(const RomPack &) = delete;
+  RomPack &operator=(const RomPack &) = delete;
+
+  // Returns false (after printing why), leaving the pack empty, if the
+  // file isn't a valid pack
+  bool open(const char *path);
+
+  // nullptr if there's no such ROM
+  const PackedRom *find(const char *name) const;
+  const PackedRom *find(uint64_t hash) const;
+
+  size_t size() const { return roms.size(); }
+  const PackedRom &operator[](size_t i) const { return roms[i]; }
+
+  // Pack the files at paths, named by their paths. Returns false on error.
+  static bool write(const char *path, const std::vector<const char *> &paths);
+
+  static uint64_t hash(const uint8_t *data, size_t size);
+
+private:
+  void close();
+
+  const uint8_t *map = nullptr;
+  size_t map_size = 0;
+  std::vector<PackedRom> roms; // Sorted by hash
+  std::unordered_map<std::string, uint32_t> names;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+
+// Keeps a real-time run loop on the monotonic clock, however often it gets
+// to run: each tick (one begin_frame() and step(), so one timer decrement)
+// is due exactly 1/60 sec after the last, and the instructions for a given
+// speed are spread over the ticks.
+//
+// Tick n is due at a fixed offset from the start, rather than a frame after
+// tick n-1 ran, so late wake-ups and rounding never add up to drift.
+class Scheduler
+{
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  static const unsigned int tick_rate = 60; // Timer ticks a second
+
+  // Ticks run back to back at most, when catching up
+  static const unsigned int max_batch = 4;
+
+  // Ticks overdue beyond this many are skipped rather than caught up, so
+  // after a long stall (e.g. the machine sleeping) the game carries on
+  // where it was instead of running flat out until it's back on time
+  static const unsigned int max_lag = 15;
+
+  Scheduler() : start(Clock::now()) {}
+
+  // The number of ticks to run now, up to max_batch. Call again after
+  // running them; more may still be due.
+  unsigned int due()
+  {
+    uint64_t now = ticks_by(Clock::now());
+    if (now > ticks + max_lag)
+    {
+      // Drop the time lost, moving the start so the ticks stay evenly spaced
+      start += tick_time(now - ticks - max_lag);
+      now = ticks + max_lag;
+    }
+    uint64_t n = now - ticks;
+    return n < max_batch ? n : max_batch;
+  }
+
+  // Count a tick as run, returning how many instructions it gets at
+  // instructions_per_second. The remainder carries over, so e.g. 700/sec
+  // alternates 11 and 12 instructions and adds up to exactly 700 a second.
+  unsigned int tick(unsigned int instructions_per_second)
+  {
+    ticks++;
+    remainder += instructions_per_second;
+    unsigned int n = remainder / tick_rate;
+    remainder %= tick_rate;
+    return n;
+  }
+
+  // Sleep until the next tick is due, at once if it already is. This
+  // sleeps in the OS rather than spinning, to an absolute deadline, so
+  // wake-ups are as close as the OS's timer allows (tens of microseconds
+  // on Linux) and the thread uses no CPU meanwhile.
+  void wait() const
+  {
+    Clock::time_point next = start + tick_time(ticks);
+    // sleep_until can return early, e.g. on a signal
+    while (Clock::now() < next)
+      std::this_thread::sleep_until(next);
+  }
+
+private:
+  Clock::time_point start; // When tick 0 was due
+  uint64_t ticks = 0;      // Ticks run
+  unsigned int remainder = 0;
+
+  static Clock::duration tick_time(uint64_t n)
+  {
+    return std::chrono::duration_cast<Clock::duration>(
+      std::chrono::nanoseconds(n * 1000000000 / tick_rate));
+  }
+
+  // Ticks due by t, counting tick 0, due at the start
+  uint64_t ticks_by(Clock::time_point t) const
+  {
+    if (t < start)
+      return 0;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t - start).count()
+      * tick_rate / 1000000000 + 1;
+  }
+};
+
+#endif
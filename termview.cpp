@@ -0,0 +1,119 @@
+#include "termview.h"
+#include "chip8.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+static_assert(TermView::columns*2*TermView::rows*4 == Chip8::max_display_pixels,
+              "braille cells cover the display");
+
+// Breaking a run of changed cells costs a cursor move of up to 8 bytes,
+// and an unchanged cell costs 3, so runs are joined across short gaps
+static const unsigned int max_gap = 2;
+
+// Dot bit for each pixel of a 2x4 braille cell, by row then column
+static const uint8_t dots[4][2] = {
+  {0x01, 0x08},
+  {0x02, 0x10},
+  {0x04, 0x20},
+  {0x40, 0x80}
+};
+
+static void put_cell(std::string &out, uint8_t cell)
+{
+  // U+2800 plus the dot bits, in UTF-8
+  out += (char)0xe2;
+  out += (char)(0xa0 | (cell >> 6));
+  out += (char)(0x80 | (cell & 0x3f));
+}
+
+static void move_to(std::string &out, unsigned int row, unsigned int column)
+{
+  char escape[16];
+  snprintf(escape, sizeof(escape), "\x1b[%u;%uH", row + 1, column + 1);
+  out += escape;
+}
+
+void TermView::draw(const Chip8 &c)
+{
+  uint8_t bits[Chip8::display_bytes];
+  c.get_display_bits(bits);
+  const unsigned int row_bytes = columns*2/8;
+
+  out.clear();
+  if (!started)
+  {
+    // Clear the screen and hide the cursor, then draw every cell. Anything
+    // already printed goes out first.
+    fflush(stdout);
+    out += "\x1b[2J\x1b[?25l";
+    memset(cells, 0xff, sizeof(cells));
+  }
+
+  for (unsigned int r=0; r<rows; r++)
+  {
+    uint8_t line[columns];
+    memset(line, 0, sizeof(line));
+    for (unsigned int y=0; y<4; y++)
+    {
+      const uint8_t *row = bits + (r*4 + y)*row_bytes;
+      for (unsigned int x=0; x<columns*2; x++)
+      {
+        if ((row[x/8] >> (7 - x%8)) & 1)
+          line[x/2] |= dots[y][x%2];
+      }
+    }
+
+    unsigned int x = 0;
+    while (x < columns)
+    {
+      if (line[x] == cells[r][x] && started)
+      {
+        x++;
+        continue;
+      }
+      // A run of changes, until more than max_gap cells in a row are the same
+      unsigned int end = x + 1;
+      for (unsigned int same=0; end < columns && same <= max_gap; end++)
+        same = line[end] == cells[r][end] ? same + 1 : 0;
+      while (line[end - 1] == cells[r][end - 1] && started)
+        end--;
+      move_to(out, r, x);
+      for (; x<end; x++)
+      {
+        put_cell(out, line[x]);
+        cells[r][x] = line[x];
+      }
+    }
+  }
+  started = true;
+  send();
+}
+
+void TermView::finish()
+{
+  if (!started)
+    return;
+  out.clear();
+  move_to(out, rows, 0);
+  out += "\x1b[?25h";
+  send();
+  started = false;
+}
+
+void TermView::send()
+{
+  const char *p = out.data();
+  size_t left = out.size();
+  while (left > 0)
+  {
+    ssize_t n = ::write(fd, p, left);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return; // Nowhere to show it; not worth stopping the emulator for
+    p += n;
+    left -= n;
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef TERMVIEW_H
+#define TERMVIEW_H
+
+#include <stdint.h>
+#include <string>
+#include <unistd.h>
+
+class Chip8;
+
+// Shows the display on a terminal in Unicode braille, each character a 2x4
+// block of pixels, so the 128x64 display fits in 64x16 characters.
+//
+// Only the characters that changed since the last frame are sent, each run
+// of them after a cursor move, in one write per frame; a frame that moves a
+// sprite or two costs a few hundred bytes, so it can be watched live over a
+// slow SSH link.
+class TermView
+{
+public:
+  static const unsigned int columns = 64;
+  static const unsigned int rows = 16;
+
+  explicit TermView(int fd = STDOUT_FILENO) : fd(fd) {}
+  ~TermView() { finish(); }
+  TermView(const TermView &) = delete;
+  TermView &operator=(const TermView &) = delete;
+
+  void draw(const Chip8 &c);
+
+  // Put the cursor back, below the picture, so output can follow it
+  void finish();
+
+private:
+  int fd;
+  bool started = false;
+  uint8_t cells[rows][columns]; // Braille dots on the terminal now
+  std::string out;
+
+  void send();
+};
+
+#endif
@@ -0,0 +1,172 @@
+// Runs generated ROMs through chip8-headless with every dispatch method and
+// quirk profile, and checks each method's --save-state output is byte for
+// byte the same as the switch interpreter's.
+//
+// Usage: dispatch-test CHIP8_HEADLESS WORK_DIR
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <random>
+
+std::mt19937 rng; // not seeded - should be the same every time
+
+// Any instruction, mostly register ones so the JIT gets long blocks, with
+// jumps, calls and I pointing into the program
+uint16_t random_instruction()
+{
+  uint16_t x = (rng() % 16) << 8;
+  uint16_t y = (rng() % 16) << 4;
+  uint16_t kk = rng() % 0x100;
+  uint16_t n = rng() % 16;
+  uint16_t code = 0x200 + 2*(rng() % 0x100);
+  static const uint16_t alu[] = {0, 1, 2, 3, 4, 5, 6, 7, 0xe};
+  switch (rng() % 24)
+  {
+    case 0:  return 0x1000 | code;
+    case 1:  return 0x2000 | code;
+    case 2:  return 0x00ee;
+    case 3:  return 0x3000 | x | (kk & 3);
+    case 4:  return 0x4000 | x | (kk & 3);
+    case 5:  return 0x5000 | x | y;
+    case 6:  return 0x9000 | x | y;
+    case 7:  return 0x6000 | x | kk;
+    case 8:  case 9:  return 0x7000 | x | kk;
+    case 10: case 11: case 12: return 0x8000 | x | y | alu[rng() % 9];
+    case 13: return 0xa000 | code; // Fx33 and Fx55 then write into the code
+    case 14: return 0xb000 | code;
+    case 15: return 0xc000 | x | kk;
+    case 16: return 0xd000 | x | y | n;
+    case 17: return 0xf007 | x;
+    case 18: return 0xf015 | x;
+    case 19: return 0xf01e | x;
+    case 20: return 0xf029 | x;
+    case 21: return 0xf033 | x;
+    case 22: return 0xf055 | x;
+    default: return 0xf065 | x;
+  }
+}
+
+std::vector<uint8_t> random_rom()
+{
+  std::vector<uint8_t> rom;
+  for (unsigned int i=0; i<0x100; i++)
+  {
+    uint16_t instruction = random_instruction();
+    rom.push_back(instruction >> 8);
+    rom.push_back(instruction & 0xff);
+  }
+  return rom;
+}
+
+// A loop of a long run of register instructions - one JIT block of up to
+// 64 instructions, 128 bytes - which rewrites the block's last instruction
+// each time round. Dropping the block means finding where it starts, 126
+// bytes back from the write.
+std::vector<uint8_t> self_modifying_rom(unsigned int target)
+{
+  std::vector<uint16_t> code;
+  code.push_back(0x6072);                 // 0x200: V0 = 0x72
+  for (unsigned int i=0; i<63; i++)
+    code.push_back(0x7101);               // V1 += 1
+  code.push_back(0xa000 | target);        // 0x280: I = target
+  code.push_back(0xf155);                 // [I] = 72 V1, i.e. V2 += V1
+  code.push_back(0x1200);                 // Round again
+  std::vector<uint8_t> rom;
+  for (uint16_t instruction : code)
+  {
+    rom.push_back(instruction >> 8);
+    rom.push_back(instruction & 0xff);
+  }
+  return rom;
+}
+
+bool write_file(const std::string &path, const std::vector<uint8_t> &data)
+{
+  FILE *f = fopen(path.c_str(), "wb");
+  if (!f)
+    return false;
+  bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+  return fclose(f) == 0 && ok;
+}
+
+bool read_file(const std::string &path, std::vector<uint8_t> &data)
+{
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f)
+    return false;
+  data.clear();
+  int c;
+  while ((c = fgetc(f)) != EOF)
+    data.push_back(c);
+  fclose(f);
+  return true;
+}
+
+// Run rom and read back the state it ends in
+bool run(const std::string &emulator, const std::string &rom, const char *dispatch,
+         const char *quirks, const char *ips, const std::string &state,
+         std::vector<uint8_t> &out)
+{
+  std::string command = emulator + " -d " + dispatch + " -q " + quirks + " -i " + ips +
+                        " -f 60 --seed 1 --save-state " + state + " " + rom + " > /dev/null";
+  if (system(command.c_str()) != 0)
+  {
+    fprintf(stderr, "Failed: %s\n", command.c_str());
+    return false;
+  }
+  return read_file(state, out);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 3)
+  {
+    fprintf(stderr, "Usage: %s CHIP8_HEADLESS WORK_DIR\n", argv[0]);
+    return 1;
+  }
+  std::string emulator = argv[1];
+  std::string dir = argv[2];
+
+  std::vector<std::vector<uint8_t>> roms;
+  for (unsigned int i=0; i<8; i++)
+    roms.push_back(random_rom());
+  roms.push_back(self_modifying_rom(0x27e)); // The block's last instruction
+  roms.push_back(self_modifying_rom(0x240)); // And one in the middle
+
+  static const char *dispatches[] = {"table", "cached", "jit"};
+  static const char *profiles[] = {"legacy", "vip", "schip"};
+  static const char *speeds[] = {"7", "64", "500"};
+  bool pass = true;
+  for (unsigned int r=0; r<roms.size(); r++)
+  {
+    std::string rom = dir + "/dispatch-" + std::to_string(r) + ".ch8";
+    std::string state = dir + "/dispatch-" + std::to_string(r) + ".state";
+    if (!write_file(rom, roms[r]))
+    {
+      fprintf(stderr, "Couldn't write %s\n", rom.c_str());
+      return 1;
+    }
+    for (const char *quirks : profiles)
+    {
+      for (const char *ips : speeds)
+      {
+        std::vector<uint8_t> expected, got;
+        if (!run(emulator, rom, "switch", quirks, ips, state, expected))
+          return 1;
+        for (const char *dispatch : dispatches)
+        {
+          if (!run(emulator, rom, dispatch, quirks, ips, state, got))
+            return 1;
+          if (got != expected)
+          {
+            fprintf(stderr, "ROM %u, -q %s -i %s: -d %s state differs from -d switch\n",
+                    r, quirks, ips, dispatch);
+            pass = false;
+          }
+        }
+      }
+    }
+  }
+  return pass ? 0 : 1;
+}
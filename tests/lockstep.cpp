@@ -0,0 +1,231 @@
+// Runs generated ROMs on Lockstep<N> and on N separate Chip8s, with each
+// lane seeded and keyed differently so they branch apart and back, and
+// checks every lane's state matches its Chip8 frame by frame.
+//
+// Lane counts that don't fill the last group of four lanes (5, 13) are
+// included, as are all three quirk profiles, so sprites both wrap and clip.
+#include "lockstep.h"
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <random>
+
+std::mt19937 rng; // not seeded - should be the same every time
+
+// Any instruction but the ones which wait or stop, weighted towards the
+// ones which make lanes differ: random numbers, keys and skips on them.
+// Some come in pairs, so keys are only looked up for Vx < 16.
+void random_instruction(std::vector<uint16_t> &code)
+{
+  uint16_t x = (rng() % 16) << 8;
+  uint16_t y = (rng() % 16) << 4;
+  uint16_t kk = rng() % 0x100;
+  uint16_t n = rng() % 16;
+  uint16_t jump = 0x200 + 2*(rng() % 0x100);
+  static const uint16_t alu[] = {0, 1, 2, 3, 4, 5, 6, 7, 0xe};
+  static const uint16_t misc[] = {0x00e0, 0x00fb, 0x00fc, 0x00fe, 0x00ff};
+  switch (rng() % 32)
+  {
+    case 0:  code.push_back(0x1000 | jump); break;
+    case 1:  code.push_back(0x2000 | jump); break;
+    case 2:  code.push_back(0x00ee); break;
+    case 3:  code.push_back(0x3000 | x | (kk & 3)); break;
+    case 4:  code.push_back(0x4000 | x | (kk & 3)); break;
+    case 5:  code.push_back(0x5000 | x | y); break;
+    case 6:  code.push_back(0x9000 | x | y); break;
+    case 7:  code.push_back(0x6000 | x | kk); break;
+    case 8:  code.push_back(0x7000 | x | kk); break;
+    case 9:  case 10: code.push_back(0x8000 | x | y | alu[rng() % 9]); break;
+    case 11: code.push_back(0xa000 | (0x200 + rng() % 0xe00)); break;
+    case 12: code.push_back(0xa000 | jump); break; // Fx33 and Fx55 then write into the code
+    case 13: code.push_back(0xb000 | jump); break;
+    case 14: case 15: code.push_back(0xc000 | x | (kk | 3)); break;
+    case 16: case 17: case 18: code.push_back(0xd000 | x | y | n); break;
+    case 19: code.push_back(0xc00f | x); code.push_back(0xe09e | x); break;
+    case 20: code.push_back(0xc00f | x); code.push_back(0xe0a1 | x); break;
+    case 21: code.push_back(0x00c0 | n); break;
+    case 22: code.push_back(misc[rng() % 5]); break;
+    case 23: code.push_back(0xf007 | x); break;
+    case 24: code.push_back(0xf015 | x); break;
+    case 25: code.push_back(0xf018 | x); break;
+    case 26: code.push_back(0xf01e | x); break;
+    case 27: code.push_back(rng() % 2 ? 0xf029 | x : 0xf030 | x); break;
+    case 28: code.push_back(0xf033 | x); break;
+    case 29: code.push_back(0xf055 | x); break;
+    case 30: code.push_back(0xf065 | x); break;
+    default: code.push_back(rng() % 2 ? 0xf075 | (x & 0x700) : 0xf085 | (x & 0x700));
+  }
+}
+
+std::vector<uint8_t> to_bytes(const std::vector<uint16_t> &code)
+{
+  std::vector<uint8_t> rom;
+  for (uint16_t instruction : code)
+  {
+    rom.push_back(instruction >> 8);
+    rom.push_back(instruction & 0xff);
+  }
+  return rom;
+}
+
+std::vector<uint8_t> random_rom()
+{
+  std::vector<uint16_t> code;
+  while (code.size() < 0x100)
+    random_instruction(code);
+  code.resize(0x100);
+  return to_bytes(code);
+}
+
+// Each lane writes a random add into the code and runs it, so the lanes
+// fetch different instructions from the same address, then draws its
+// total and goes round again
+std::vector<uint8_t> self_modifying_rom()
+{
+  return to_bytes({
+    0x6072, // 0x200: V0 = 0x72
+    0xc1ff, //        V1 = random
+    0xa20e, //        I = 0x20e
+    0xf155, //        [I] = V0 V1, i.e. 0x20e: V2 += random
+    0xa300, //        I = 0x300
+    0xf233, //        BCD of V2
+    0xf229, //        I = font digit for V2
+    0xd345, //        Draw it at V3, V4
+    0x7305, //        V3 += 5
+    0x0000, // 0x20e: Written above
+    0x1202  //        Round again
+  });
+}
+
+// Big sprites at random places, so they go off every edge, in the normal
+// or extended mode depending on each lane's keys
+std::vector<uint8_t> edges_rom()
+{
+  return to_bytes({
+    0xc0ff, // 0x200: V0 = random
+    0xc1ff, //        V1 = random
+    0xa200, //        I = the code, as a sprite
+    0xd01f, //        Draw 15 rows at V0, V1
+    0xc20f, //        V2 = random key
+    0xe2a1, //        Skip if it isn't pressed
+    0x00ff, //        Extended mode
+    0xd010, //        Draw 16x16 (nothing in the normal mode)
+    0xe29e, //        Skip if it is pressed
+    0x00fe, //        Normal mode
+    0x1200  //        Round again
+  });
+}
+
+// The keys held in frame, for lane
+uint16_t keys_at(unsigned int lane, unsigned int frame)
+{
+  uint32_t h = (lane*31 + frame/8 + 1) * 2654435761u;
+  return h >> 16;
+}
+
+bool same_state(Chip8 &a, Chip8 &b)
+{
+  std::vector<uint8_t> sa, sb;
+  a.save_state(sa);
+  b.save_state(sb);
+  return sa == sb && a.status == b.status;
+}
+
+// Run rom for frames frames on Lanes lanes and Lanes Chip8s. With
+// check_each_frame unset, the lanes are only looked at when their keys
+// change, so they stay in the register file in between.
+template <unsigned int Lanes>
+bool run(const std::vector<uint8_t> &rom, Quirks quirks, unsigned int ips,
+         bool check_each_frame, const char *what)
+{
+  const unsigned int frames = 120;
+  Chip8 settings;
+  settings.quirks = quirks;
+  settings.instructions_per_step = ips;
+  std::unique_ptr<Lockstep<Lanes>> lockstep(new Lockstep<Lanes>(settings));
+  lockstep->loadProgram(rom.data(), rom.size(), what);
+  std::vector<std::unique_ptr<Chip8>> chip8s;
+  for (unsigned int l=0; l<Lanes; l++)
+  {
+    chip8s.emplace_back(new Chip8());
+    Chip8 &c = *chip8s.back();
+    c.dispatch = Chip8::Dispatch::Switch;
+    c.quirks = quirks;
+    c.instructions_per_step = ips;
+    c.muted = true;
+    c.loadProgram(rom.data(), rom.size(), what);
+    c.seed(l + 1);
+    lockstep->lane(l).seed(l + 1);
+  }
+
+  for (unsigned int frame=0; frame<frames; frame++)
+  {
+    bool new_keys = frame % 8 == 0;
+    for (unsigned int l=0; l<Lanes; l++)
+    {
+      uint16_t keys = keys_at(l, frame);
+      for (unsigned int k=0; k<16; k++)
+      {
+        chip8s[l]->keys[k] = (keys >> k) & 1;
+        if (new_keys)
+          lockstep->lane(l).keys[k] = (keys >> k) & 1;
+      }
+      chip8s[l]->step();
+    }
+    lockstep->step();
+
+    if (!check_each_frame && frame + 1 < frames && (frame + 1) % 8 != 0)
+      continue;
+    for (unsigned int l=0; l<Lanes; l++)
+    {
+      if (!same_state(lockstep->lane(l), *chip8s[l]))
+      {
+        fprintf(stderr, "%s, -q %u -i %u, %u lanes%s: lane %u differs in frame %u\n",
+                what, (unsigned int)quirks, ips, Lanes,
+                check_each_frame ? ", checked each frame" : "", l, frame);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+int main()
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+  if (!__builtin_cpu_supports("avx2"))
+    printf("No AVX2: the lanes run as separate Chip8s, so this only checks that\n");
+#endif
+  std::vector<std::vector<uint8_t>> roms;
+  std::vector<std::string> names;
+  for (unsigned int i=0; i<6; i++)
+  {
+    roms.push_back(random_rom());
+    names.push_back("random ROM " + std::to_string(i));
+  }
+  roms.push_back(self_modifying_rom());
+  names.push_back("self-modifying ROM");
+  roms.push_back(edges_rom());
+  names.push_back("edges ROM");
+
+  static const Quirks profiles[] = {Quirks::Legacy, Quirks::Vip, Quirks::SuperChip};
+  bool pass = true;
+  for (unsigned int r=0; r<roms.size(); r++)
+  {
+    for (Quirks quirks : profiles)
+    {
+      const char *what = names[r].c_str();
+      pass &= run<5>(roms[r], quirks, 7, true, what);
+      pass &= run<13>(roms[r], quirks, 30, false, what);
+      pass &= run<8>(roms[r], quirks, 1, false, what);
+      pass &= run<32>(roms[r], quirks, 64, r % 2 == 0, what);
+    }
+  }
+  if (pass)
+    printf("All lockstep tests passed\n");
+  else
+    printf("Lockstep tests failed\n");
+  return pass ? 0 : 1;
+}
@@ -1,5 +1,6 @@
 #include "memory.h"
 #include <stdio.h>
+#include <string.h>
 #include <random>
 
 const int memSize = 1000;
@@ -66,11 +67,113 @@ bool test_memory_16bit()
   return pass;
 }
 
+bool test_memory_wrap()
+{
+  bool pass = true;
+  Memory<0x1000, WrapAddresses> mem;
+
+  // Addresses past the end wrap around to the start
+  mem.set8(0x1005, 0xab);
+  if (mem.get8(5) != 0xab || mem.get8(0x3005) != 0xab)
+  {
+    fprintf(stderr, "Wrapped 8-bit access error\n");
+    pass = false;
+  }
+
+  // Including halfway through a 16-bit access
+  mem.set16(0xfff, 0x1234);
+  if (mem.get8(0xfff) != 0x12 || mem.get8(0) != 0x34 || mem.get16(0x1fff) != 0x1234)
+  {
+    fprintf(stderr, "Wrapped 16-bit access error\n");
+    pass = false;
+  }
+  if (mem.fault.faulted)
+  {
+    fprintf(stderr, "Wrapped access reported a fault\n");
+    pass = false;
+  }
+  return pass;
+}
+
+bool test_memory_fault()
+{
+  bool pass = true;
+  Memory<memSize, ReportFault> mem;
+
+  mem.set8(0, 0x55);
+  if (mem.fault.faulted)
+  {
+    fprintf(stderr, "Fault reported for an in range access\n");
+    pass = false;
+  }
+  mem.set16(memSize-1, 0xffff); // Straddles the end, so isn't written
+  if (!mem.fault.faulted || strcmp(mem.fault.access, "set16") != 0 ||
+      mem.fault.address != memSize-1)
+  {
+    fprintf(stderr, "Out of range set16 not reported\n");
+    pass = false;
+  }
+  if (mem.get8(memSize-1) != 0)
+  {
+    fprintf(stderr, "Out of range set16 wrote memory\n");
+    pass = false;
+  }
+
+  // Bad reads give 0, and the first fault is kept
+  if (mem.get8(memSize) != 0 || mem.get16(memSize+100) != 0 || mem.get8(0) != 0x55)
+  {
+    fprintf(stderr, "Out of range reads error\n");
+    pass = false;
+  }
+  if (strcmp(mem.fault.access, "set16") != 0)
+  {
+    fprintf(stderr, "First fault overwritten\n");
+    pass = false;
+  }
+  return pass;
+}
+
+bool test_memory_dirty()
+{
+  bool pass = true;
+  Memory<0x1000> mem;
+  const unsigned int line = Memory<0x1000>::line_size;
+
+  mem.clean();
+  mem.set8(line*3 + 5, 1);
+  mem.set16(line*8 - 1, 0x0102); // Straddles lines 7 and 8
+  uint8_t src[3] = {};
+  mem.load(line*20 - 1, 3, src);  // Lines 19 and 20
+  for (unsigned int l=0; l<Memory<0x1000>::lines; l++)
+  {
+    bool expected = l == 3 || l == 7 || l == 8 || l == 19 || l == 20;
+    if (mem.dirty(l) != expected)
+    {
+      fprintf(stderr, "Dirty line error: line %u is %s\n", l, expected ? "clean" : "dirty");
+      pass = false;
+    }
+  }
+
+  mem.clean();
+  for (unsigned int l=0; l<Memory<0x1000>::lines; l++)
+  {
+    if (mem.dirty(l))
+    {
+      fprintf(stderr, "Dirty line error: line %u still dirty after clean()\n", l);
+      pass = false;
+    }
+  }
+  return pass;
+}
+
 int main()
 {
   bool result = true;
   result &= test_memory_8bit();
   result &= test_memory_16bit();
+  result &= test_memory_wrap();
+  result &= test_memory_fault();
+  result &= test_memory_dirty();
   if (result)
   {
     printf("All memory tests passed\n");
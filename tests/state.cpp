@@ -0,0 +1,331 @@
+// Save states, checkpoints and movies: a machine restored from any of them
+// must carry on exactly as the one they were taken from.
+//
+// Usage: state-test WORK_DIR
+#include "chip8.h"
+#include "movie.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Draws random sprites at random places, skipping on random keys, and
+// writes a counter into memory every round, so the RNG, display, memory,
+// keys and timers all end up in the state. The first instruction picks the
+// mode: 00FE normal, 00FF extended.
+std::vector<uint8_t> test_rom(uint16_t mode)
+{
+  std::vector<uint16_t> code = {
+    mode,
+    0xc0ff, // 0x202: V0 = random
+    0xc13f, //        V1 = random & 0x3f
+    0xc20f, //        V2 = random & 0xf
+    0xa220, //        I = sprite
+    0xd015, //        Draw it at V0, V1
+    0xe29e, //        Skip if key V2 is pressed
+    0x7301, //        V3 += 1
+    0xa300, //        I = 0x300
+    0xf333, //        BCD of V3 at 0x300
+    0xf215, //        Delay timer = V2
+    0x1202, //        Round again
+    0, 0, 0, 0,
+    0xf090, 0xf090, 0xf000 // 0x220: sprite
+  };
+  std::vector<uint8_t> rom;
+  for (uint16_t instruction : code)
+  {
+    rom.push_back(instruction >> 8);
+    rom.push_back(instruction & 0xff);
+  }
+  return rom;
+}
+
+// The keys pressed in each frame
+uint16_t keys_at(unsigned int frame)
+{
+  uint32_t x = frame * 2654435761u;
+  return (x >> 16) & (x >> 8);
+}
+
+void load(Chip8 &c, const std::vector<uint8_t> &rom, uint32_t seed)
+{
+  c.loadProgram(rom.data(), rom.size(), "test");
+  c.seed(seed);
+  c.muted = true;
+  c.instructions_per_step = 20;
+}
+
+// Run frames [first, first + n) as the run loops do. A movie player, if
+// set, overrides the keys.
+void run(Chip8 &c, unsigned int first, unsigned int n)
+{
+  for (unsigned int frame=first; frame<first+n; frame++)
+  {
+    for (unsigned int k=0; k<16; k++)
+      c.keys[k] = (keys_at(frame) >> k) & 1;
+    if (c.begin_frame())
+      c.step();
+  }
+}
+
+std::vector<uint8_t> state(const Chip8 &c)
+{
+  std::vector<uint8_t> s;
+  c.save_state(s);
+  return s;
+}
+
+// The same state in the version 1 layout, which had separate 64x32 and
+// 128x64 displays
+std::vector<uint8_t> to_v1(const std::vector<uint8_t> &s)
+{
+  const size_t display = 64 + 0x1000;
+  std::vector<uint8_t> v1(s.begin(), s.begin() + display);
+  v1[4] = 1;
+  v1[5] = 0;
+  bool extended = s[8] & 1;
+  for (unsigned int y=0; y<32; y++)
+  {
+    for (unsigned int b=0; b<8; b++)
+    {
+      // Every other pixel of every other row of the 128x64 display
+      uint8_t byte = 0;
+      for (unsigned int x=b*8; x<b*8+8; x++)
+      {
+        bool pixel = s[display + y*2*16 + x*2/8] & (0x80 >> (x*2%8));
+        byte = (byte << 1) | pixel;
+      }
+      // In the extended mode this display wasn't in use, so fill it with
+      // something that would show up if it were read
+      v1.push_back(extended ? 0xa5 : byte);
+    }
+  }
+  if (extended)
+    v1.insert(v1.end(), s.begin() + display, s.end());
+  else
+    v1.insert(v1.end(), 64*128/8, 0x5a);
+  return v1;
+}
+
+bool test_round_trip(uint16_t mode)
+{
+  std::vector<uint8_t> rom = test_rom(mode);
+  Chip8 a;
+  load(a, rom, 1);
+  run(a, 0, 30);
+  std::vector<uint8_t> saved = state(a);
+  run(a, 30, 30);
+
+  Chip8 b;
+  load(b, rom, 2);
+  if (!b.load_state(saved.data(), saved.size()))
+  {
+    fprintf(stderr, "%04X: saved state rejected\n", mode);
+    return false;
+  }
+  run(b, 30, 30);
+  if (state(b) != state(a))
+  {
+    fprintf(stderr, "%04X: loaded state runs differently\n", mode);
+    return false;
+  }
+  return true;
+}
+
+bool test_v1(uint16_t mode)
+{
+  std::vector<uint8_t> rom = test_rom(mode);
+  Chip8 a;
+  load(a, rom, 1);
+  run(a, 0, 30);
+  std::vector<uint8_t> saved = state(a);
+  std::vector<uint8_t> v1 = to_v1(saved);
+
+  Chip8 b;
+  load(b, rom, 2);
+  if (!b.load_state(v1.data(), v1.size()))
+  {
+    fprintf(stderr, "%04X: version 1 state rejected\n", mode);
+    return false;
+  }
+  if (state(b) != saved)
+  {
+    fprintf(stderr, "%04X: version 1 state loaded differently\n", mode);
+    return false;
+  }
+  run(a, 30, 30);
+  run(b, 30, 30);
+  if (state(b) != state(a))
+  {
+    fprintf(stderr, "%04X: version 1 state runs differently\n", mode);
+    return false;
+  }
+  return true;
+}
+
+bool test_rejects()
+{
+  bool pass = true;
+  std::vector<uint8_t> rom = test_rom(0x00fe);
+  Chip8 a;
+  load(a, rom, 1);
+  run(a, 0, 30);
+  std::vector<uint8_t> good = state(a);
+
+  Chip8 b;
+  load(b, rom, 2);
+  run(b, 0, 10);
+  std::vector<uint8_t> before = state(b);
+
+  struct Bad
+  {
+    const char *name;
+    std::vector<uint8_t> data;
+  };
+  std::vector<Bad> bad(6, Bad{"", good});
+  bad[0].name = "truncated";
+  bad[0].data.pop_back();
+  bad[1].name = "overlong";
+  bad[1].data.push_back(0);
+  bad[2].name = "truncated header";
+  bad[2].data.resize(6);
+  bad[3].name = "bad magic";
+  bad[3].data[0] = 'X';
+  bad[4].name = "unknown version";
+  bad[4].data[4] = 3;
+  bad[5].name = "zero RNG state";
+  memset(&bad[5].data[40], 0, 4);
+  for (auto &s : bad)
+  {
+    if (b.load_state(s.data.data(), s.data.size()))
+    {
+      fprintf(stderr, "%s state accepted\n", s.name);
+      pass = false;
+    }
+    else if (state(b) != before)
+    {
+      fprintf(stderr, "%s state changed the machine\n", s.name);
+      pass = false;
+    }
+  }
+  return pass;
+}
+
+bool test_checkpoint()
+{
+  bool pass = true;
+  std::vector<uint8_t> rom = test_rom(0x00ff);
+  Chip8 c;
+  load(c, rom, 1);
+  run(c, 0, 10);
+  c.set_base();
+  run(c, 10, 20);
+  Chip8::Checkpoint cp;
+  c.checkpoint(cp);
+  run(c, 30, 20);
+  std::vector<uint8_t> expected = state(c);
+
+  run(c, 50, 20);
+  if (!c.restore(cp))
+  {
+    fprintf(stderr, "Checkpoint rejected\n");
+    return false;
+  }
+  run(c, 30, 20);
+  if (state(c) != expected)
+  {
+    fprintf(stderr, "Restored checkpoint runs differently\n");
+    pass = false;
+  }
+
+  cp.rng = 0;
+  if (c.restore(cp))
+  {
+    fprintf(stderr, "Checkpoint with a zero RNG state accepted\n");
+    pass = false;
+  }
+  else if (state(c) != expected)
+  {
+    fprintf(stderr, "Checkpoint with a zero RNG state changed the machine\n");
+    pass = false;
+  }
+  return pass;
+}
+
+bool test_movie(const std::string &dir)
+{
+  bool pass = true;
+  std::string path = dir + "/state-test.c8m";
+  std::vector<uint8_t> rom = test_rom(0x00fe);
+  const unsigned int frames = 200;
+
+  Chip8 a;
+  load(a, rom, 1);
+  {
+    MovieWriter writer(path.c_str(), a, 1, 50);
+    a.recorder = &writer;
+    run(a, 0, 90);
+    a.reset_requested = true; // Resets go in the movie too
+    run(a, 90, frames - 90);
+    a.recorder = nullptr;
+    if (!writer.finish())
+    {
+      fprintf(stderr, "Couldn't write %s\n", path.c_str());
+      return false;
+    }
+  }
+  std::vector<uint8_t> expected = state(a);
+
+  // Played from the start, and from a seek past a keyframe. The keys given
+  // by run() are different, so only the movie's are used.
+  for (unsigned int seek : {0u, 120u})
+  {
+    MoviePlayer player;
+    Chip8 b;
+    load(b, rom, 2);
+    b.instructions_per_step = 1;
+    if (!player.open(path.c_str()) || !player.setup(b))
+      return false;
+    if (player.frames() != frames || (seek && !player.seek(b, seek)))
+    {
+      fprintf(stderr, "Couldn't seek to frame %u of %u\n", seek, player.frames());
+      return false;
+    }
+    b.player = &player;
+    run(b, frames + seek, frames - seek);
+    if (state(b) != expected)
+    {
+      fprintf(stderr, "Movie from frame %u replays differently\n", seek);
+      pass = false;
+    }
+  }
+  return pass;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "Usage: %s WORK_DIR\n", argv[0]);
+    return 1;
+  }
+  bool result = true;
+  for (uint16_t mode : {0x00fe, 0x00ff})
+  {
+    result &= test_round_trip(mode);
+    result &= test_v1(mode);
+  }
+  result &= test_rejects();
+  result &= test_checkpoint();
+  result &= test_movie(argv[1]);
+  if (result)
+  {
+    printf("All state tests passed\n");
+    return 0;
+  }
+  else
+  {
+    printf("State tests failed\n");
+    return 1;
+  }
+}
@@ -0,0 +1,92 @@
+#include "wavaudio.h"
+
+#include <errno.h>
+#include <string.h>
+
+static const unsigned int header_size = 44;
+
+static void put16(uint8_t *p, uint16_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+  for (int i=0; i<4; i++)
+    p[i] = v >> (i*8);
+}
+
+bool WavAudio::open(const char *path)
+{
+  this->path = path;
+  file = fopen(path, "wb");
+  if (!file)
+  {
+    fprintf(stderr, "Can't write '%s': %s\n", path, strerror(errno));
+    return false;
+  }
+  // The sizes are filled in by finish(). A pipe can't be gone back to, so
+  // they're left as large as they go, which players read as "until the
+  // end".
+  seekable = ftell(file) != -1;
+  write_header(seekable ? 0 : UINT32_MAX);
+  return true;
+}
+
+void WavAudio::write_header(uint64_t data_bytes)
+{
+  // A RIFF file's sizes are 32-bit, so a run of more than about three
+  // days is cut short, as far as players are concerned
+  if (data_bytes > UINT32_MAX - header_size)
+    data_bytes = (UINT32_MAX - header_size) & ~(uint64_t)1;
+
+  uint8_t h[header_size];
+  memcpy(h, "RIFF", 4);
+  put32(h + 4, header_size - 8 + data_bytes);
+  memcpy(h + 8, "WAVEfmt ", 8);
+  put32(h + 16, 16);                     // fmt chunk size
+  put16(h + 20, 1);                      // PCM
+  put16(h + 22, 1);                      // Mono
+  put32(h + 24, Tone::sample_rate);
+  put32(h + 28, Tone::sample_rate*2);    // Bytes/sec
+  put16(h + 32, 2);                      // Bytes/sample
+  put16(h + 34, 16);                     // Bits/sample
+  memcpy(h + 36, "data", 4);
+  put32(h + 40, data_bytes);
+  if (fwrite(h, 1, sizeof(h), file) != sizeof(h))
+    ok = false;
+}
+
+void WavAudio::tick(bool on)
+{
+  if (!file)
+    return;
+  tone.render(buffer, on);
+  // WAV samples are little-endian
+  uint8_t bytes[sizeof(buffer)];
+  for (unsigned int i=0; i<Tone::tick_samples; i++)
+    put16(bytes + i*2, buffer[i]);
+  if (fwrite(bytes, 1, sizeof(bytes), file) != sizeof(bytes))
+    ok = false;
+  samples += Tone::tick_samples;
+}
+
+bool WavAudio::finish()
+{
+  if (!file)
+    return ok;
+  if (seekable)
+  {
+    if (fseek(file, 0, SEEK_SET) == 0)
+      write_header(samples*2);
+    else
+      ok = false;
+  }
+  if (fclose(file) != 0)
+    ok = false;
+  file = nullptr;
+  if (!ok)
+    fprintf(stderr, "Error writing '%s'\n", path);
+  return ok;
+}
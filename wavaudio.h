@@ -0,0 +1,42 @@
+#ifndef WAVAUDIO_H
+#define WAVAUDIO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "audio.h"
+
+// Writes the tone to a WAV file, 16-bit mono at 44.1kHz, a tick of samples
+// for every timer tick from the start of the run. The file is as long as
+// the run and each beep starts on the sample its tick does, so with a
+// fixed seed (or a movie) it's reproducible and can be compared between
+// versions like any other output.
+class WavAudio : public Audio
+{
+public:
+  WavAudio() {}
+  ~WavAudio() { finish(); }
+  WavAudio(const WavAudio &) = delete;
+  WavAudio &operator=(const WavAudio &) = delete;
+
+  // Returns false (after printing why) if path can't be written
+  bool open(const char *path);
+
+  void tick(bool on) override;
+
+  // Fill in the header's sizes and close the file. Returns false if any
+  // of it couldn't be written.
+  bool finish();
+
+private:
+  const char *path = nullptr;
+  FILE *file = nullptr;
+  uint64_t samples = 0;
+  bool ok = true;
+  bool seekable = true;
+  Tone tone;
+  int16_t buffer[Tone::tick_samples];
+
+  void write_header(uint64_t data_bytes);
+};
+
+#endif
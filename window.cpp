@@ -0,0 +1,388 @@
+#include "chip8.h"
+#include "scheduler.h"
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#include <atomic>
+#include <thread>
+#endif
+
+#include <string.h>
+
+GLFWwindow *window;
+GLuint shader_program;
+
+// The display, packed, as the emulator last published it. Natively the
+// emulator runs on its own thread and this hands frames to the render
+// thread; under Emscripten both run in turn on the one thread.
+struct Frame
+{
+  // The rows changed by this and the last few publications before it, so
+  // the renderer can upload only those even when it skipped some
+  static const unsigned int history = 4;
+
+  uint8_t bits[Chip8::display_bytes];
+  uint64_t serial; // Publications before this one
+  unsigned int first[history], last[history]; // Newest first, as [first, last)
+};
+TripleBuffer<Frame> frames;
+
+void key_callback(GLFWwindow *window, int key, int scancode, int action, int mode);
+
+// The display is always the same size, so its texture is allocated once
+static void create_display_texture(unsigned int width, unsigned int height)
+{
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+#ifdef __EMSCRIPTEN__
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, height, 0,
+               GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
+#else
+  // A single channel, the same format as the pixels uploaded into it, read
+  // back as grey
+  if (GLEW_ARB_texture_storage)
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, width, height);
+  else
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0,
+                 GL_RED, GL_UNSIGNED_BYTE, NULL);
+  GLint swizzle[] = {GL_RED, GL_RED, GL_RED, GL_ONE};
+  glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+#endif
+}
+
+// Run a tick, publishing the display if it changed
+static void emulate_frame(Chip8 *chip8, Scheduler &schedule)
+{
+  unsigned int per_step = chip8->instructions_per_step;
+  unsigned int per_second = chip8->instructions_per_second;
+  unsigned int n = schedule.tick(per_second ? per_second : per_step*Scheduler::tick_rate);
+  // A stopped machine waits for a reset; say why once
+  if (chip8->begin_frame() && chip8->status == Chip8::Status::Running &&
+      chip8->step(n) != Chip8::Status::Running)
+    chip8->print_status();
+  static uint64_t serial = 0;
+  static unsigned int first[Frame::history], last[Frame::history];
+  unsigned int f, l;
+  if (chip8->take_display_changes(f, l))
+  {
+    memmove(first + 1, first, sizeof(first) - sizeof(first[0]));
+    memmove(last + 1, last, sizeof(last) - sizeof(last[0]));
+    first[0] = f;
+    last[0] = l;
+
+    // The whole display is packed, since the slot holds a frame from a
+    // few publications ago
+    Frame &frame = frames.back();
+    chip8->get_display_bits(frame.bits);
+    frame.serial = serial++;
+    memcpy(frame.first, first, sizeof(first));
+    memcpy(frame.last, last, sizeof(last));
+    frames.publish();
+  }
+}
+
+// Copy the rows of the newest frame that changed since the one shown into
+// the texture. Returns false if there's no new frame, leaving the texture as
+// it was.
+static bool upload_display()
+{
+  const Frame *frame = frames.read();
+  if (!frame)
+    return false;
+
+  const unsigned int w = Chip8::display_width;
+  const unsigned int h = Chip8::display_height;
+  const unsigned int row_bytes = w/8;
+  static uint64_t shown = 0;    // Serial of the frame after the one shown
+  static bool uploaded = false; // The texture starts out undefined
+  unsigned int first = 0, last = h;
+  uint64_t published = frame->serial + 1 - shown; // Since the one shown
+  if (uploaded && published <= Frame::history)
+  {
+    first = frame->first[0];
+    last = frame->last[0];
+    for (unsigned int i=1; i<published; i++)
+    {
+      first = frame->first[i] < first ? frame->first[i] : first;
+      last = frame->last[i] > last ? frame->last[i] : last;
+    }
+  }
+  shown = frame->serial + 1;
+  uploaded = true;
+
+  static uint8_t pixels[Chip8::max_display_pixels];
+  for (unsigned int i=first*row_bytes; i<last*row_bytes; i++)
+  {
+    for (unsigned int b=0; b<8; b++)
+      pixels[i*8 + b] = (frame->bits[i] >> (7 - b)) & 1 ? 0xff : 0;
+  }
+
+#ifdef __EMSCRIPTEN__
+  GLenum format = GL_LUMINANCE;
+#else
+  GLenum format = GL_RED;
+#endif
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, w, last - first,
+                  format, GL_UNSIGNED_BYTE, pixels + first*w);
+  return true;
+}
+
+// Draw the display if it changed. Returns false if it didn't, in which case
+// there's nothing to swap: the window keeps showing the last frame drawn.
+static bool render_frame()
+{
+  if (!upload_display())
+    return false;
+  glClear(GL_COLOR_BUFFER_BIT);
+  glDrawArrays(GL_TRIANGLES, 0, 6);
+  return true;
+}
+
+#ifdef __EMSCRIPTEN__
+// Called at the display's refresh rate, which may be 144Hz or more, so it
+// runs however many ticks have come due, often none, a batch at a time
+void run_frame(void *c8)
+{
+  static Scheduler schedule;
+  for (unsigned int n = schedule.due(); n > 0; n--)
+    emulate_frame(static_cast<Chip8 *>(c8), schedule);
+  render_frame();
+}
+#endif
+
+void Chip8::run()
+{
+  //
+  // Set up window
+  //
+  unsigned int screenWidth  = width * scaleFactor;
+  unsigned int screenHeight = height * scaleFactor;
+  if (!glfwInit()) {
+    fprintf(stderr, "Failed to initialise GLFW\n");
+    abort();
+  }
+
+  glfwWindowHint(GLFW_SAMPLES, 4);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
+
+  window = glfwCreateWindow(screenWidth, screenHeight, "Chip8 Emulator", NULL, NULL);
+  if (window == NULL) {
+    fprintf(stderr, "Failed to open window.\n");
+    glfwTerminate();
+    abort();
+  }
+  glfwMakeContextCurrent(window);
+  glfwSetWindowUserPointer(window, this);
+  glfwSetKeyCallback(window, key_callback);
+
+  glewExperimental = true;
+  if (glewInit() != GLEW_OK) {
+    fprintf(stderr, "Failed to initialise GLEW.\n");
+    abort();
+  }
+
+  //
+  // OpenGL settings
+  //
+  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+
+  //
+  // Shaders
+  //
+  const GLchar *vertex_shader_source =
+    "attribute vec2 position;"
+    "attribute vec2 texCoord;"
+    "varying vec2 TexCoord;"
+    "void main()"
+    "{"
+    "  gl_Position = vec4(position, 0.0, 1.0);"
+    "  TexCoord = texCoord;"
+    "}";
+
+  const GLchar *fragment_shader_source =
+#ifdef __EMSCRIPTEN__
+    "precision mediump float;"
+#endif
+    "varying vec2 TexCoord;"
+    "uniform sampler2D display;"
+    "void main()"
+    "{"
+    "  gl_FragColor = texture2D(display, TexCoord);"
+    "}";
+
+  GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(vertex_shader, 1, &vertex_shader_source, NULL);
+  glCompileShader(vertex_shader);
+  GLint status;
+  glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &status);
+  if (!status)
+  {
+    char error_buffer[512];
+    glGetShaderInfoLog(vertex_shader, 512, NULL, error_buffer);
+    fprintf(stderr, "Vertex shader error:\n%s\n", error_buffer);
+    abort();
+  }
+
+  GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(fragment_shader, 1, &fragment_shader_source, NULL);
+  glCompileShader(fragment_shader);
+  glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &status);
+  if (!status)
+  {
+    char error_buffer[512];
+    glGetShaderInfoLog(fragment_shader, 512, NULL, error_buffer);
+    fprintf(stderr, "Fragment shader error:\n%s\n", error_buffer);
+    abort();
+  }
+
+  shader_program = glCreateProgram();
+  glAttachShader(shader_program, vertex_shader);
+  glAttachShader(shader_program, fragment_shader);
+  glLinkProgram(shader_program);
+  glGetProgramiv(shader_program, GL_LINK_STATUS, &status);
+  if (!status)
+  {
+    char error_buffer[512];
+    glGetProgramInfoLog(shader_program, 512, NULL, error_buffer);
+    fprintf(stderr, "Shader link error:\n%s\n", error_buffer);
+    abort();
+  }
+  glUseProgram(shader_program);
+  glUniform1i(glGetUniformLocation(shader_program, "display"), 0);
+
+  //
+  // Buffers
+  //
+  GLfloat display_vertices[] = {
+    // Pos          Tex
+   -1.0f,-1.0f,  0.0f, 1.0f,
+   -1.0f, 1.0f,  0.0f, 0.0f,
+    1.0f,-1.0f,  1.0f, 1.0f,
+    1.0f, 1.0f,  1.0f, 0.0f,
+    1.0f,-1.0f,  1.0f, 1.0f,
+   -1.0f, 1.0f,  0.0f, 0.0f,
+  };
+
+  GLuint vao, vbo;
+  glGenVertexArrays(1, &vao);
+  glGenBuffers(1, &vbo);
+
+  glBindVertexArray(vao);
+
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(display_vertices), display_vertices, GL_STATIC_DRAW);
+
+  // Position attribute
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat), 0);
+  glEnableVertexAttribArray(0);
+
+  // TexCoord attribute
+  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat), (GLvoid*)(2*sizeof(GLfloat)));
+  glEnableVertexAttribArray(1);
+
+  //
+  // Texture
+  //
+  create_display_texture(extWidth, extHeight);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+  //
+  // Audio
+  //
+  // Started here rather than when the tone first sounds, so the emulator
+  // thread never waits on it. Its own thread opens the device, and only
+  // once the tone sounds.
+  if (!audio && !muted)
+  {
+    device.reset(new DeviceAudio());
+    audio = device.get();
+  }
+
+#ifdef __EMSCRIPTEN__
+  emscripten_set_main_loop_arg(run_frame, this, 0, 1);
+#else
+  // The emulator runs on its own thread, on a Scheduler, so a slow swap or
+  // a monitor at another refresh rate doesn't change its speed
+  std::atomic<bool> quit{false};
+  std::thread emulator([this, &quit]
+  {
+    Scheduler schedule;
+    while (!quit)
+    {
+      for (unsigned int n = schedule.due(); n > 0; n--)
+        emulate_frame(this, schedule);
+      schedule.wait();
+    }
+  });
+
+  // Without a swap to wait on vsync, an unchanged display polls for input
+  // and new frames a few times a tick
+  while (!glfwWindowShouldClose(window))
+  {
+    if (render_frame())
+    {
+      glfwSwapBuffers(window);
+      glfwPollEvents();
+    }
+    else
+      glfwWaitEventsTimeout(1.0 / (4*Scheduler::tick_rate));
+  }
+  quit = true;
+  emulator.join();
+#endif
+}
+
+void key_callback(GLFWwindow *window, int key, int scancode, int action, int mode)
+{
+  // This runs on the render thread, so input goes to the emulator through
+  // its queue rather than being written straight into it
+  Chip8 *chip8 = (Chip8 *)glfwGetWindowUserPointer(window);
+  if (action == GLFW_REPEAT)
+    return;
+  Chip8::Input in = {Chip8::Input::Key, 0, action == GLFW_PRESS};
+  switch (key)
+  {
+    case GLFW_KEY_1: in.key = 0x1; break;
+    case GLFW_KEY_2: in.key = 0x2; break;
+    case GLFW_KEY_3: in.key = 0x3; break;
+    case GLFW_KEY_4: in.key = 0xc; break;
+    case GLFW_KEY_Q: in.key = 0x4; break;
+    case GLFW_KEY_W: in.key = 0x5; break;
+    case GLFW_KEY_E: in.key = 0x6; break;
+    case GLFW_KEY_R: in.key = 0xd; break;
+    case GLFW_KEY_A: in.key = 0x7; break;
+    case GLFW_KEY_S: in.key = 0x8; break;
+    case GLFW_KEY_D: in.key = 0x9; break;
+    case GLFW_KEY_F: in.key = 0xe; break;
+    case GLFW_KEY_Z: in.key = 0xa; break;
+    case GLFW_KEY_X: in.key = 0x0; break;
+    case GLFW_KEY_C: in.key = 0xb; break;
+    case GLFW_KEY_V: in.key = 0xf; break;
+    case GLFW_KEY_ENTER:
+      // Applied at the start of the next frame, so it can be recorded
+      if (!in.pressed)
+        return;
+      in.type = Chip8::Input::Reset;
+      break;
+    case GLFW_KEY_BACKSPACE:
+      // Held down, goes back a frame every frame
+      in.type = Chip8::Input::Rewind;
+      break;
+    default:
+      return;
+  }
+  chip8->input.push(in);
+}